@@ -0,0 +1,797 @@
+# $File: evloop.py
+# $Author: Jiakai <jia.kai66@gmail.com>
+#
+# This file is part of orzoj
+#
+# Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+#
+# Orzoj is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Orzoj is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""an event loop running coroutines in one thread, so that many connections
+can be served without a thread for each of them
+
+a coroutine is a generator, which may yield
+    a Future -- to wait until it is done; the result is sent back,
+                or the exception is raised in the coroutine
+    another coroutine -- to run it and get its return value
+    Return(value) -- to return @value (since a generator can not return
+                a value in python 2)
+
+blocking jobs (computing checksums, requests to orzoj-web, etc.) should be
+run by run_in_thread(), which runs them in a pool of worker threads"""
+
+import select, os, sys, time, heapq, threading, errno, types, traceback
+import Queue
+from collections import deque
+
+from orzoj import snc, log, mux, zstream
+
+try:
+    import fcntl
+except ImportError:
+    fcntl = None
+
+_POLL_MAX_WAIT = 1
+# the loop wakes up at least once every this number of seconds,
+# so that the stop condition is checked
+
+_RECV_SIZE = 1024 * 64
+_SEND_SIZE = 1024 * 64
+
+_ready = deque()
+# deque of tuple(<func>, <args>) to be called in the next iteration
+_timers = list()
+# heap of timer entries [<time>, <seq>, <func>, <args>, <cancelled>]
+_timer_seq = 0
+_handlers = dict()
+# dict of <file descriptor> => <function called with the events>
+_threadsafe = deque()
+# deque of tuple(<func>, <args>) added by other threads
+_poller = None
+_wake_fd = None
+_jobs = Queue.Queue()
+# tuple(<future>, <func>, <args>) for the worker threads, None to stop one
+_workers = list()
+_loop_thread = None
+
+if hasattr(select, "epoll"):
+    EV_READ = select.EPOLLIN
+    EV_WRITE = select.EPOLLOUT
+    EV_ERROR = select.EPOLLERR | select.EPOLLHUP
+else:
+    EV_READ = select.POLLIN
+    EV_WRITE = select.POLLOUT
+    EV_ERROR = select.POLLERR | select.POLLHUP
+
+
+class Return:
+    def __init__(self, value = None):
+        self.value = value
+
+
+class Future:
+    def __init__(self):
+        """a result which will be available later; callbacks are called
+        in the loop thread, with the future as the only argument"""
+        self.done = False
+        self._value = None
+        self._exc_info = None
+        self._callbacks = list()
+
+    def set_result(self, value = None):
+        if self.done:
+            return
+        self.done = True
+        self._value = value
+        self._schedule()
+
+    def set_error(self, e, exc_info = None):
+        """@exc_info is the tuple returned by sys.exc_info(), to keep the
+        traceback; if it is None, @e is raised without one"""
+        if self.done:
+            return
+        self.done = True
+        if exc_info is None:
+            exc_info = (type(e), e, None)
+        self._exc_info = exc_info
+        self._schedule()
+
+    def result(self):
+        """return the result, or raise the exception"""
+        if self._exc_info:
+            raise self._exc_info[0], self._exc_info[1], self._exc_info[2]
+        return self._value
+
+    def add_callback(self, func):
+        if self.done:
+            call_soon(func, self)
+        else:
+            self._callbacks.append(func)
+
+    def _schedule(self):
+        for func in self._callbacks:
+            call_soon(func, self)
+        self._callbacks = None
+
+
+class _Task:
+    def __init__(self, coro, name):
+        self.future = Future()
+        self._stack = [coro]
+        self._name = name
+        call_soon(self._step, None, None)
+
+    def _resume(self, fut):
+        if fut._exc_info:
+            self._step(None, fut._exc_info)
+        else:
+            self._step(fut._value, None)
+
+    def _step(self, value, exc_info):
+        stack = self._stack
+        while True:
+            gen = stack[-1]
+            try:
+                if exc_info:
+                    (t, v, tb) = exc_info
+                    exc_info = None
+                    y = gen.throw(t, v, tb)
+                else:
+                    y = gen.send(value)
+            except StopIteration:
+                y = Return()
+            except Exception:
+                stack.pop()
+                exc_info = sys.exc_info()
+                if not stack:
+                    self.future.set_error(exc_info[1], exc_info)
+                    return
+                continue
+
+            if isinstance(y, Return):
+                stack.pop().close()
+                if not stack:
+                    self.future.set_result(y.value)
+                    return
+                value = y.value
+            elif isinstance(y, types.GeneratorType):
+                stack.append(y)
+                value = None
+            elif isinstance(y, Future):
+                if not y.done:
+                    y.add_callback(self._resume)
+                    return
+                if y._exc_info:
+                    exc_info = y._exc_info
+                else:
+                    value = y._value
+            else:
+                exc_info = (TypeError, TypeError("coroutine {0!r} yielded {1!r}" .
+                    format(self._name, y)), None)
+
+
+def spawn(coro, name = None):
+    """run the coroutine @coro, and return a Future of its return value"""
+    return _Task(coro, name).future
+
+def call_soon(func, *args):
+    _ready.append((func, args))
+
+def call_later(delay, func, *args):
+    """call @func after @delay seconds, return a handle for cancel_timer()"""
+    global _timers, _timer_seq
+    entry = [time.time() + delay, _timer_seq, func, args, False]
+    _timer_seq += 1
+    heapq.heappush(_timers, entry)
+    return entry
+
+def cancel_timer(handle):
+    if handle is not None:
+        handle[4] = True
+
+def call_threadsafe(func, *args):
+    """like call_soon, but can be called from any thread"""
+    _threadsafe.append((func, args))
+    if threading.current_thread() is not _loop_thread:
+        try:
+            os.write(_wake_fd, "w")
+        except OSError as e:
+            if e.errno != errno.EAGAIN:
+                raise
+
+def sleep(delay):
+    """return a Future done after @delay seconds"""
+    fut = Future()
+    call_later(delay, fut.set_result)
+    return fut
+
+def wait(fut, interval, tick):
+    """a coroutine waiting until the Future @fut is done and returning its
+    result, calling @tick() every @interval seconds meanwhile"""
+    wake = [None]
+    def _on_done(f):
+        if wake[0]:
+            wake[0].set_result()
+    fut.add_callback(_on_done)
+    while not fut.done:
+        wake[0] = Future()
+        timer = call_later(interval, wake[0].set_result)
+        yield wake[0]
+        cancel_timer(timer)
+        if not fut.done:
+            tick()
+    yield Return(fut.result())
+
+def run_in_thread(func, *args):
+    """run @func(*args) in a worker thread and return a Future of the result"""
+    fut = Future()
+    _jobs.put((fut, func, args))
+    return fut
+
+def add_handler(fd, events, func):
+    """call @func(<events>) in the loop when @fd has @events,
+    which is a combination of EV_READ and EV_WRITE"""
+    _handlers[fd] = func
+    _poller.register(fd, events)
+
+def modify_handler(fd, events):
+    _poller.modify(fd, events)
+
+def remove_handler(fd):
+    if _handlers.pop(fd, None) is not None:
+        _poller.unregister(fd)
+
+def init(nworker):
+    """prepare the loop, with @nworker worker threads for run_in_thread"""
+    global _poller, _wake_fd, _workers
+    if hasattr(select, "epoll"):
+        _poller = select.epoll()
+    else:
+        _poller = _Poll()
+    (rfd, _wake_fd) = os.pipe()
+    for fd in (rfd, _wake_fd):
+        fcntl.fcntl(fd, fcntl.F_SETFL, fcntl.fcntl(fd, fcntl.F_GETFL) | os.O_NONBLOCK)
+    add_handler(rfd, EV_READ, lambda events: _drain_wake_fd(rfd))
+    for i in range(nworker - len(_workers)):
+        th = threading.Thread(target = _run_worker, name = "evloop._run_worker")
+        th.start()
+        _workers.append(th)
+
+def stop():
+    """stop the worker threads after the jobs already added are done,
+    and wait for them to exit"""
+    global _workers
+    for th in _workers:
+        _jobs.put(None)
+    for th in _workers:
+        th.join()
+    _workers = list()
+
+def run(test_stop):
+    """run the loop in the current thread until @test_stop() returns True,
+    which is checked at least once every _POLL_MAX_WAIT seconds"""
+    global _loop_thread, _timers
+    _loop_thread = threading.current_thread()
+    while not test_stop():
+        while _threadsafe:
+            _ready.append(_threadsafe.popleft())
+
+        if _ready:
+            timeout = 0
+        elif _timers:
+            timeout = min(max(_timers[0][0] - time.time(), 0), _POLL_MAX_WAIT)
+        else:
+            timeout = _POLL_MAX_WAIT
+
+        try:
+            events = _poller.poll(timeout)
+        except (IOError, select.error) as e:
+            if e.args[0] != errno.EINTR:
+                raise
+            events = ()
+        for (fd, ev) in events:
+            func = _handlers.get(fd)
+            if func is not None:
+                _call(func, (ev, ))
+
+        now = time.time()
+        while _timers and _timers[0][0] <= now:
+            entry = heapq.heappop(_timers)
+            if not entry[4]:
+                _ready.append((entry[2], entry[3]))
+
+        for i in range(len(_ready)):
+            (func, args) = _ready.popleft()
+            _call(func, args)
+
+def _call(func, args):
+    try:
+        func(*args)
+    except Exception as e:
+        log.error("uncaught exception in event loop: {0!r}" . format(e))
+        log.debug(traceback.format_exc())
+
+def _drain_wake_fd(fd):
+    try:
+        while os.read(fd, 4096):
+            pass
+    except OSError as e:
+        if e.errno != errno.EAGAIN:
+            raise
+
+def _run_worker():
+    while True:
+        job = _jobs.get()
+        if job is None:
+            return
+        (fut, func, args) = job
+        try:
+            ret = func(*args)
+        except Exception as e:
+            call_threadsafe(fut.set_error, e, sys.exc_info())
+        else:
+            call_threadsafe(fut.set_result, ret)
+
+
+class _Poll:
+    """select.poll with the interface of select.epoll"""
+    def __init__(self):
+        self._poll = select.poll()
+
+    def register(self, fd, events):
+        self._poll.register(fd, events)
+
+    def modify(self, fd, events):
+        self._poll.modify(fd, events)
+
+    def unregister(self, fd):
+        self._poll.unregister(fd)
+
+    def poll(self, timeout):
+        return self._poll.poll(timeout * 1000)
+
+
+class _Reader:
+    heartbeat_interval = 0.5
+    last_msg_time = 0
+    # see snc.snc
+
+    def __init__(self):
+        """a buffer of received data, read by one coroutine at a time"""
+        self._rbuf = deque()
+        self._rbuf_len = 0
+        self._req = None
+        # tuple(<size>, <future>, <timer>) of the read in progress
+        self._error = None
+
+    def read(self, size, timeout = 0):
+        """return a Future of exactly @size bytes; @timeout has the same
+        meaning as in snc.snc.read, and snc.Error is raised on timeout
+        or network error"""
+        fut = Future()
+        if size <= self._rbuf_len:
+            fut.set_result(self._take(size))
+        elif self._error:
+            fut.set_error(snc.Error())
+        else:
+            timer = None
+            if timeout >= 0:
+                timer = call_later(timeout + snc.network_timeout(), self._timed_out)
+            self._req = (size, fut, timer)
+        return fut
+
+    def read_uint32(self, timeout = 0):
+        """a coroutine returning an unsigned 32-bit integer"""
+        data = yield self.read(4, timeout)
+        yield Return(snc._UINT32.unpack(data)[0])
+
+    def read_str(self, timeout = 0):
+        """a coroutine returning a string"""
+        size = yield self.read_uint32(timeout)
+        data = yield self.read(size, timeout)
+        yield Return(data)
+
+    def _feed(self, data):
+        self._rbuf.append(data)
+        self._rbuf_len += len(data)
+        req = self._req
+        if req and req[0] <= self._rbuf_len:
+            self._req = None
+            cancel_timer(req[2])
+            req[1].set_result(self._take(req[0]))
+
+    def _fail(self):
+        self._error = True
+        req = self._req
+        if req:
+            self._req = None
+            cancel_timer(req[2])
+            req[1].set_error(snc.Error())
+
+    def _timed_out(self):
+        req = self._req
+        self._req = None
+        log.error("failed to read [len={0}]: timed out" . format(req[0]))
+        req[1].set_error(snc.Error())
+        self._on_timeout()
+
+    def _on_timeout(self):
+        pass
+
+    def _take(self, size):
+        buf = self._rbuf
+        ret = list()
+        n = size
+        while n:
+            s = buf.popleft()
+            if len(s) > n:
+                buf.appendleft(s[n:])
+                s = s[:n]
+            ret.append(s)
+            n -= len(s)
+        self._rbuf_len -= size
+        self._on_consumed()
+        if len(ret) == 1:
+            return ret[0]
+        return "".join(ret)
+
+    def _on_consumed(self):
+        pass
+
+
+class Conn(_Reader):
+    def __init__(self, sock):
+        """serve the accepted socket @sock (returned by snc.socket.accept)
+        as the server side of an snc connection in the loop;
+        writing never blocks: data are buffered and sent when the socket is
+        writable, and drain() can be used to wait until they are sent"""
+        _Reader.__init__(self)
+        self._sock = sock
+        self._snc = snc.snc(sock, True, nonblock = True)
+        self._fd = self._snc.fileno()
+        self._handshake = Future()
+        self._wbuf = deque()
+        self._wbuf_len = 0
+        self._wcur = None
+        # the data being sent, which must be sent again unchanged
+        # after ErrorWantWrite or ErrorWantRead
+        self._want_write = False
+        # whether the SSL connection is waiting for the socket to
+        # become writable to go on reading or with the handshake
+        self._events = None
+        self._wtimer = None
+        # to fail if nothing can be written for snc.network_timeout() seconds
+        self._drain = list()
+        # list of tuple(<size>, <future>) from drain()
+        self._streams = None
+        # dict of <stream id> => <Stream> in multiplexed mode
+        self._paused = False
+        # whether reading is paused because a stream has too much data
+        self._zenc = None
+        self._zdec = None
+        # zstream.Encoder and zstream.Decoder if messages are compressed
+        self._zbuf = list()
+        self._zbuf_len = 0
+        # data to be compressed in the next frame
+        add_handler(self._fd, EV_READ, self._on_event)
+        self._pump()
+
+    def handshake(self):
+        """return a Future done when the SSL handshake is done"""
+        return self._handshake
+
+    def write(self, data, timeout = 0):
+        self._write(data)
+        self._end_frame()
+        self._pump()
+
+    def write_buffered(self, data, timeout = 0):
+        self._write(data)
+        if self._zbuf_len >= zstream._FRAME_FLUSH_SIZE:
+            self._end_frame()
+
+    def write_frame(self, parts, timeout = 0):
+        for i in parts:
+            self._write(i)
+        self._end_frame()
+        self._pump()
+
+    def flush(self, timeout = 0):
+        self._end_frame()
+        self._pump()
+
+    def write_uint32(self, val, timeout = 0):
+        self.write(snc.pack_uint32(val))
+
+    def write_str(self, data, timeout = 0):
+        self.write(snc.pack_str(data))
+
+    def drain(self, size = 0):
+        """return a Future done when at most @size bytes are waiting to
+        be sent"""
+        self._end_frame()
+        self._pump()
+        fut = Future()
+        if self._error:
+            fut.set_error(snc.Error())
+        elif self._wbuf_len <= size:
+            fut.set_result()
+        else:
+            self._drain.append((size, fut))
+        return fut
+
+    def begin_mux(self, nstream):
+        """switch to multiplexed mode (see mux.py) after msg.MUX_BEGIN is
+        sent, return the list of streams numbered from 1 to @nstream, which
+        have the same interface as the connection"""
+        ret = [Stream(self, i + 1) for i in range(nstream)]
+        for s in ret:
+            s.heartbeat_interval = self.heartbeat_interval
+        self._streams = dict((s._sid, s) for s in ret)
+        if self._rbuf_len:
+            data = self._take(self._rbuf_len)
+            self._feed_mux(data)
+        return ret
+
+    def begin_compress(self, method):
+        """compress everything by @method (see zstream.py) after
+        msg.CONNECT_OK choosing it is written"""
+        self._zenc = zstream.Encoder(method)
+        self._zdec = zstream.Decoder(method)
+        if self._rbuf_len:
+            data = self._zdec.feed(self._take(self._rbuf_len))
+            if data:
+                self._feed(data)
+
+    def stop_streams(self):
+        """make every operation on the streams raise snc.Error, while data
+        already written can still be sent"""
+        if self._streams:
+            for s in self._streams.itervalues():
+                s._fail()
+
+    def close(self):
+        """close the connection; data that can not be sent at once
+        are dropped"""
+        if not self._error and self._handshake.done:
+            try:
+                self._end_frame()
+                self._send()
+            except snc.Error:
+                pass
+        remove_handler(self._fd)
+        cancel_timer(self._wtimer)
+        self._fail_all()
+        if self._snc:
+            self._snc.close()
+            self._snc = None
+        self._sock.close()
+
+    def _write(self, data):
+        if self._error:
+            raise snc.Error
+        if not data:
+            return
+        if self._zenc:
+            self._zbuf.append(data)
+            self._zbuf_len += len(data)
+        else:
+            self._wbuf.append(data)
+            self._wbuf_len += len(data)
+
+    def _end_frame(self):
+        """compress the data written since the last frame"""
+        if self._zbuf and not self._error:
+            parts = self._zenc.encode(self._zbuf)
+            self._zbuf = list()
+            self._zbuf_len = 0
+            self._wbuf.extend(parts)
+            self._wbuf_len += sum(len(i) for i in parts)
+
+    def _on_event(self, events):
+        if events & EV_ERROR and not events & EV_READ:
+            self._fail_all()
+            return
+        self._pump()
+
+    def _pump(self):
+        if self._error:
+            return
+        try:
+            if not self._handshake.done:
+                try:
+                    self._snc.do_handshake()
+                except snc.ErrorWantRead:
+                    self._want_write = False
+                except snc.ErrorWantWrite:
+                    self._want_write = True
+                else:
+                    self._want_write = False
+                    self._handshake.set_result()
+
+            if self._handshake.done:
+                self._send()
+                self._recv()
+        except snc.Error:
+            self._fail_all()
+            return
+        self._update_events()
+
+    def _send(self):
+        while self._wcur or self._wbuf:
+            if self._wcur is None:
+                parts = list()
+                n = 0
+                while self._wbuf and n < _SEND_SIZE:
+                    s = self._wbuf.popleft()
+                    parts.append(s)
+                    n += len(s)
+                self._wcur = "".join(parts)
+            try:
+                n = self._snc.send(self._wcur)
+            except (snc.ErrorWantWrite, snc.ErrorWantRead):
+                return
+            self._wbuf_len -= n
+            self._wcur = self._wcur[n:] or None
+            cancel_timer(self._wtimer)
+            self._wtimer = None
+            if self._drain:
+                self._check_drain()
+        self._wbuf_len = 0
+
+    def _recv(self):
+        self._want_write = False
+        while not self._paused:
+            try:
+                data = self._snc.recv(_RECV_SIZE)
+            except snc.ErrorWantRead:
+                return
+            except snc.ErrorWantWrite:
+                self._want_write = True
+                return
+            if not data:
+                raise snc.Error
+            if self._zdec:
+                data = self._zdec.feed(data)
+                if not data:
+                    continue
+            if self._streams is None:
+                self._feed(data)
+            else:
+                self._feed_mux(data)
+
+    def _update_events(self):
+        if self._error:
+            return
+        want_write = self._want_write or self._wcur is not None or bool(self._wbuf)
+        events = EV_WRITE if want_write else 0
+        if not self._paused:
+            events |= EV_READ
+        if events != self._events:
+            self._events = events
+            modify_handler(self._fd, events)
+        if want_write and self._wtimer is None:
+            self._wtimer = call_later(snc.network_timeout(), self._write_timed_out)
+        elif not want_write and self._wtimer is not None:
+            cancel_timer(self._wtimer)
+            self._wtimer = None
+
+    def _check_drain(self):
+        left = list()
+        for (size, fut) in self._drain:
+            if self._wbuf_len <= size:
+                fut.set_result()
+            else:
+                left.append((size, fut))
+        self._drain = left
+
+    def _write_timed_out(self):
+        self._wtimer = None
+        log.error("failed to write: timed out")
+        self._fail_all()
+
+    def _on_timeout(self):
+        self._fail_all()
+
+    def _fail_all(self):
+        if self._error:
+            return
+        self._fail()
+        for (size, fut) in self._drain:
+            fut.set_error(snc.Error())
+        self._drain = list()
+        if self._streams:
+            for s in self._streams.itervalues():
+                s._fail()
+        remove_handler(self._fd)
+
+    def _feed_mux(self, data):
+        """split @data into frames of the streams"""
+        _Reader._feed(self, data)
+        hsize = mux._HEADER.size
+        while self._rbuf_len >= hsize:
+            head = self._take(hsize)
+            (sid, size) = mux._HEADER.unpack(head)
+            if self._rbuf_len < size:
+                self._rbuf.appendleft(head)
+                self._rbuf_len += hsize
+                break
+            data = self._take(size) if size else ""
+            s = self._streams.get(sid)
+            if s is None:
+                log.warning("data received for unknown stream {0}" . format(sid))
+                continue
+            s._feed(data)
+            if s._rbuf_len > mux._BUF_MAX:
+                self._paused = True
+
+    def _resume_reading(self):
+        if self._paused and all(s._rbuf_len <= mux._BUF_MAX
+                for s in self._streams.itervalues()):
+            self._paused = False
+            call_soon(self._pump)
+
+
+class Stream(_Reader):
+    def __init__(self, conn, sid):
+        """a stream of a connection in multiplexed mode"""
+        _Reader.__init__(self)
+        self._conn = conn
+        self._sid = sid
+        self._wbuf = list()
+        self._wbuf_len = 0
+
+    def write(self, data, timeout = 0):
+        self.write_frame([data])
+
+    def write_buffered(self, data, timeout = 0):
+        self._wbuf.append(data)
+        self._wbuf_len += len(data)
+        if self._wbuf_len >= mux._FRAME_FLUSH_SIZE:
+            self.flush()
+
+    def write_frame(self, parts, timeout = 0):
+        self._wbuf.extend(parts)
+        self.flush()
+
+    def flush(self, timeout = 0):
+        if self._error:
+            raise snc.Error
+        if self._wbuf:
+            parts = self._wbuf
+            self._wbuf = list()
+            self._wbuf_len = 0
+            size = sum(len(i) for i in parts)
+            self._conn.write_frame([mux._HEADER.pack(self._sid, size)] + parts)
+
+    def write_uint32(self, val, timeout = 0):
+        self.write(snc.pack_uint32(val))
+
+    def write_str(self, data, timeout = 0):
+        self.write(snc.pack_str(data))
+
+    def drain(self, size = 0):
+        self.flush()
+        return self._conn.drain(size)
+
+    def read(self, size, timeout = 0):
+        self.flush()
+        return _Reader.read(self, size, timeout)
+
+    def _on_timeout(self):
+        self._conn._fail_all()
+
+    def _on_consumed(self):
+        self._conn._resume_reading()
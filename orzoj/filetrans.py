@@ -24,9 +24,12 @@
 
 import datetime, hashlib, os.path
 
-from orzoj import log, msg, snc
+from orzoj import log, msg, snc, evloop
 
 _PACKET_SIZE = 1024 * 16
+_ASYNC_BUF_SIZE = 1024 * 256
+# send_async waits until at most this number of bytes are not sent yet
+# before reading more of the file
 _OFTP_VERSION = 0x0f000001
 
 # orzoj file transfer protocol (OFTP) :
@@ -66,8 +69,8 @@ def send(fpath, conn):
     """send the file at @fpath, return the speed in kb/s
     OFTPError may be raised"""
 
-    def _write_msg(m):
-        msg.write_msg(conn, m)
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
 
     def _read_msg():
         return msg.read_msg(conn)
@@ -99,7 +102,7 @@ def send(fpath, conn):
                     psize -= s - fsize
                 buf = fptr.read(psize)
                 sha_ctx.update(buf)
-                conn.write(buf)
+                conn.write_buffered(buf)
             _write_msg(msg.OFTP_END)
             _check_msg(msg.OFTP_END)
 
@@ -119,12 +122,70 @@ def send(fpath, conn):
         log.warning("failed to transfer file because of network error.")
         raise OFTPError
 
+def send_async(fpath, conn):
+    """like send, but a coroutine for evloop, where @conn is an evloop.Conn
+    or evloop.Stream"""
+
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
+
+    def _check_msg(m):
+        if m != (yield conn.read_uint32()):
+            log.warning("message check error.")
+            raise OFTPError
+
+    try:
+        time_start = datetime.datetime.now()
+        sha_ctx = hashlib.sha1()
+        fsize = os.path.getsize(fpath)
+        with open(fpath, "rb") as fptr:
+            _write_msg(msg.OFTP_BEGIN)
+            yield _check_msg(msg.OFTP_BEGIN)
+            _write_msg(_OFTP_VERSION)
+            if (yield conn.read_uint32()) != _OFTP_VERSION:
+                log.warning("version check error.")
+                raise OFTPError
+            conn.write_uint32(fsize)
+            yield _check_msg(msg.OFTP_TRANS_BEGIN)
+
+            s = 0
+            while s < fsize:
+                psize = _PACKET_SIZE
+                s += psize
+                if s > fsize:
+                    psize -= s - fsize
+                buf = fptr.read(psize)
+                sha_ctx.update(buf)
+                conn.write_buffered(buf)
+                if s % _ASYNC_BUF_SIZE == 0:
+                    yield conn.drain(_ASYNC_BUF_SIZE)
+            _write_msg(msg.OFTP_END)
+            yield _check_msg(msg.OFTP_END)
+
+            if (yield conn.read(sha_ctx.digest_size)) != sha_ctx.digest():
+                _write_msg(msg.OFTP_CHECK_FAIL)
+            else:
+                _write_msg(msg.OFTP_CHECK_OK)
+
+            speed = fsize / 1024.0 / _td2seconds(datetime.datetime.now() - time_start)
+
+    except EnvironmentError as e:
+        log.error("error while sending file [errno {0}] [filename {1!r}]: {2}" .
+                format(e.errno, e.filename, e.strerror))
+        conn.write_uint32(msg.OFTP_SYSTEM_ERROR)
+        raise OFTPError
+    except snc.Error:
+        log.warning("failed to transfer file because of network error.")
+        raise OFTPError
+
+    yield evloop.Return(speed)
+
 def recv(fpath, conn):
     """receive file and save it at @fpath, return the speed in kb/s
     OFTPError may be raised"""
 
-    def _write_msg(m):
-        msg.write_msg(conn, m)
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
 
     def _read_msg():
         return msg.read_msg(conn)
@@ -136,31 +197,21 @@ def recv(fpath, conn):
 
     try:
         time_start = datetime.datetime.now()
-        sha_ctx = hashlib.sha1()
         with open(fpath, "wb") as fptr:
             _check_msg(msg.OFTP_BEGIN)
-            _write_msg(msg.OFTP_BEGIN)
-            _write_msg(_OFTP_VERSION)
+            _write_msg(msg.OFTP_BEGIN, _OFTP_VERSION)
             if conn.read_uint32() != _OFTP_VERSION:
                 log.warning("version check error.")
                 raise OFTPError
             fsize = conn.read_uint32()
             _write_msg(msg.OFTP_TRANS_BEGIN)
 
-            s = 0
-            while s < fsize:
-                psize = _PACKET_SIZE
-                s += psize
-                if s > fsize:
-                    psize -= s - fsize
-                buf = conn.read(psize)
-                sha_ctx.update(buf)
-                fptr.write(buf)
+            digest = conn.recv_to_file(fptr.fileno(), fsize, "sha1")
 
             _check_msg(msg.OFTP_END)
             _write_msg(msg.OFTP_END)
 
-            conn.write(sha_ctx.digest())
+            conn.write(digest)
             m = _read_msg()
             if m == msg.OFTP_CHECK_OK:
                 return fsize / 1024.0 / _td2seconds(datetime.datetime.now() - time_start)
@@ -0,0 +1,182 @@
+# $File: compile_cache.py
+# $Author: Jiakai <jia.kai66@gmail.com>
+#
+# This file is part of orzoj
+#
+# Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+#
+# Orzoj is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Orzoj is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""cache of compilation results, so that identical sources (e.g. on
+rejudging) are not compiled again
+
+an entry is a directory named by the key, containing the files produced
+by the compiler; entries are evicted in least recently used order when
+the total size exceeds CompileCacheSize"""
+
+import os, os.path, shutil, hashlib, threading
+from collections import OrderedDict
+
+from orzoj import conf, log
+
+_cache_dir = None
+_max_size = None
+
+_lock = threading.Lock()
+_entries = OrderedDict()
+# OrderedDict of <key> => <total size of files>, least recently used first
+_total_size = 0
+_nhit = 0
+_nmiss = 0
+
+def enabled():
+    return _cache_dir is not None
+
+def make_key(*parts):
+    """make a key from @parts, which should be str or (nested) lists or
+    tuples of str and numbers"""
+    return hashlib.sha256(repr(parts)).hexdigest()
+
+def file_identity(path):
+    """return a tuple identifying the file at @path, which changes when
+    the file is replaced or modified, or @path itself if it does not exist"""
+    try:
+        path = os.path.realpath(path)
+        st = os.stat(path)
+        return (path, st.st_dev, st.st_ino, st.st_size, st.st_mtime)
+    except OSError:
+        return path
+
+def get(key, dest_dir):
+    """copy the files of entry @key to @dest_dir and return True,
+    or return False if not found"""
+    global _entries, _nhit, _nmiss
+    with _lock:
+        if key not in _entries:
+            _nmiss += 1
+            log.info("compile cache miss ({0})" . format(_stats()))
+            return False
+        _entries[key] = _entries.pop(key)
+    path = os.path.join(_cache_dir, key)
+    try:
+        for i in os.listdir(path):
+            shutil.copy(os.path.join(path, i), dest_dir)
+        os.utime(path, None)
+    except Exception as e:
+        log.warning("failed to restore compilation result from cache: {0}" . format(e))
+        _remove(key)
+        with _lock:
+            _nmiss += 1
+        return False
+    with _lock:
+        _nhit += 1
+        log.info("compile cache hit ({0})" . format(_stats()))
+    return True
+
+def put(key, src_dir, exclude):
+    """add files in @src_dir (except file names in @exclude) as entry @key;
+    nothing is added if @src_dir contains anything other than regular files"""
+    global _entries, _total_size
+    path = os.path.join(_cache_dir, key)
+    path_tmp = os.path.join(_cache_dir, ".{0}.{1}" . format(key, threading.current_thread().ident))
+    try:
+        files = list()
+        for i in os.listdir(src_dir):
+            p = os.path.join(src_dir, i)
+            if os.path.islink(p) or not os.path.isfile(p):
+                return
+            if i not in exclude:
+                files.append(p)
+        if os.path.isdir(path_tmp):
+            shutil.rmtree(path_tmp)
+        os.mkdir(path_tmp)
+        size = 0
+        for p in files:
+            shutil.copy(p, path_tmp)
+            size += os.path.getsize(p)
+        with _lock:
+            if key in _entries:
+                shutil.rmtree(path_tmp)
+                return
+            os.rename(path_tmp, path)
+            _entries[key] = size
+            _total_size += size
+            victims = list()
+            while _total_size > _max_size and len(_entries) > 1:
+                (k, s) = _entries.popitem(False)
+                _total_size -= s
+                victims.append(k)
+        for k in victims:
+            shutil.rmtree(os.path.join(_cache_dir, k), True)
+    except Exception as e:
+        log.warning("failed to add compilation result to cache: {0}" . format(e))
+        shutil.rmtree(path_tmp, True)
+
+def stats():
+    """return a human readable string of cache statistics"""
+    with _lock:
+        return _stats()
+
+def _stats():
+    return "hit: {0}, miss: {1}, entries: {2}, size: {3} bytes" . format(
+            _nhit, _nmiss, len(_entries), _total_size)
+
+def _remove(key):
+    global _entries, _total_size
+    with _lock:
+        if key in _entries:
+            _total_size -= _entries.pop(key)
+    shutil.rmtree(os.path.join(_cache_dir, key), True)
+
+def _init():
+    """load existing entries, in the order of last use"""
+    global _entries, _total_size
+    if _cache_dir is None:
+        return
+    ent = list()
+    for i in os.listdir(_cache_dir):
+        p = os.path.join(_cache_dir, i)
+        if i.startswith('.'):
+            shutil.rmtree(p, True)
+            continue
+        try:
+            size = sum(os.path.getsize(os.path.join(p, j)) for j in os.listdir(p))
+            ent.append((os.path.getmtime(p), i, size))
+        except Exception as e:
+            log.warning("removing bad compile cache entry {0!r}: {1}" . format(i, e))
+            shutil.rmtree(p, True)
+    ent.sort()
+    for (t, k, s) in ent:
+        _entries[k] = s
+        _total_size += s
+    while _total_size > _max_size and _entries:
+        _remove(next(iter(_entries)))
+
+def _set_cache_dir(arg):
+    if len(arg) == 1:
+        return
+    global _cache_dir
+    _cache_dir = arg[1]
+    if not os.path.isdir(_cache_dir):
+        raise conf.UserError("path {0!r} is not a directory" . format(_cache_dir))
+
+def _set_max_size(arg):
+    global _max_size
+    _max_size = int(arg[1]) * 1024 * 1024
+    if _max_size < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
+conf.simple_conf_handler("CompileCache", _set_cache_dir, required = False, no_dup = True)
+conf.simple_conf_handler("CompileCacheSize", _set_max_size, default = "256")
+conf.register_init_func(_init)
@@ -23,7 +23,7 @@
 and executes (by running the executor under limiter) user's
 program and verifies the output"""
 
-import os.path, errno, shutil, time, os, threading, Queue, stat, traceback
+import os.path, errno, shutil, time, os, threading, Queue, stat, traceback, hashlib, re
 
 try:
     import fcntl
@@ -34,16 +34,16 @@ class Error(Exception):
     pass
 
 from orzoj import conf, log, structures, msg, snc
-from orzoj.judge import limiter
+from orzoj.judge import limiter, compile_cache, _zdata
 
 _DEFAULT_PROG_NAME = "prog"  # file name of program being judged (without extention)
 
+COMPRESSED_SUFFIX = ".zst"  # data files with this suffix are compressed by zstd
+
 _dir_temp = None  # relative to ChrootDir
 _dir_temp_abs = None
 
-_prog_path = None  # path of program being judged, without extention (relative to ChrootDir)
-_prog_path_abs = None
-
+_lock_file_path = None
 _lock_file_obj = None
 _lock_file_fd = None
 
@@ -52,24 +52,122 @@ lang_dict = dict()
 
 _cmd_vars = dict()
 
+_exec_sem = None
+# if not None, a semaphore held while running user's program, so that
+# other slots can only compile while the number of slots given by
+# ExecuteSlots are executing
+_compile_cpus = None
+_execute_cpus = None
+
+_pch_dir = None
+
+_INCLUDE_RE = re.compile(r'#\s*include\s*[<"]([^>"]+)[>"]')
+
+def set_cmd_var(name, val):
+    """set a variable usable in arguments of AddLimiter and AddExecutor"""
+    global _cmd_vars
+    _cmd_vars[name] = val
+
 def _join_path(p1, p2):
     return os.path.normpath(os.path.join(p1, p2))
 
-def _clean_temp():
+def _clean_temp(dir_temp_abs):
     """clean temporary directory"""
-    global _dir_temp_abs
     try:
-        for i in os.listdir(_dir_temp_abs):
-            p = _join_path(_dir_temp_abs, i)
+        for i in os.listdir(dir_temp_abs):
+            p = _join_path(dir_temp_abs, i)
             if os.path.isdir(p) and not os.path.islink(p):
                 shutil.rmtree(p)
             else:
                 os.remove(p)
     except Exception as e:
         log.error("failed to clean temporary directory [{0!r}]: {1}" .
-                format(_dir_temp_abs, e))
+                format(dir_temp_abs, e))
         raise Error
 
+def _chmod_temp(path):
+    os.chmod(path,
+            stat.S_IRUSR | stat.S_IWUSR | stat.S_IXUSR |
+            stat.S_IRGRP | stat.S_IWGRP | stat.S_IXGRP |
+            stat.S_IROTH | stat.S_IWOTH | stat.S_IXOTH)
+
+class Slot:
+    def __init__(self, num):
+        """state for judging one task, so that several tasks can be judged
+        at the same time in different slots
+
+        slot 0 is the only slot of a judge with Slots set to 1, which uses
+        TempDir and LockFile directly; otherwise slot @num (starting from 1)
+        uses subdirectory <num> of TempDir and LockFile with suffix .<num>
+
+        may raise Error"""
+        global _dir_temp, _dir_temp_abs, _cmd_vars, _lock_file_path, _lock_file_fd
+        self.num = num
+        self.cmd_vars = dict(_cmd_vars)
+        self._lock_file_obj = None
+        if not num:
+            self.dir_temp = _dir_temp
+            self.dir_temp_abs = _dir_temp_abs
+            self.lock_file_fd = _lock_file_fd
+        else:
+            self.dir_temp = _join_path(_dir_temp, str(num))
+            self.dir_temp_abs = _join_path(_dir_temp_abs, str(num))
+            self.lock_file_fd = None
+            try:
+                if not os.path.isdir(self.dir_temp_abs):
+                    os.mkdir(self.dir_temp_abs)
+                _chmod_temp(self.dir_temp_abs)
+                if _lock_file_path:
+                    self._lock_file_obj = open("{0}.{1}" . format(_lock_file_path, num), "w")
+                    self.lock_file_fd = self._lock_file_obj.fileno()
+            except Exception as e:
+                log.error("failed to initialize slot {0}: {1}" . format(num, e))
+                raise Error
+        self.prog_path = _join_path(self.dir_temp, _DEFAULT_PROG_NAME)
+        self.prog_path_abs = _join_path(self.dir_temp_abs, _DEFAULT_PROG_NAME)
+        self.cmd_vars["WORKDIR"] = self.dir_temp
+        self.cmd_vars["WORKDIR_ABS"] = self.dir_temp_abs
+
+def is_compressed(path):
+    """whether the data file at @path is compressed"""
+    return path.endswith(COMPRESSED_SUFFIX)
+
+def copy_data(src, dest):
+    """copy data file @src to @dest, decompressing it if it is compressed
+    (in which case COMPRESSED_SUFFIX is removed from the file name if @dest
+    is a directory)
+    may raise EnvironmentError or _zdata.error"""
+    if not is_compressed(src):
+        shutil.copy(src, dest)
+        return
+    if os.path.isdir(dest):
+        dest = _join_path(dest, os.path.basename(src)[:-len(COMPRESSED_SUFFIX)])
+    fd = os.open(dest, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0644)
+    try:
+        _zdata.decompress(src, fd)
+    finally:
+        os.close(fd)
+
+class _thread_feed_stdin(threading.Thread):
+    def __init__(self, src):
+        """decompress data file @src into a pipe, whose reading end is
+        self.fin (a file object to be used as stdin of user's program)"""
+        threading.Thread.__init__(self)
+        self._src = src
+        (fin, self._fout) = os.pipe()
+        for fd in (fin, self._fout):
+            # so that the program does not hold the writing end
+            fcntl.fcntl(fd, fcntl.F_SETFD, fcntl.fcntl(fd, fcntl.F_GETFD) | fcntl.FD_CLOEXEC)
+        self.fin = os.fdopen(fin, "r")
+
+    def run(self):
+        try:
+            _zdata.decompress(self._src, self._fout)
+        except _zdata.error as e:
+            log.error("failed to feed program input: {0}" . format(e))
+        finally:
+            os.close(self._fout)
+
 class _thread_report_case_result(threading.Thread):
     def __init__(self, conn, ncase):
         threading.Thread.__init__(self)
@@ -82,13 +180,11 @@ class _thread_report_case_result(threading.Thread):
         try:
             while self._ncase:
                 try:
-                    res = self._queue.get(False)
-                    msg.write_msg(self._conn, msg.REPORT_CASE)
-                    res.write(self._conn)
+                    res = self._queue.get(True, self._conn.heartbeat_interval)
+                    msg.write_msg(self._conn, msg.REPORT_CASE, *res.fields())
                     self._ncase -= 1
                 except Queue.Empty:
-                    msg.write_msg(self._conn, msg.TELL_ONLINE)
-                    time.sleep(msg.TELL_ONLINE_INTERVAL)
+                    msg.tell_online(self._conn)
         except Exception as e:
             log.error("failed to report case result: {0}" . format(e))
             self._error = e
@@ -101,6 +197,18 @@ class _thread_report_case_result(threading.Thread):
         self._queue.put(res)
 
 
+def _skipped_result(case):
+    """return the case_result of @case (a probconf.Case_conf) when skipped"""
+    ret = structures.case_result()
+    ret.exe_status = structures.EXESTS_SKIPPED
+    ret.score = 0
+    ret.full_score = case.score
+    ret.time = 0
+    ret.memory = 0
+    ret.extra_info = "skipped"
+    return ret
+
+
 class _thread_tell_online(threading.Thread):
     def __init__(self, conn):
         threading.Thread.__init__(self)
@@ -108,9 +216,8 @@ class _thread_tell_online(threading.Thread):
         self._stop = threading.Event()
 
     def run(self):
-        while not self._stop.is_set():
-            msg.write_msg(self._conn, msg.TELL_ONLINE)
-            time.sleep(msg.TELL_ONLINE_INTERVAL)
+        while not self._stop.wait(self._conn.heartbeat_interval):
+            msg.tell_online(self._conn)
 
     def stop(self):
         self._stop.set()
@@ -134,7 +241,34 @@ class _Executor:
         self._limiter = limiter.limiter_dict[args[2]]
         self._args = args[3:]
 
-    def run_as_compiler(self, fsrc, extra_args = None):
+    def cache_key(self, lang, src, extra_args, cmd_vars):
+        """return the key in compile_cache for compiling @src of language
+        @lang with this executor and @extra_args, or None if the result
+        should not be cached (e.g. the compiler uses problem data)"""
+        if not compile_cache.enabled():
+            return None
+        return self.make_key(extra_args, cmd_vars, lang, hashlib.sha256(src).hexdigest())
+
+    def make_key(self, extra_args, cmd_vars, *parts):
+        """return a key identifying the output of running this executor as
+        compiler with @extra_args on input identified by @parts, or None if
+        the output may depend on problem data"""
+        args = list(self._args)
+        if extra_args:
+            args.extend(extra_args)
+        for i in args:
+            if "DATADIR" in i:
+                return None
+        var_dict = dict(cmd_vars)
+        var_dict['SRC'] = ""
+        try:
+            exe = limiter.eval_arg_list(self._args[:1], var_dict)
+        except Exception:
+            return None
+        return compile_cache.make_key(args,
+                [compile_cache.file_identity(i) for i in exe], *parts)
+
+    def run_as_compiler(self, fsrc, extra_args = None, cmd_vars = None):
         """run the executor as compiler (retrieve stderr and stdout)
         return a tuple (success, info),
         where success is a boolean value indicating whether it's compiled successfully,
@@ -142,12 +276,13 @@ class _Executor:
         if successfully compiled, info is None
 
         @extra_args can be a list of string (will be evaluated using limiter.eval_arg_list)
+        @cmd_vars: variables for evaluating arguments, global ones if None
             
         no exceptions are raised"""
 
         global _cmd_vars
 
-        var_dict = dict(_cmd_vars)
+        var_dict = dict(_cmd_vars if cmd_vars is None else cmd_vars)
         var_dict['SRC'] = fsrc;
         try:
             args = limiter.eval_arg_list(self._args, var_dict)
@@ -158,28 +293,29 @@ class _Executor:
             return (False, "failed to compile: executor configuration error")
 
         try:
-            l = self._limiter
             del var_dict['SRC']
             var_dict["TARGET"] = args
 
-            l.run(var_dict, stdin = limiter.get_null_dev(False), stdout = limiter.SAVE_OUTPUT, stderr = limiter.SAVE_OUTPUT)
+            r = self._limiter.run(var_dict, stdin = limiter.get_null_dev(False), stdout = limiter.SAVE_OUTPUT, stderr = limiter.SAVE_OUTPUT,
+                    cpus = _compile_cpus)
 
-            if l.exe_status:
-                if l.exe_status == structures.EXESTS_EXIT_NONZERO:
-                    return (False, l.stdout + l.stderr)
+            if r.exe_status:
+                if r.exe_status == structures.EXESTS_EXIT_NONZERO:
+                    return (False, r.stdout + r.stderr)
                 else:
                     return (False, "failed to compile: {0}: details: {1}" .
-                            format(structures.EXECUTION_STATUS_STR[l.exe_status],
-                                l.exe_extra_info))
+                            format(structures.EXECUTION_STATUS_STR[r.exe_status],
+                                r.exe_extra_info))
             return (True, None)
         except limiter.SysError as e:
-            return (False, "failed to compile: limiter error: {0} [stderr: {1}]" .
-                    format(e.msg, l.stderr))
+            return (False, "failed to compile: limiter error: {0}" .
+                    format(e.msg))
         except Exception as e:
             return (False, "failed to compile: caught exception: {0}" .
                     format(e))
 
-    def run(self, prog, stdin = None, stdout = None, retrieve_stdout = False, extra_args = None):
+    def run(self, prog, stdin = None, stdout = None, retrieve_stdout = False, extra_args = None,
+            cmd_vars = None, umask = None):
         """execute user's program @prog, stdin and stdout can be redirected to file
         allowed @stdin and @stdout values are the same as that of subprocess.Popen
 
@@ -188,6 +324,9 @@ class _Executor:
         if retrieve_stdout is True,
             return a tuple(res:structures.case_result, stdout:str),
         and @stdin and @stdout are ignored
+
+        @cmd_vars: variables for evaluating arguments, global ones if None
+        @umask: if not None, the umask of the executor process
         
         no exceptions are raised"""
 
@@ -205,7 +344,7 @@ class _Executor:
                 return (res, None)
             return res
 
-        var_dict = dict(_cmd_vars)
+        var_dict = dict(_cmd_vars if cmd_vars is None else cmd_vars)
         var_dict['SRC'] = prog
         try:
             args = limiter.eval_arg_list(self._args, var_dict)
@@ -223,19 +362,21 @@ class _Executor:
             var_dict["TARGET"] = args
 
             if retrieve_stdout:
-                l.run(var_dict, stdout = limiter.SAVE_OUTPUT, stderr = limiter.get_null_dev())
+                r = l.run(var_dict, stdout = limiter.SAVE_OUTPUT, stderr = limiter.get_null_dev(),
+                        umask = umask, cpus = _execute_cpus)
             else:
-                l.run(var_dict, stdin = stdin, stdout = stdout, stderr = limiter.get_null_dev())
+                r = l.run(var_dict, stdin = stdin, stdout = stdout, stderr = limiter.get_null_dev(),
+                        umask = umask, cpus = _execute_cpus)
 
             res.score = 0
             res.full_score = 0
-            res.exe_status = l.exe_status
-            res.time = l.exe_time
-            res.memory = l.exe_mem
-            res.extra_info = l.exe_extra_info
+            res.exe_status = r.exe_status
+            res.time = r.exe_time
+            res.memory = r.exe_mem
+            res.extra_info = r.exe_extra_info
 
             if retrieve_stdout:
-                return (res, l.stdout)
+                return (res, r.stdout)
             return res
         
         except limiter.SysError as e:
@@ -273,30 +414,34 @@ class _Lang:
             raise conf.UserError("unknown program executor {0!r} for language {1!r}" .
                     format(args[5], args[1]))
         self._executor = _executor_dict[args[5]]
+        self._pch = None
 
         lang_dict[args[1]] = self
 
-    def judge(self, conn, pcode, pconf, src, input, output):
+    def judge(self, conn, pcode, pconf, src, input, output, slot):
         """@pcode: problem code
         @pconf: problem configuration (defined in probconf.py)
+        @slot: an instance of Slot, which must not be used by others meanwhile
         may raise Error or snc.Error"""
 
-        def _write_msg(m):
-            msg.write_msg(conn, m)
-
-        def _write_str(s):
-            conn.write_str(s)
-
-        def _write_uint32(v):
-            conn.write_uint32(v)
+        def _write_msg(m, *fields):
+            msg.write_msg(conn, m, *fields)
 
         locked = False
+        exec_locked = False
+
+        def _unlock():
+            if locked:
+                fcntl.flock(lock_file_fd, fcntl.LOCK_UN)
+            if exec_locked:
+                _exec_sem.release()
 
-        global _lock_file_fd
-        if _lock_file_fd:
+        lock_file_fd = slot.lock_file_fd
+        cmd_vars = slot.cmd_vars
+        if lock_file_fd:
             while True:
                 try:
-                    fcntl.flock(_lock_file_fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+                    fcntl.flock(lock_file_fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
                 except IOError as e:
                     if e.errno == errno.EACCES or e.errno == errno.EAGAIN:
                         _write_msg(msg.START_JUDGE_WAIT)
@@ -318,68 +463,99 @@ class _Lang:
         try:
             _write_msg(msg.START_JUDGE_OK)
 
-            _clean_temp()
-
-            global _prog_path_abs, _cmd_vars
+            _clean_temp(slot.dir_temp_abs)
 
             if self._compiler:
-                with open(_prog_path_abs + self._src_ext, "w") as f:
+                with open(slot.prog_path_abs + self._src_ext, "w") as f:
                     f.write(src)
 
-                _cmd_vars["MEMORY"] = 0
-                _cmd_vars["DATADIR"] = os.path.abspath(pcode)
+                cmd_vars["MEMORY"] = 0
+                cmd_vars["DATADIR"] = os.path.abspath(pcode)
 
                 th_tell_online = _thread_tell_online(conn)
                 th_tell_online.start()
 
                 if pconf.compiler and self._name in pconf.compiler:
-                    (ok, info) = self._compiler.run_as_compiler(_prog_path_abs, pconf.compiler[self._name])
+                    extra_args = pconf.compiler[self._name]
                 else:
-                    (ok, info) = self._compiler.run_as_compiler(_prog_path_abs)
+                    extra_args = None
+
+                cache_key = self._compiler.cache_key(self._name, src, extra_args, cmd_vars)
+                if cache_key and compile_cache.get(cache_key, slot.dir_temp_abs):
+                    (ok, info) = (True, None)
+                else:
+                    pch_args = None
+                    if self._pch:
+                        pch_args = self._pch.get_args(src, extra_args, cmd_vars)
+                    if pch_args:
+                        (ok, info) = self._compiler.run_as_compiler(slot.prog_path_abs,
+                                (extra_args or []) + pch_args, cmd_vars)
+                    else:
+                        (ok, info) = self._compiler.run_as_compiler(slot.prog_path_abs,
+                                extra_args, cmd_vars)
+                    if ok and cache_key:
+                        compile_cache.put(cache_key, slot.dir_temp_abs,
+                                [_DEFAULT_PROG_NAME + self._src_ext])
 
                 th_tell_online.stop()
                 th_tell_online.join()
 
                 if not ok:
-                    _write_msg(msg.COMPILE_FAIL)
-                    _write_str(info)
+                    _write_msg(msg.COMPILE_FAIL, info)
                     return
 
             _write_msg(msg.COMPILE_SUCCEED)
 
-            global _dir_temp_abs
+            dir_temp_abs = slot.dir_temp_abs
 
-            os.chmod(_prog_path_abs + self._exe_ext,
+            os.chmod(slot.prog_path_abs + self._exe_ext,
                     stat.S_IRUSR | stat.S_IXUSR |
                     stat.S_IRGRP | stat.S_IXGRP |
                     stat.S_IROTH | stat.S_IXOTH)
-            global _prog_path
 
             th_report_case = _thread_report_case_result(conn, len(pconf.case))
             th_report_case.start()
 
-            for case in pconf.case:
+            if _exec_sem:
+                # th_report_case tells orzoj-server we are online meanwhile
+                _exec_sem.acquire()
+                exec_locked = True
+
+            scoring = pconf.new_scoring()
+
+            for (num, case) in enumerate(pconf.case):
+
+                if scoring.skip(num):
+                    for i in scoring.add(num, _skipped_result(case)):
+                        th_report_case.add(i)
+                    continue
 
                 try:
+                    th_feed_stdin = None
                     if pconf.extra_input:
                         for i in pconf.extra_input:
-                            shutil.copy(_join_path(pcode, i), _dir_temp_abs)
+                            copy_data(_join_path(pcode, i), dir_temp_abs)
 
                     stdin_path = _join_path(pcode, case.stdin)
                     if not input: # use stdin
-                        prog_fin = open(stdin_path)
+                        if is_compressed(stdin_path):
+                            th_feed_stdin = _thread_feed_stdin(stdin_path)
+                            th_feed_stdin.start()
+                            prog_fin = th_feed_stdin.fin
+                        else:
+                            prog_fin = open(stdin_path)
                     else:
-                        tpath = _join_path(_dir_temp_abs, input)
-                        shutil.copy(stdin_path, tpath)
+                        tpath = _join_path(dir_temp_abs, input)
+                        copy_data(stdin_path, tpath)
                         os.chmod(tpath, stat.S_IRUSR | stat.S_IRGRP | stat.S_IROTH)
                         prog_fin = limiter.get_null_dev(False)
 
                     if not output: # use stdout
-                        prog_fout_path = _join_path(_dir_temp_abs, "output.{0}" .
+                        prog_fout_path = _join_path(dir_temp_abs, "output.{0}" .
                                 format(time.time()))
                         prog_fout = open(prog_fout_path, "w")
                     else:
-                        prog_fout_path = _join_path(_dir_temp_abs, output)
+                        prog_fout_path = _join_path(dir_temp_abs, output)
                         prog_fout = limiter.get_null_dev()
                 except Exception as e:
                     log.error("failed to open data file: {0}" . format(stdin_path, e))
@@ -390,21 +566,25 @@ class _Lang:
                     case_result.time = 0
                     case_result.memory = 0
                     case_result.extra_info = "failed to open data file"
+                    if th_feed_stdin:
+                        th_feed_stdin.fin.close()
+                        th_feed_stdin.join()
 
                 else:
 
-                    _cmd_vars["TIME"] = case.time
-                    _cmd_vars["MEMORY"] = case.mem
+                    cmd_vars["TIME"] = case.time
+                    cmd_vars["MEMORY"] = case.mem
 
-                    umask_prev = os.umask(0)
-                    case_result = self._executor.run(_prog_path, stdin = prog_fin, stdout = prog_fout)
+                    case_result = self._executor.run(slot.prog_path, stdin = prog_fin, stdout = prog_fout,
+                            cmd_vars = cmd_vars, umask = 0)
                     case_result.full_score = case.score
-                    os.umask(umask_prev)
 
                     if prog_fin:
                         prog_fin.close()
                     if prog_fout:
                         prog_fout.close()
+                    if th_feed_stdin:
+                        th_feed_stdin.join()
 
                     if case_result.exe_status == structures.EXESTS_NORMAL:
                         if (not os.path.isfile(prog_fout_path)) or os.path.islink(prog_fout_path):
@@ -425,26 +605,27 @@ class _Lang:
                         os.unlink(prog_fout_path)
                     except Exception as e:
                         log.warning("failed to remove program output file: {0}" . format(e))
-                th_report_case.add(case_result)
+                for i in scoring.add(num, case_result):
+                    th_report_case.add(i)
+
+            if exec_locked:
+                _exec_sem.release()
+                exec_locked = False
 
             th_report_case.join()
             th_report_case.check_error()
             _write_msg(msg.REPORT_JUDGE_FINISH)
 
-            if locked:
-                fcntl.flock(_lock_file_fd, fcntl.LOCK_UN)
+            _unlock()
 
         except Error:
-            if locked:
-                fcntl.flock(_lock_file_fd, fcntl.LOCK_UN)
+            _unlock()
             raise
         except snc.Error:
-            if locked:
-                fcntl.flock(_lock_file_fd, fcntl.LOCK_UN)
+            _unlock()
             raise Error
         except Exception as e:
-            if locked:
-                fcntl.flock(_lock_file_fd, fcntl.LOCK_UN)
+            _unlock()
             log.error("[lang {0!r}] failed to judge: {1}" .
                     format(self._name, e))
             log.debug(traceback.format_exc())
@@ -487,10 +668,11 @@ class _Lang:
                     format(e))
             raise Error
 
-        _cmd_vars["MEMORY"] = 0
-        _cmd_vars["DATADIR"] = os.path.abspath(pcode)
+        cmd_vars = dict(_cmd_vars)
+        cmd_vars["MEMORY"] = 0
+        cmd_vars["DATADIR"] = os.path.abspath(pcode)
 
-        ret = self._compiler.run_as_compiler(fexe, extra_args)
+        ret = self._compiler.run_as_compiler(fexe, extra_args, cmd_vars)
 
         if ret[0]:
             return ret
@@ -509,44 +691,140 @@ class _Lang:
         
         no exceptions are raised"""
         global _cmd_vars
-        user = None
-        try:
-            user = _cmd_vars["USER"]
-            _cmd_vars["USER"] = os.geteuid()
-        except KeyError:
-            pass
+        cmd_vars = dict(_cmd_vars)
+        if "USER" in cmd_vars:
+            cmd_vars["USER"] = os.geteuid()
+        if "GROUP" in cmd_vars:
+            cmd_vars["GROUP"] = os.getegid()
+        if "CHROOT_DIR" in cmd_vars:
+            cmd_vars["CHROOT_DIR"] = "/"
 
-        group = None
-        try:
-            group = _cmd_vars["GROUP"]
-            _cmd_vars["GROUP"] = os.getegid()
-        except KeyError:
-            pass
-
-        chroot_dir = None
-        try:
-            chroot_dir = _cmd_vars["CHROOT_DIR"]
-            _cmd_vars["CHROOT_DIR"] = "/"
-        except KeyError:
-            pass
+        cmd_vars["TIME"] = time
+        cmd_vars["MEMORY"] = mem
 
-        _cmd_vars["TIME"] = time
-        _cmd_vars["MEMORY"] = mem
+        cmd_vars["DATADIR"] = os.path.abspath(pcode)
 
-        _cmd_vars["DATADIR"] = os.path.abspath(pcode)
+        return self._executor.run(fexe, retrieve_stdout = True, extra_args = args,
+                cmd_vars = cmd_vars)
 
-        ret = self._executor.run(fexe, retrieve_stdout = True, extra_args = args)
 
-        if user is not None:
-            _cmd_vars["USER"] = user
-        if group is not None:
-            _cmd_vars["GROUP"] = group
-        if chroot_dir is not None:
-            _cmd_vars["CHROOT_DIR"] = chroot_dir
 
-        return ret
+class _Pch:
+    def __init__(self, args):
+        """precompiled headers of a language, see AddPrecompiledHeader"""
+        if len(args) < 4:
+            raise conf.UserError("Option {0} takes at least three arguments" . format(args[0]))
 
+        global _executor_dict, lang_dict
 
+        if args[1] not in lang_dict:
+            raise conf.UserError("unknown language {0!r} (Option {1} must be after AddLang)" .
+                    format(args[1], args[0]))
+        if args[2] not in _executor_dict:
+            raise conf.UserError("unknown executor {0!r} for precompiled headers" .
+                    format(args[2]))
+        lang = lang_dict[args[1]]
+        if lang._compiler is None:
+            raise conf.UserError("language {0!r} has no compiler" . format(args[1]))
+        if lang._pch:
+            raise conf.UserError("duplicated precompiled headers for language {0!r}" .
+                    format(args[1]))
+        lang._pch = self
+
+        self._lang = args[1]
+        self._executor = _executor_dict[args[2]]
+        self._headers = set(args[3:])
+        self._lock = threading.Lock()
+        self._dirs = dict()
+        # dict of <key> => <directory containing the precompiled header, or None
+        #   if failed to build>
+
+    def get_args(self, src, extra_args, cmd_vars):
+        """return a list of extra compiler arguments to use a precompiled
+        header for @src (compiled with @extra_args), or None if no usable
+        header; the header is built if not built yet
+
+        the compiler checks that the header is built with compatible options,
+        and ignores it otherwise"""
+        global _pch_dir
+        if _pch_dir is None:
+            return None
+        header = _get_first_include(src)
+        if header not in self._headers:
+            return None
+        key = self._executor.make_key(extra_args, cmd_vars, self._lang, header)
+        if key is None:
+            return None
+        with self._lock:
+            if key not in self._dirs:
+                self._dirs[key] = self._build(key, header, extra_args, cmd_vars)
+            d = self._dirs[key]
+        if d is None:
+            return None
+        return ["-I" + d]
+
+    def _build(self, key, header, extra_args, cmd_vars):
+        """build the precompiled header for @header into a directory
+        and return the directory, or None on failure"""
+        d = _join_path(_pch_dir, key)
+        if os.path.isfile(_join_path(d, header + ".gch")):
+            return d
+        tmp = d + ".tmp"
+        try:
+            for i in (d, tmp):
+                if os.path.isdir(i):
+                    shutil.rmtree(i)
+            # the precompiled header is found before the real header
+            # in the include search path
+            hpath = _join_path(tmp, header)
+            os.makedirs(os.path.dirname(hpath))
+            with open(hpath, "w") as f:
+                f.write("#include <{0}>\n" . format(header))
+            log.info("[lang {0!r}] building precompiled header {1!r}" .
+                    format(self._lang, header))
+            (ok, info) = self._executor.run_as_compiler(hpath, extra_args, cmd_vars)
+            if not ok:
+                log.warning("[lang {0!r}] failed to build precompiled header {1!r}: {2}" .
+                        format(self._lang, header, info))
+                shutil.rmtree(tmp, True)
+                return None
+            os.remove(hpath)
+            os.rename(tmp, d)
+            return d
+        except Exception as e:
+            log.warning("[lang {0!r}] failed to build precompiled header {1!r}: {2}" .
+                    format(self._lang, header, e))
+            shutil.rmtree(tmp, True)
+            return None
+
+def _get_first_include(src):
+    """return the header included by the first preprocessing directive of
+    @src if there are only comments and blank lines before it, otherwise None"""
+    in_comment = False
+    for line in src.splitlines():
+        line = line.strip()
+        while line:
+            if in_comment:
+                pos = line.find("*/")
+                if pos == -1:
+                    line = ""
+                else:
+                    line = line[pos + 2:].lstrip()
+                    in_comment = False
+            elif line.startswith("/*"):
+                line = line[2:]
+                in_comment = True
+            elif line.startswith("//"):
+                line = ""
+            else:
+                break
+        if not line:
+            continue
+        m = _INCLUDE_RE.match(line)
+        if m:
+            return m.group(1)
+        return None
+    return None
 
 def _ch_add_executor(args):
     if len(args) == 1:
@@ -558,8 +836,13 @@ def _ch_add_lang(args):
         raise conf.UserError("Option {0} must be specified in the configuration file." . format(args[0]))
     _Lang(args)
 
+def _ch_add_pch(args):
+    if len(args) > 1:
+        _Pch(args)
+
 conf.register_handler("AddExecutor", _ch_add_executor)
 conf.register_handler("AddLang", _ch_add_lang)
+conf.register_handler("AddPrecompiledHeader", _ch_add_pch)
 
 def _set_chroot_dir(arg):
     if len(arg) == 2:
@@ -571,7 +854,7 @@ def _set_chroot_dir(arg):
         _cmd_vars["CHROOT_DIR"] = arg[1]
 
 def _set_temp_dir(arg):
-    global _cmd_vars, _dir_temp, _dir_temp_abs, _prog_path, _prog_path_abs
+    global _cmd_vars, _dir_temp, _dir_temp_abs
     _dir_temp = arg[1]
     if "CHROOT_DIR" in _cmd_vars:
         if os.path.isabs(_dir_temp):
@@ -587,22 +870,17 @@ def _set_temp_dir(arg):
         raise conf.UserError("path {0!r} is not a directory" . format(_dir_temp_abs))
 
     try:
-        os.chmod(_dir_temp_abs,
-                stat.S_IRUSR | stat.S_IWUSR | stat.S_IXUSR |
-                stat.S_IRGRP | stat.S_IWGRP | stat.S_IXGRP |
-                stat.S_IROTH | stat.S_IWOTH | stat.S_IXOTH)
+        _chmod_temp(_dir_temp_abs)
     except Exception as e:
         raise conf.UserError("failed to change permission for temporary directory: {0}" . format(e))
 
-    _prog_path = _join_path(_dir_temp, _DEFAULT_PROG_NAME)
-    _prog_path_abs = _join_path(_dir_temp_abs, _DEFAULT_PROG_NAME)
-
     _cmd_vars["WORKDIR"] = _dir_temp
     _cmd_vars["WORKDIR_ABS"] = _dir_temp_abs
 
 def _set_lock_file(arg):
     if len(arg) == 2:
-        global _lock_file_fd, _lock_file_obj
+        global _lock_file_fd, _lock_file_obj, _lock_file_path
+        _lock_file_path = arg[1]
         _lock_file_obj = open(arg[1], "w")
         _lock_file_fd = _lock_file_obj.fileno()
 
@@ -626,9 +904,40 @@ def _set_group(arg):
         global _cmd_vars
         _cmd_vars["GROUP"] = g.gr_gid
 
+def _set_pch_dir(arg):
+    if len(arg) == 2:
+        global _pch_dir
+        if not os.path.isabs(arg[1]):
+            raise conf.UserError("Option {0} takes an absolute path as argument" . format(arg[0]))
+        if not os.path.isdir(arg[1]):
+            raise conf.UserError("path {0!r} is not a directory" . format(arg[1]))
+        _pch_dir = arg[1]
+
+def _set_execute_slots(arg):
+    global _exec_sem
+    n = int(arg[1])
+    if n < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+    if n:
+        _exec_sem = threading.Semaphore(n)
+
+def _ch_set_compile_cpus(arg):
+    if len(arg) > 1:
+        global _compile_cpus
+        _compile_cpus = limiter.parse_cpu_list(arg)
+
+def _ch_set_execute_cpus(arg):
+    if len(arg) > 1:
+        global _execute_cpus
+        _execute_cpus = limiter.parse_cpu_list(arg)
+
 conf.simple_conf_handler("ChrootDir", _set_chroot_dir, required = False, no_dup = True, require_os = conf.REQUIRE_UNIX)
 conf.simple_conf_handler("TempDir", _set_temp_dir, no_dup = True)
 conf.simple_conf_handler("LockFile", _set_lock_file, required = False, no_dup = True, require_os = conf.REQUIRE_UNIX)
 conf.simple_conf_handler("User", _set_user, required = False, no_dup = True, require_os = conf.REQUIRE_UNIX)
 conf.simple_conf_handler("Group", _set_group, required = False, no_dup = True, require_os = conf.REQUIRE_UNIX)
+conf.simple_conf_handler("ExecuteSlots", _set_execute_slots, default = "0")
+conf.simple_conf_handler("PrecompiledHeaderDir", _set_pch_dir, required = False, no_dup = True)
+conf.register_handler("CompileCPUs", _ch_set_compile_cpus, no_dup = True)
+conf.register_handler("ExecuteCPUs", _ch_set_execute_cpus, no_dup = True)
 
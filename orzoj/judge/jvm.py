@@ -0,0 +1,136 @@
+# $File: jvm.py
+# $Author: Jiakai <jia.kai66@gmail.com>
+#
+# This file is part of orzoj
+#
+# Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+#
+# Orzoj is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Orzoj is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""speed up starting Java programs with a class data sharing (CDS) archive
+generated when orzoj-judge starts, and measure the remaining startup time
+
+variables usable in AddLimiter and AddExecutor:
+    JAVA_CDS     -- list of JVM arguments to use the archive,
+                    empty if JavaCDS is not set or the archive failed
+                    to be generated
+    JAVA_STARTUP -- CPU time (in milliseconds) of starting the JVM
+                    with the arguments above, 0 if JavaCDS is not set
+
+the time limit should only be relaxed by JAVA_STARTUP if JAVA_CDS is not
+empty, since the startup time without the archive varies much more"""
+
+import os, subprocess
+
+from orzoj import conf, log
+from orzoj.judge import core
+
+_STARTUP_NRUN = 3
+# the JVM is started this number of times and the minimal time is used
+
+_archive = None
+_java = None
+_class_list = None
+
+startup_time = None
+# CPU time of starting the JVM in microseconds, None if not measured
+
+def _run(args):
+    """run @args and return (exit status, CPU time in microseconds)"""
+    with open(os.devnull, "r+") as null:
+        p = subprocess.Popen(args, stdin = null, stdout = null, stderr = null,
+                close_fds = True)
+        (pid, status, rusage) = os.wait4(p.pid, 0)
+        p.returncode = status # already reaped
+    return (status, int((rusage.ru_utime + rusage.ru_stime) * 1000000))
+
+def _generate():
+    """generate the archive and return the JVM arguments to use it,
+    or None on failure"""
+    args = [_java, "-Xshare:dump", "-XX:SharedArchiveFile=" + _archive]
+    if _class_list:
+        args.append("-XX:SharedClassListFile=" + _class_list)
+    log.info("generating Java CDS archive: {0!r}" . format(args))
+    try:
+        (status, t) = _run(args)
+    except Exception as e:
+        log.error("failed to generate Java CDS archive: {0}" . format(e))
+        return None
+    if status or not os.path.isfile(_archive):
+        log.error("failed to generate Java CDS archive: {0!r} exited with status {1}" .
+                format(_java, status))
+        return None
+    # the archive is created under the umask of orzoj-judge (see SetUmask),
+    # but Java programs are run as another user
+    try:
+        os.chmod(_archive, 0644)
+    except Exception as e:
+        log.error("failed to change mode of Java CDS archive: {0}" . format(e))
+        return None
+    # the JVM refuses to start if the archive can not be used
+    return ["-Xshare:on", "-XX:SharedArchiveFile=" + _archive]
+
+def _measure(jvm_args):
+    """return the minimal CPU time in microseconds of starting the JVM
+    with @jvm_args, or None on failure"""
+    ret = None
+    for i in range(_STARTUP_NRUN):
+        try:
+            (status, t) = _run([_java] + jvm_args + ["-version"])
+        except Exception as e:
+            log.error("failed to start JVM: {0}" . format(e))
+            return None
+        if status:
+            log.error("failed to start JVM: exited with status {0}" . format(status))
+            return None
+        if ret is None or t < ret:
+            ret = t
+    return ret
+
+def _init():
+    global startup_time
+    if _archive is None:
+        return
+    jvm_args = _generate()
+    if jvm_args is None:
+        jvm_args = []
+    startup_time = _measure(jvm_args)
+    if startup_time is None:
+        # the archive can not be used
+        jvm_args = []
+        startup_time = _measure(jvm_args)
+    core.set_cmd_var("JAVA_CDS", jvm_args)
+    if startup_time is not None:
+        core.set_cmd_var("JAVA_STARTUP", startup_time // 1000)
+        log.info("JVM startup time: {0} ms (with CDS archive: {1})" .
+                format(startup_time // 1000, bool(jvm_args)))
+
+def _ch_set_java_cds(arg):
+    core.set_cmd_var("JAVA_CDS", [])
+    core.set_cmd_var("JAVA_STARTUP", 0)
+    if len(arg) == 1:
+        return
+    if len(arg) not in (3, 4):
+        raise conf.UserError("Option {0} takes two or three arguments" . format(arg[0]))
+    global _archive, _java, _class_list
+    for i in arg[1:]:
+        if not os.path.isabs(i):
+            raise conf.UserError("Option {0} takes absolute paths as arguments" . format(arg[0]))
+    _archive = arg[1]
+    _java = arg[2]
+    if len(arg) == 4:
+        _class_list = arg[3]
+
+conf.register_handler("JavaCDS", _ch_set_java_cds, no_dup = True)
+conf.register_init_func(_init)
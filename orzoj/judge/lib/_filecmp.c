@@ -2,6 +2,8 @@
  * $File: _filecmp.c
  * $Author: Jiakai <jia.kai66@gmail.com>
  * $Date: Wed Dec 21 14:46:59 2011 +0800
+ *
+ * usable compilation flags: ORZOJ_HAVE_ZSTD
  */
 /*
 This file is part of orzoj
@@ -30,7 +32,12 @@ along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <ctype.h>
 
+#ifdef ORZOJ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 // args: (fstdout:str, fusrout:str)
+// a file whose name ends with ".zst" is decompressed while being compared
 static PyObject* filecmp(PyObject *self, PyObject *args);
 
 static PyMethodDef
@@ -45,8 +52,19 @@ struct Filecmp_ctx
 {
 	FILE *fobj[2];
 	char *buf[2], *buf_end[2], *ptr[2];
+#ifdef ORZOJ_HAVE_ZSTD
+	ZSTD_DCtx *dctx[2];
+	ZSTD_inBuffer zin[2];
+	size_t zret[2]; // last return value of ZSTD_decompressStream, 0 if a frame is complete
+	int zpending[2]; // whether the decompressor may still hold some output
+#endif
 };
 
+static const char ZST_SUFFIX[] = ".zst";
+
+// whether @path ends with ZST_SUFFIX
+static int is_zst(const char *path);
+
 const int CHAR_EOF = 256, CHAR_ERR = 257;
 // return CHAR_EOF on end of file, CHAR_ERR on error
 static int read_char(struct Filecmp_ctx *ctx, int p);
@@ -63,13 +81,27 @@ PyObject* filecmp(PyObject *self, PyObject *args)
 				fclose(ctx.fobj[i]); \
 			if (ctx.buf[i]) \
 				free(ctx.buf[i]); \
+			ZSTD_FREE(i); \
 		} \
 		return Py_BuildValue("(is)", (_ok_), info_buf); \
 	} while(0)
 
+#ifdef ORZOJ_HAVE_ZSTD
+#define ZSTD_FREE(_i_) \
+	do \
+	{ \
+		if (ctx.dctx[_i_]) \
+			ZSTD_freeDCtx(ctx.dctx[_i_]); \
+		if (ctx.zin[_i_].src) \
+			free((void*)ctx.zin[_i_].src); \
+	} while (0)
+#else
+#define ZSTD_FREE(_i_)
+#endif
+
 	const char *fpath[2];
 	char info_buf[256];
-	int linenr = 1;
+	int linenr = 1, i;
 	struct Filecmp_ctx ctx;
 
 	if (!PyArg_ParseTuple(args, "ss:filecmp", fpath, fpath + 1))
@@ -97,6 +129,23 @@ PyObject* filecmp(PyObject *self, PyObject *args)
 		RETURN(0);
 	}
 
+	for (i = 0; i < 2; i ++)
+		if (is_zst(fpath[i]))
+		{
+#ifdef ORZOJ_HAVE_ZSTD
+			ctx.dctx[i] = ZSTD_createDCtx();
+			ctx.zin[i].src = malloc(ZSTD_DStreamInSize());
+			if (!ctx.dctx[i] || !ctx.zin[i].src)
+			{
+				strcpy(info_buf, "failed to initialize zstd decompression");
+				RETURN(0);
+			}
+#else
+			strcpy(info_buf, "compressed file is not supported");
+			RETURN(0);
+#endif
+		}
+
 	while (1)
 	{
 		int a = read_char(&ctx, 0), b = read_char(&ctx, 1);
@@ -159,9 +208,16 @@ FAIL:
 		RETURN(0);
 	}
 
+#undef ZSTD_FREE
 #undef RETURN
 }
 
+int is_zst(const char *path)
+{
+	size_t len = strlen(path), slen = sizeof(ZST_SUFFIX) - 1;
+	return len > slen && !strcmp(path + len - slen, ZST_SUFFIX);
+}
+
 int read_char(struct Filecmp_ctx *ctx, int p)
 {
 #define fobj (ctx->fobj[p])
@@ -171,6 +227,35 @@ int read_char(struct Filecmp_ctx *ctx, int p)
 
 	if (buf_end == ptr)
 	{
+#ifdef ORZOJ_HAVE_ZSTD
+		if (ctx->dctx[p])
+		{
+			ZSTD_inBuffer *zin = ctx->zin + p;
+			ZSTD_outBuffer zout = {buf, BUF_SIZE, 0};
+			while (!zout.pos)
+			{
+				if (zin->pos == zin->size && !ctx->zpending[p])
+				{
+					zin->size = fread((void*)zin->src, 1, ZSTD_DStreamInSize(), fobj);
+					zin->pos = 0;
+					if (!zin->size)
+					{
+						// a truncated frame is an error
+						if (ferror(fobj) || ctx->zret[p])
+							return CHAR_ERR;
+						return CHAR_EOF;
+					}
+				}
+				ctx->zret[p] = ZSTD_decompressStream(ctx->dctx[p], &zout, zin);
+				if (ZSTD_isError(ctx->zret[p]))
+					return CHAR_ERR;
+				ctx->zpending[p] = (zout.pos == zout.size);
+			}
+			buf_end = buf + zout.pos;
+			ptr = buf;
+			return *(ptr ++);
+		}
+#endif
 		buf_end = buf + fread(buf, 1, BUF_SIZE, fobj);
 		ptr = buf;
 
@@ -0,0 +1,212 @@
+/*
+ * $File: _zdata.c
+ * $Author: Jiakai <jia.kai66@gmail.com>
+ *
+ * usable compilation flags: ORZOJ_HAVE_ZSTD
+ */
+/*
+This file is part of orzoj
+
+Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+
+Orzoj is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orzoj is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// decompress zstd-compressed data files
+//
+// module attributes:
+//	available -- whether zstd is supported (compiled with ORZOJ_HAVE_ZSTD)
+
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef ORZOJ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static PyObject *zdata_error_obj;
+
+// args: (src:str, fd:int)
+// decompress the file at @src and write the result to file descriptor @fd,
+// which is usually a pipe to the stdin of user's program;
+// the GIL is released while working
+// return the number of bytes written, or None if the reading end of @fd is
+// closed before all data are written (i.e. the program does not read all of
+// its input, which is not an error)
+// may raise error
+// module function
+static PyObject* decompress(PyObject *self, PyObject *args);
+
+static PyMethodDef
+	methods_module[] =
+	{
+		{"decompress", (PyCFunction)decompress, METH_VARARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	};
+
+#ifdef ORZOJ_HAVE_ZSTD
+// write all @len bytes in @buf to @fd
+// return 0 on success, errno on failure
+static int write_all(int fd, const char *buf, size_t len);
+#endif
+
+PyObject* decompress(PyObject *self, PyObject *args)
+{
+	const char *src;
+	int fd;
+
+	if (!PyArg_ParseTuple(args, "si:decompress", &src, &fd))
+		return NULL;
+
+#ifdef ORZOJ_HAVE_ZSTD
+	const char *err_func = NULL;
+	const char *zerr = NULL;
+	int fin = -1, err = 0;
+	long long tot_size = 0;
+	ZSTD_DCtx *dctx = NULL;
+	void *buf_in = NULL, *buf_out = NULL;
+	size_t size_in = ZSTD_DStreamInSize(), size_out = ZSTD_DStreamOutSize(),
+		   zret = 0;
+
+#define ERROR(_func_) \
+	do \
+	{ \
+		err_func = _func_; \
+		if (!err) \
+			err = errno ? errno : EIO; \
+		goto END; \
+	} while (0)
+
+	Py_BEGIN_ALLOW_THREADS
+
+	if ((fin = open(src, O_RDONLY)) < 0)
+		ERROR("open");
+
+	if (!(dctx = ZSTD_createDCtx()))
+		ERROR("ZSTD_createDCtx");
+	if (!(buf_in = malloc(size_in)) || !(buf_out = malloc(size_out)))
+		ERROR("malloc");
+
+	while (1)
+	{
+		ssize_t len = read(fin, buf_in, size_in);
+		ZSTD_inBuffer zin = {buf_in, 0, 0};
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ERROR("read");
+		}
+		if (!len)
+		{
+			if (zret)
+			{
+				zerr = "truncated data";
+				err = EIO;
+				ERROR("ZSTD_decompressStream");
+			}
+			break;
+		}
+		zin.size = len;
+		while (zin.pos < zin.size)
+		{
+			ZSTD_outBuffer zout = {buf_out, size_out, 0};
+			zret = ZSTD_decompressStream(dctx, &zout, &zin);
+			if (ZSTD_isError(zret))
+			{
+				zerr = ZSTD_getErrorName(zret);
+				err = EIO;
+				ERROR("ZSTD_decompressStream");
+			}
+			if ((err = write_all(fd, buf_out, zout.pos)))
+				ERROR("write");
+			tot_size += zout.pos;
+		}
+	}
+
+END:
+	if (fin >= 0)
+		close(fin);
+	if (dctx)
+		ZSTD_freeDCtx(dctx);
+	free(buf_in);
+	free(buf_out);
+
+	Py_END_ALLOW_THREADS
+
+#undef ERROR
+
+	if (err == EPIPE)
+		Py_RETURN_NONE;
+	if (err_func)
+		return PyErr_Format(zdata_error_obj, "failed to decompress [func %s] [filename '%s']: %s",
+				err_func, src, zerr ? zerr : strerror(err));
+	return PyLong_FromLongLong(tot_size);
+#else
+	return PyErr_Format(zdata_error_obj, "failed to decompress [filename '%s']: "
+			"zstd is not supported", src);
+#endif
+}
+
+#ifdef ORZOJ_HAVE_ZSTD
+int write_all(int fd, const char *buf, size_t len)
+{
+	while (len)
+	{
+		ssize_t s = write(fd, buf, len);
+		if (s < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		buf += s;
+		len -= s;
+	}
+	return 0;
+}
+#endif
+
+
+#ifndef PyMODINIT_FUNC	/* declarations for DLL import/export */
+#define PyMODINIT_FUNC extern void
+#endif
+
+PyMODINIT_FUNC
+init_zdata(void)
+{
+	PyObject *m = Py_InitModule3("_zdata", methods_module, NULL);
+	if (!m)
+		return;
+
+	zdata_error_obj = PyErr_NewException("_zdata.error", NULL, NULL);
+	if (!zdata_error_obj)
+		return;
+
+	Py_INCREF(zdata_error_obj);
+	PyModule_AddObject(m, "error", zdata_error_obj);
+
+#ifdef ORZOJ_HAVE_ZSTD
+	PyModule_AddIntConstant(m, "available", 1);
+#else
+	PyModule_AddIntConstant(m, "available", 0);
+#endif
+}
@@ -10,4 +10,5 @@ static const Exests_t EXESTS_SIGNAL = 4;
 static const Exests_t EXESTS_ILLEGAL_CALL = 5;
 static const Exests_t EXESTS_EXIT_NONZERO = 6;
 static const Exests_t EXESTS_SYSTEM_ERROR = 7;
+static const Exests_t EXESTS_SKIPPED = 8;
 #endif
@@ -22,8 +22,25 @@
 #
 
 from distutils.core import setup, Extension
+import subprocess, platform
 
-module = Extension("orzoj._filecmp", sources = ["_filecmp.c"])
+cflags = None
+libs = None
 
-setup(name = "orzoj", ext_modules = [module])
+if platform.system() == "Linux":
+    # zstd is optional, needed for compressed data files
+    if subprocess.call(["pkg-config", "--exists", "libzstd"]) == 0:
+        cflags = ["-DORZOJ_HAVE_ZSTD"]
+        cflags.extend(subprocess.check_output(["pkg-config", "--cflags", "libzstd"]).split())
+        libs = subprocess.check_output(["pkg-config", "--libs", "libzstd"]).split()
+
+module = Extension("orzoj._filecmp", sources = ["_filecmp.c"],
+        extra_compile_args = cflags,
+        extra_link_args = libs)
+
+module_zdata = Extension("orzoj._zdata", sources = ["_zdata.c"],
+        extra_compile_args = cflags,
+        extra_link_args = libs)
+
+setup(name = "orzoj", ext_modules = [module, module_zdata])
 
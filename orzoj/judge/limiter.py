@@ -21,13 +21,16 @@
 #
 """parse limiter configuration and export functions to use limiter"""
 
-import subprocess, tempfile, struct, os, sys, time, uuid
+import subprocess, tempfile, struct, os, sys, time, uuid, platform
 
 from orzoj import conf, log
 
 if conf.is_unix:
     import socket
 
+_libc = None
+_CPU_SET_SIZE = 128 # sizeof(cpu_set_t) in glibc
+
 limiter_dict = {}
 
 class SysError(Exception):
@@ -41,6 +44,16 @@ class SysError(Exception):
 class _empty_class:
     pass
 
+class Result:
+    def __init__(self):
+        """execution result returned by _Limiter.run"""
+        self.exe_status = None
+        self.exe_time = None  # in microseconds
+        self.exe_mem = None  # in kb
+        self.exe_extra_info = None
+        self.stdout = None
+        self.stderr = None
+
 SAVE_OUTPUT = _empty_class()
 
 _LIMITER_SOCKET = 0
@@ -66,6 +79,46 @@ def get_null_dev(for_writing = True):
         log.error("failed to open NULL device: {0}", e)
         raise SysError("limiter system error")
 
+def parse_cpu_list(arg):
+    """parse CPU numbers given in a configuration option @arg (which can
+    be written as ranges like 0-3) and return a list of them;
+    may raise conf.UserError"""
+    global _libc
+    if platform.system() != "Linux":
+        raise conf.UserError("Option {0} is only available on Linux" . format(arg[0]))
+    ret = list()
+    try:
+        for i in arg[1:]:
+            if i is None:
+                continue
+            if '-' in i:
+                (a, b) = i.split('-')
+                ret.extend(range(int(a), int(b) + 1))
+            else:
+                ret.append(int(i))
+    except ValueError:
+        raise conf.UserError("Option {0}: invalid CPU number" . format(arg[0]))
+    if not ret:
+        raise conf.UserError("Option {0} takes at least one argument" . format(arg[0]))
+    ncpu = min(os.sysconf("SC_NPROCESSORS_CONF"), _CPU_SET_SIZE * 8)
+    for i in ret:
+        if i < 0 or i >= ncpu:
+            raise conf.UserError("Option {0}: invalid CPU number {1}" . format(arg[0], i))
+    if _libc is None:
+        import ctypes
+        _libc = ctypes.CDLL(None, use_errno = True)
+    return ret
+
+def _set_affinity(cpus):
+    """bind the calling process to CPUs in @cpus"""
+    import ctypes
+    mask = [0] * _CPU_SET_SIZE
+    for i in cpus:
+        mask[i // 8] |= 1 << (i % 8)
+    buf = ctypes.create_string_buffer("".join(chr(i) for i in mask), _CPU_SET_SIZE)
+    if _libc.sched_setaffinity(0, _CPU_SET_SIZE, buf):
+        raise OSError(ctypes.get_errno(), "failed to set CPU affinity")
+
 def eval_arg(s, var_dict):
     """evaluate the argument"""
     class _eval_error(Exception):
@@ -132,12 +185,7 @@ class _Limiter:
                 raise conf.UserError("{0}: socket method is only avaliable on Unix systems" . format(args[0]))
             self._type = _LIMITER_SOCKET
             try:
-                self._socket_name = "orzoj-limiter-socket.{0}" . format(str(uuid.uuid4()))
-
-                s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-                s.bind("\0{0}".format(self._socket_name))
-                s.listen(1)
-                self._socket = s
+                self._make_socket()[1].close()
             except Exception as e:
                 raise conf.UserError("[limiter {0!r}] failed to establish socket: {1}" .
                         format(self._name, e))
@@ -153,26 +201,37 @@ class _Limiter:
             raise conf.UserError("duplicated limiter name: {0!r}" . format(args[1]))
         limiter_dict[args[1]] = self
 
-    def __del_(self):
-        if self._type == _LIMITER_SOCKET:
-            try:
-                self._socket.close()
-            except Exception as e:
-                log.warning("failed to close socket: {0}" . format(e))
-
-    def run(self, var_dict, stdin = None, stdout = None, stderr = None):
+    def _make_socket(self):
+        """return a tuple(<name>, <listening socket>);
+        a socket is used for each run, so that the limiter can be run
+        by several threads at the same time"""
+        name = "orzoj-limiter-socket.{0}" . format(str(uuid.uuid4()))
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            s.bind("\0{0}".format(name))
+            s.listen(1)
+        except:
+            s.close()
+            raise
+        return (name, s)
+
+    def run(self, var_dict, stdin = None, stdout = None, stderr = None, umask = None,
+            cpus = None):
         """run the limiter under variables defined in @var_dict
         Note: @var_dict may be changed
         
-        execution result can be accessed via self.exe_status, self.exe_time (in microseconds),
-        self.exe_mem (in kb) and self.exe_extra_info
+        return an instance of Result
 
         if @stdout and/or @stderr is SAVE_OUTPUT, stdout and/or stderr will be stored
-        in self.stdout and self.stderr
+        in stdout and stderr of the result
+
+        if @umask is not None, it is set as the umask of the limiter process
+
+        if @cpus is not None, the limiter process is bound to CPUs in the list
+        (see parse_cpu_list)
         """
 
-        self.stdout = None
-        self.stderr = None
+        res = Result()
 
         if self._type == _LIMITER_FILE:
             try:
@@ -183,84 +242,105 @@ class _Limiter:
                         format(self._name, e))
                 raise SysError("limiter communication error")
         else:
-            var_dict["SOCKNAME"] = self._socket_name
-
-
-        try:
-            args = eval_arg_list(self._args, var_dict)
-        except Exception as e:
-            log.error("[limiter {0!r}] failed to evaluate argument: {1}" .
-                    format(self._name, e))
-            raise SysError("limiter configuration error")
-
-        log.debug("executing command: {0!r}" . format(args))
-
-        try:
-            stdout_ = stdout
-            if stdout_ is SAVE_OUTPUT:
-                stdout_ = subprocess.PIPE
-            stderr_ = stderr
-            if stderr_ is SAVE_OUTPUT:
-                stderr_ = subprocess.PIPE
-
-            p = subprocess.Popen(args, stdin = stdin, stdout = stdout_, stderr = stderr_)
-        except OSError as e:
-            log.error("error while calling Popen [errno {0}] "
-                    "[filename {1!r}]: {2}" . format(e.errno, e.filename, e.strerror))
-            raise SysError("failed to execute limiter")
-        except Exception as e:
-            log.error("error while calling Popen: {0}" .  format(e))
-            raise SysError("failed to execute limiter")
-
-        if self._type == _LIMITER_SOCKET:
             try:
-                s = self._socket
-                s.settimeout(1)
-                (conn, addr) = s.accept()
-                s.settimeout(None)
-                (self.exe_status, self.exe_time, self.exe_mem, info_len) = \
-                        struct.unpack("IIII", conn.recv(16))
-                if info_len:
-                    self.exe_extra_info = conn.recv(info_len)
-                else:
-                    self.exe_extra_info = ''
-            except socket.timeout:
-                log.error("[limiter {0!r}] socket timed out" .
-                        format(self._name))
-                raise SysError("limiter socket error")
+                (var_dict["SOCKNAME"], s) = self._make_socket()
             except Exception as e:
-                log.error("[limiter {0!r}] failed to retrieve data through socket: {1}" .
+                log.error("[limiter {0!r}] failed to establish socket: {1}" .
                         format(self._name, e))
-                raise SysError("limiter socket error")
-
-        if stdout is SAVE_OUTPUT or stderr is SAVE_OUTPUT:
-            (self.stdout, self.stderr) = p.communicate()
-        else:
-            p.wait()
-
-        log.debug('the command above now finished')
+                raise SysError("limiter communication error")
 
-        if self._type == _LIMITER_FILE:
+        try:
             try:
-                with open(ftmp[1], 'rb') as f:
-                    (self.exe_status, self.exe_time, self.exe_mem, info_len) = \
-                            struct.unpack("IIII", f.read(16))
-                    if info_len:
-                        self.exe_extra_info = f.read(info_len)
-                    else:
-                        self.exe_extra_info = ''
-                os.close(ftmp[0])
-                os.remove(ftmp[1])
+                args = eval_arg_list(self._args, var_dict)
             except Exception as e:
-                log.error("[limiter {0!r}] failed to retrieve data through file: {1}" .
+                log.error("[limiter {0!r}] failed to evaluate argument: {1}" .
                         format(self._name, e))
-                raise SysError("limiter file error")
+                raise SysError("limiter configuration error")
+
+            log.debug("executing command: {0!r}" . format(args))
 
-        if self._type == _LIMITER_SOCKET:
             try:
-                conn.close()
+                stdout_ = stdout
+                if stdout_ is SAVE_OUTPUT:
+                    stdout_ = subprocess.PIPE
+                stderr_ = stderr
+                if stderr_ is SAVE_OUTPUT:
+                    stderr_ = subprocess.PIPE
+
+                preexec_fn = None
+                if umask is not None or cpus is not None:
+                    def preexec_fn():
+                        if umask is not None:
+                            os.umask(umask)
+                        if cpus is not None:
+                            _set_affinity(cpus)
+
+                # close_fds, so that pipes created by other threads at the same
+                # time are not inherited
+                p = subprocess.Popen(args, stdin = stdin, stdout = stdout_, stderr = stderr_,
+                        preexec_fn = preexec_fn, close_fds = conf.is_unix)
+            except OSError as e:
+                log.error("error while calling Popen [errno {0}] "
+                        "[filename {1!r}]: {2}" . format(e.errno, e.filename, e.strerror))
+                raise SysError("failed to execute limiter")
             except Exception as e:
-                log.warning("failed to close socket connection: {0}".format(e))
+                log.error("error while calling Popen: {0}" .  format(e))
+                raise SysError("failed to execute limiter")
+
+            if self._type == _LIMITER_SOCKET:
+                try:
+                    s.settimeout(1)
+                    (conn, addr) = s.accept()
+                    s.settimeout(None)
+                    (res.exe_status, res.exe_time, res.exe_mem, info_len) = \
+                            struct.unpack("IIII", conn.recv(16))
+                    if info_len:
+                        res.exe_extra_info = conn.recv(info_len)
+                    else:
+                        res.exe_extra_info = ''
+                except socket.timeout:
+                    log.error("[limiter {0!r}] socket timed out" .
+                            format(self._name))
+                    raise SysError("limiter socket error")
+                except Exception as e:
+                    log.error("[limiter {0!r}] failed to retrieve data through socket: {1}" .
+                            format(self._name, e))
+                    raise SysError("limiter socket error")
+
+            if stdout is SAVE_OUTPUT or stderr is SAVE_OUTPUT:
+                (res.stdout, res.stderr) = p.communicate()
+            else:
+                p.wait()
+
+            log.debug('the command above now finished')
+
+            if self._type == _LIMITER_FILE:
+                try:
+                    with open(ftmp[1], 'rb') as f:
+                        (res.exe_status, res.exe_time, res.exe_mem, info_len) = \
+                                struct.unpack("IIII", f.read(16))
+                        if info_len:
+                            res.exe_extra_info = f.read(info_len)
+                        else:
+                            res.exe_extra_info = ''
+                    os.close(ftmp[0])
+                    os.remove(ftmp[1])
+                except Exception as e:
+                    log.error("[limiter {0!r}] failed to retrieve data through file: {1}" .
+                            format(self._name, e))
+                    raise SysError("limiter file error")
+
+            if self._type == _LIMITER_SOCKET:
+                try:
+                    conn.close()
+                except Exception as e:
+                    log.warning("failed to close socket connection: {0}".format(e))
+
+            return res
+
+        finally:
+            if self._type == _LIMITER_SOCKET:
+                s.close()
 
 def _ch_add_limiter(args):
     if len(args) == 1:
@@ -22,15 +22,25 @@
 
 """parse problem configuration file (XML)"""
 
-import os.path, shlex
+import os, os.path, shlex, tempfile, fractions
 from xml.etree.ElementTree import ElementTree
 
 from orzoj import log, structures, conf
-from orzoj.judge import core, _filecmp
+from orzoj.judge import core, _filecmp, _zdata
 
 _PROBCONF_FILE = "probconf.xml"
 _verifier_cache = None
 
+# policies of skipping the remaining cases after a case fails
+# (gets less than its full score):
+SKIP_NONE = None
+SKIP_ALL = "all"        # skip all the remaining cases
+SKIP_GROUP = "group"    # skip the remaining cases in the same group
+
+# scoring modes of a group:
+SCORE_SUM = "sum"       # the score of each case counts
+SCORE_MIN = "min"       # the group gets the lowest score ratio of its cases
+
 class Error(Exception):
     def __init__(self, msg):
         self.msg = msg
@@ -54,6 +64,15 @@ class Case_conf:
         self.time = None        # integer, milliseconds
         self.mem = None         # integer, kb
         self.score = None       # integer
+        self.group = None       # Group_conf, or None if not in a group
+
+class Group_conf:
+    def __init__(self):
+        self.name = None        # string, or None
+        self.case = []          # list of Case_conf
+        self.score = SCORE_SUM  # one of SCORE_*
+        self.depends = []       # list of Group_conf whose score ratios bound
+                                # that of this group
 
 class Prob_conf:
     def __init__(self, pcode):
@@ -66,6 +85,8 @@ class Prob_conf:
                                 #   if @score is None, there is something wrong with the verifier
         self.extra_input = None # list, or None
         self.case = []          # list of Case_conf
+        self.group = []         # list of Group_conf
+        self.skip = SKIP_NONE   # one of SKIP_*
 
         self._pcode = pcode
         self._parse()
@@ -99,6 +120,10 @@ class Prob_conf:
 
     def _parse_1d0(self, root): # for version 1.0
         global _verifier_cache
+        units = list()
+        # cases and groups in the order of declaration
+        depends = dict()
+        # Group_conf => list of names of the groups it depends on
         for section in root:
             try:
                 if section.tag == "compiler":
@@ -165,17 +190,37 @@ class Prob_conf:
                 if section.tag == "extra":
                     if self.extra_input is None:
                         self.extra_input = list()
-                    self.extra_input.append(section.attrib["file"])
+                    self.extra_input.append(self._data_file(section.attrib["file"]))
                     continue
 
                 if section.tag == "case":
-                    case = Case_conf()
-                    case.stdin = section.attrib["input"]
-                    case.stdout = section.attrib["output"]
-                    case.time = int(section.attrib["time"])
-                    case.mem = int(section.attrib["mem"])
-                    case.score = int(section.attrib["score"])
-                    self.case.append(case)
+                    units.append(self._parse_case(section))
+                    continue
+
+                if section.tag == "group":
+                    group = Group_conf()
+                    group.name = section.attrib.get("name")
+                    group.score = section.attrib.get("score", SCORE_SUM)
+                    if group.score not in (SCORE_SUM, SCORE_MIN):
+                        raise _Parse_error("unknown scoring mode: {0!r}" . format(group.score))
+                    depends[group] = section.attrib.get("depends", "").split()
+                    for i in section:
+                        if i.tag != "case":
+                            raise _Parse_error("unknown tag {0!r} in 'group'" . format(i.tag))
+                        case = self._parse_case(i)
+                        case.group = group
+                        group.case.append(case)
+                    if not group.case:
+                        raise _Parse_error("empty group")
+                    units.append(group)
+                    self.group.append(group)
+                    continue
+
+                if section.tag == "skip":
+                    policy = section.attrib["policy"]
+                    if policy not in (SKIP_ALL, SKIP_GROUP):
+                        raise _Parse_error("unknown skip policy: {0!r}" . format(policy))
+                    self.skip = policy
                     continue
             except _Parse_error:
                 raise
@@ -186,6 +231,157 @@ class Prob_conf:
         if self.verify_func is None:
             raise _Parse_error("no verifier specified")
 
+        names = dict()
+        for group in self.group:
+            if group.name is None:
+                continue
+            if group.name in names:
+                raise _Parse_error("duplicated group name: {0!r}" . format(group.name))
+            names[group.name] = group
+        for (group, dep) in depends.iteritems():
+            for i in dep:
+                if i not in names:
+                    raise _Parse_error("group {0!r} depends on unknown group {1!r}" .
+                            format(group.name, i))
+                if names[i] not in group.depends:
+                    group.depends.append(names[i])
+
+        self.case = _schedule(units)
+
+    def new_scoring(self):
+        """return a new instance of Scoring for a judge process"""
+        return Scoring(self)
+
+    def cases_to_skip(self, num):
+        """return the list of indexes of the cases to be skipped according to
+        the skip policy after case @num (index in self.case) fails"""
+        if self.skip == SKIP_ALL:
+            return range(num + 1, len(self.case))
+        group = self.case[num].group
+        if self.skip == SKIP_GROUP and group is not None:
+            return [i for i in range(num + 1, len(self.case))
+                    if self.case[i].group is group]
+        return []
+
+    def _parse_case(self, section):
+        case = Case_conf()
+        case.stdin = self._data_file(section.attrib["input"])
+        case.stdout = self._data_file(section.attrib["output"])
+        case.time = int(section.attrib["time"])
+        case.mem = int(section.attrib["mem"])
+        case.score = int(section.attrib["score"])
+        return case
+
+    def _data_file(self, fname):
+        """return the name of data file @fname as stored in the data directory,
+        which is @fname with core.COMPRESSED_SUFFIX appended if only the
+        compressed version exists"""
+        if not os.path.exists(os.path.join(self._pcode, fname)) and \
+                os.path.exists(os.path.join(self._pcode, fname + core.COMPRESSED_SUFFIX)):
+            fname += core.COMPRESSED_SUFFIX
+        if core.is_compressed(fname) and not _zdata.available:
+            raise _Parse_error("compressed data file {0!r} is not supported by this judge" .
+                    format(fname))
+        return fname
+
+class Scoring:
+    def __init__(self, pconf):
+        """keep track of the results of the cases of @pconf (an instance of Prob_conf),
+        which are judged in the order of pconf.case, to decide which cases
+        need not be run and the final score of each case"""
+        self._pconf = pconf
+        self._skipped = set()   # indexes of the cases not to be run
+        self._pending = list()  # case_result of the judged cases in the current group
+        self._ratio = dict()    # Group_conf => fractions.Fraction, score ratio
+                                # of a finished group
+
+    def skip(self, num):
+        """return whether case @num (index in pconf.case) need not be run"""
+        if num in self._skipped:
+            return True
+        group = self._pconf.case[num].group
+        return group is not None and self._bound(group) == 0
+
+    def add(self, num, result):
+        """add @result (an instance of structures.case_result) of case @num;
+        return the list of results whose scores are final since then, in the
+        order of the cases; the results of a group are final after its last case"""
+        pconf = self._pconf
+        case = pconf.case[num]
+        group = case.group
+        if result.score < case.score:
+            self._skipped.update(pconf.cases_to_skip(num))
+            if group is not None and group.score == SCORE_MIN and result.score <= 0:
+                # the group gets 0 anyway
+                self._skipped.update(i for i in range(num + 1, len(pconf.case))
+                        if pconf.case[i].group is group)
+        if group is None:
+            return [result]
+
+        self._pending.append(result)
+        if case is not group.case[-1]:
+            return []
+        ret = self._pending
+        self._pending = list()
+        self._finish(group, ret)
+        return ret
+
+    def _bound(self, group):
+        """return the upper bound of the score ratio of @group set by the
+        groups it depends on"""
+        return min([self._ratio[i] for i in group.depends] + [fractions.Fraction(1)])
+
+    def _finish(self, group, results):
+        ratio = self._bound(group)
+        if group.score == SCORE_MIN:
+            for (case, res) in zip(group.case, results):
+                if case.score > 0:
+                    ratio = min(ratio, fractions.Fraction(res.score, case.score))
+            got = 0
+            full = 0
+            for (case, res) in zip(group.case, results):
+                res.score = int(case.score * ratio)
+                got += res.score
+                full += case.score
+            if full:
+                ratio = min(ratio, fractions.Fraction(got, full))
+        else:
+            got = sum(res.score for res in results)
+            full = sum(case.score for case in group.case)
+            own = fractions.Fraction(1)
+            if full:
+                own = min(own, fractions.Fraction(got, full))
+            if ratio < own:
+                # scale the cases down so that the group gets at most
+                # @ratio of its full score
+                for res in results:
+                    res.score = int(res.score * ratio / own)
+            else:
+                ratio = own
+        self._ratio[group] = ratio
+
+def _schedule(units):
+    """return the list of cases in @units (a list of Case_conf and Group_conf)
+    in the order to be judged, which is the order in @units except that a group
+    is moved after the groups it depends on"""
+    ret = list()
+    done = set()
+    units = list(units)
+    while units:
+        for (num, unit) in enumerate(units):
+            if not isinstance(unit, Group_conf):
+                ret.append(unit)
+                break
+            if all(i in done for i in unit.depends):
+                ret.extend(unit.case)
+                done.add(unit)
+                break
+        else:
+            raise _Parse_error("circular dependency among groups: {0}" .
+                    format(", " . join(repr(i.name) for i in units if isinstance(i, Group_conf))))
+        del units[num]
+    return ret
+
 def _std_verifier(score, fstdin, fstdout, fusrout):
     (ok, info) = _filecmp.filecmp(fstdout, fusrout)
     if ok:
@@ -194,7 +390,31 @@ def _std_verifier(score, fstdin, fstdout, fusrout):
 
 def _build_verifier(pcode, lang, time, mem, verifier_path):
     """@lang is an instance of core._Lang"""
+    def decompress(fpath, ftmp):
+        # verifiers are given uncompressed files
+        if not core.is_compressed(fpath):
+            return fpath
+        (fd, fpath_tmp) = tempfile.mkstemp('orzoj')
+        os.close(fd)
+        ftmp.append(fpath_tmp)
+        core.copy_data(fpath, fpath_tmp)
+        return fpath_tmp
+
     def func(score, fstdin, fstdout, fusrout):
+        ftmp = list()
+        try:
+            fstdin = decompress(fstdin, ftmp)
+            fstdout = decompress(fstdout, ftmp)
+            return func_real(score, fstdin, fstdout, fusrout)
+        except (EnvironmentError, _zdata.error) as e:
+            log.error("[pcode {0!r}] failed to decompress data for verifier: {1}" .
+                    format(pcode, e))
+            return (None, "failed to decompress data")
+        finally:
+            for i in ftmp:
+                os.remove(i)
+
+    def func_real(score, fstdin, fstdout, fusrout):
         score = str(score)
         fstdin = os.path.abspath(fstdin)
         fstdout = os.path.abspath(fstdout)
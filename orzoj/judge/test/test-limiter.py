@@ -10,14 +10,14 @@ l = limiter.limiter_dict["default"]
 for i in range(2):
 
     with open("prog.in", "r") as f:
-        l.run({"TARGET" : ["./prog", "arg1", "arg2"]}, stdin = f,
-                stdout = limiter.SAVE_OUTPUT, stderr = limiter.NULL)
+        r = l.run({"TARGET" : ["./prog", "arg1", "arg2"]}, stdin = f,
+                stdout = limiter.SAVE_OUTPUT, stderr = limiter.get_null_dev())
 
-    print "l.stdout={0!r}\nl.stderr={1!r}".format(l.stdout, l.stderr)
+    print "r.stdout={0!r}\nr.stderr={1!r}".format(r.stdout, r.stderr)
 
-    print "execution status:", l.exe_status
-    print "time: {0} [sec]" .format(l.exe_time * 1e-6)
-    print "mem: {0} [kb]" . format(l.exe_mem)
-    print "extra infomation: {0!r}" . format(l.exe_extra_info)
+    print "execution status:", r.exe_status
+    print "time: {0} [sec]" .format(r.exe_time * 1e-6)
+    print "mem: {0} [kb]" . format(r.exe_mem)
+    print "extra infomation: {0!r}" . format(r.exe_extra_info)
 
 
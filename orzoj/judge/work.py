@@ -22,13 +22,23 @@
 
 """connect to orzoj-server and wait for tasks"""
 
-import platform, os, os.path, traceback
+import platform, os, os.path, traceback, threading
 
-from orzoj import msg, snc, conf, log, control, sync_dir
-from orzoj.judge import core, probconf
+from orzoj import msg, snc, conf, log, control, sync_dir, mux, zstream
+from orzoj.judge import core, probconf, compile_cache, jvm
 
 _judge_id = None
 
+_peer_port = 0
+_peer_addr = ""
+_peer_max_uploads = None
+
+_nslot = None
+
+_prob_lock = dict()
+# dict of <problem code> => <_Prob_lock>
+_prob_lock_lock = threading.Lock()
+
 _info_dict = {
     "platform" : platform.platform()
 }
@@ -44,20 +54,109 @@ except:
 class Error(Exception):
     pass
 
+class _Prob_lock:
+    def __init__(self):
+        """lock of the data directory of a problem, held shared by the slots
+        judging the problem and exclusively while the data are modified;
+        self.sync is held while synchronizing the data and parsing the
+        configuration, and only its holder may take the lock exclusively"""
+        self.sync = threading.Lock()
+        self._cond = threading.Condition(threading.Lock())
+        self._nshared = 0
+        self._exclusive = False
+
+    def acquire_shared(self):
+        with self._cond:
+            while self._exclusive:
+                self._cond.wait()
+            self._nshared += 1
+
+    def release_shared(self):
+        with self._cond:
+            self._nshared -= 1
+            if not self._nshared:
+                self._cond.notify_all()
+
+    def acquire_exclusive(self, conn):
+        """wait until no slot is judging the problem, sending TELL_ONLINE
+        via @conn meanwhile; release_exclusive must be called even if
+        snc.Error is raised"""
+        with self._cond:
+            self._exclusive = True
+        while True:
+            with self._cond:
+                if not self._nshared:
+                    return
+                self._cond.wait(conn.heartbeat_interval)
+                if not self._nshared:
+                    return
+            msg.tell_online(conn)
+
+    def release_exclusive(self):
+        with self._cond:
+            if self._exclusive:
+                self._exclusive = False
+                self._cond.notify_all()
+
+
+class _thread_peer_server(threading.Thread):
+    def __init__(self):
+        """serve the data cache to other judges"""
+        threading.Thread.__init__(self, name = "work._thread_peer_server")
+        self.daemon = True
+        global _peer_max_uploads
+        self._sem = threading.Semaphore(_peer_max_uploads)
+
+    def run(self):
+        global _peer_port
+        try:
+            s = snc.socket(None, _peer_port)
+        except snc.Error:
+            log.error("failed to listen on port {0} for other judges" . format(_peer_port))
+            return
+
+        log.info("serving data cache to other judges on port {0}" . format(_peer_port))
+
+        while not control.test_termination_flag():
+            try:
+                (sock, addr) = s.accept(1)
+            except snc.ErrorTimeout:
+                continue
+            except snc.Error:
+                break
+
+            if not self._sem.acquire(False):
+                log.warning("too many judges fetching data, refused {0!r}" . format(addr))
+                sock.close()
+                continue
+
+            th = threading.Thread(target = self._serve, args = (sock, addr),
+                    name = "work._thread_peer_server._serve")
+            th.daemon = True
+            th.start()
+
+        s.close()
+
+    def _serve(self, sock, addr):
+        try:
+            conn = snc.snc(sock, True)
+            log.info("serving data cache to {0!r}" . format(addr))
+            sync_dir.serve_peer(conn)
+            conn.close()
+        except snc.Error:
+            pass
+        finally:
+            sock.close()
+            self._sem.release()
+
 
 def connect(sock):
     """connect to orzoj-server via socket @sock
     
     may raise Error"""
 
-    def _write_msg(m):
-        msg.write_msg(conn, m)
-
-    def _write_str(s):
-        conn.write_str(s)
-
-    def _write_uint32(v):
-        conn.write_uint32(v)
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
 
     def _read_msg(timeout = 0):
         return msg.read_msg(conn, timeout)
@@ -68,20 +167,28 @@ def connect(sock):
     def _read_uint32():
         return conn.read_uint32()
 
-    def _check_msg(m):
-        if m != _read_msg():
-            log.error("message check error.")
-            raise Error
     try:
+        if _peer_port:
+            _thread_peer_server().start()
+
         conn = snc.snc(sock)
 
-        _write_msg(msg.HELLO)
         global _judge_id
-        _write_str(_judge_id)
-        _write_uint32(msg.PROTOCOL_VERSION)
-        _write_uint32(len(core.lang_dict))
-        for i in core.lang_dict:
-            _write_str(i)
+        hello = [_judge_id, msg.PROTOCOL_VERSION, len(core.lang_dict)]
+        hello.extend(core.lang_dict)
+        hello.extend([_peer_addr, _peer_port])
+        algos = sync_dir.algorithms()
+        hello.append(len(algos))
+        hello.extend(algos)
+        formats = sync_dir.archive_formats()
+        hello.append(len(formats))
+        hello.extend(formats)
+        hello.append(_nslot)
+        methods = zstream.methods()
+        hello.append(len(methods))
+        hello.extend(methods)
+        hello.append(int(snc.heartbeat_interval() * 1000))
+        _write_msg(msg.HELLO, *hello)
 
         m = _read_msg()
         if m == msg.ERROR:
@@ -102,36 +209,141 @@ def connect(sock):
                     format(m))
             raise Error
 
-        log.info('connection established')
+        hash_algo = _read_str()
+        if hash_algo not in algos:
+            log.error("orzoj-server chose unsupported checksum algorithm {0!r}" .
+                    format(hash_algo))
+            raise Error
+
+        compression = _read_str()
+        if compression and compression not in methods:
+            log.error("orzoj-server chose unsupported compression method {0!r}" .
+                    format(compression))
+            raise Error
 
-        while not control.test_termination_flag():
-            m = _read_msg()
+        log.info("connection established, using checksum algorithm {0!r}" .
+                format(hash_algo))
 
-            if m == msg.TELL_ONLINE:
-                continue
+        heartbeat = max(_read_uint32() / 1000.0, msg.TELL_ONLINE_INTERVAL)
 
-            if m == msg.ERROR:
-                log.warning("failed to work: orzoj-server says an error happens there")
-                raise Error
+        if compression:
+            log.info("messages are compressed by {0!r}" . format(compression))
+            conn = zstream.Conn(conn, compression)
+        conn.heartbeat_interval = heartbeat
 
-            if m == msg.QUERY_INFO:
-                global _info_dict
-                q = _read_str()
-                _write_msg(msg.ANS_QUERY)
-                try:
-                    _write_str(_info_dict[q])
-                except KeyError:
-                    _write_str("unknown")
-                continue
+        _serve(conn, core.Slot(0), hash_algo, formats)
 
-            if m != msg.PREPARE_DATA:
-                log.error("unexpected message from orzoj-server: {0}" .  format(m))
-                raise Error
+    except snc.Error as e:
+        log.error("failed to communicate with orzoj-server because of network error")
+        control.set_termination_flag()
+        raise Error
+
+    except core.Error:
+        control.set_termination_flag()
+        raise Error
+
+def _get_prob_lock(pcode):
+    global _prob_lock, _prob_lock_lock
+    with _prob_lock_lock:
+        try:
+            return _prob_lock[pcode]
+        except KeyError:
+            ret = _Prob_lock()
+            _prob_lock[pcode] = ret
+            return ret
+
+def _recv_data(lock, pcode, conn, hash_algo, formats):
+    """synchronize the data of @pcode via @conn, with lock.sync held;
+    wait for the slots judging the problem to finish if the data change
+
+    may raise sync_dir.Error or snc.Error"""
+    try:
+        return sync_dir.recv(pcode, conn, hash_algo, formats,
+                lambda: lock.acquire_exclusive(conn))
+    finally:
+        lock.release_exclusive()
+
+def _serve(conn, slot, hash_algo, formats):
+    """wait for tasks from @conn and judge them in @slot;
+    for slot 0, the connection may be switched to multiplexed mode by MUX_BEGIN
+
+    may raise Error, snc.Error or core.Error"""
+
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
+
+    def _read_msg(timeout = 0):
+        return msg.read_msg(conn, timeout)
+
+    def _read_str():
+        return conn.read_str()
 
+    def _read_uint32():
+        return conn.read_uint32()
+
+    def _check_msg(m):
+        if m != _read_msg():
+            log.error("message check error.")
+            raise Error
+
+    if slot.num:
+        log_prefix = "[slot {0}] " . format(slot.num)
+    else:
+        log_prefix = ""
+
+    while not control.test_termination_flag():
+        m = _read_msg()
+
+        if m == msg.TELL_ONLINE:
+            continue
+
+        if m == msg.ERROR:
+            log.warning("failed to work: orzoj-server says an error happens there")
+            raise Error
+
+        if m == msg.QUERY_INFO:
+            global _info_dict
+            q = _read_str()
+            try:
+                if q == "compile_cache" and compile_cache.enabled():
+                    ans = compile_cache.stats()
+                elif q == "java_startup" and jvm.startup_time is not None:
+                    ans = "{0} ms" . format(jvm.startup_time // 1000)
+                else:
+                    ans = _info_dict[q]
+            except KeyError:
+                ans = "unknown"
+            _write_msg(msg.ANS_QUERY, ans)
+            continue
+
+        if m == msg.MUX_BEGIN and not slot.num:
+            _serve_mux(conn, _read_uint32(), hash_algo, formats)
+            return
+
+        if m == msg.PREFETCH_DATA:
             pcode = _read_str()
-            log.info("received task for problem {0!r}" . format(pcode))
+            log.info("{0}prefetching data for problem {1!r}" . format(log_prefix, pcode))
             try:
-                speed = sync_dir.recv(pcode, conn)
+                lock = _get_prob_lock(pcode)
+                with lock.sync:
+                    speed = _recv_data(lock, pcode, conn, hash_algo, formats)
+                if speed:
+                    log.info("file transfer speed: {0!r}" . format(speed))
+            except sync_dir.Error:
+                log.error("failed to prefetch data for problem {0!r}" . format(pcode))
+                raise Error
+            continue
+
+        if m != msg.PREPARE_DATA:
+            log.error("unexpected message from orzoj-server: {0}" .  format(m))
+            raise Error
+
+        pcode = _read_str()
+        log.info("{0}received task for problem {1!r}" . format(log_prefix, pcode))
+        lock = _get_prob_lock(pcode)
+        with lock.sync:
+            try:
+                speed = _recv_data(lock, pcode, conn, hash_algo, formats)
                 if speed:
                     log.info("file transfer speed: {0!r}" . format(speed))
 
@@ -143,14 +355,16 @@ def connect(sock):
                 pconf = probconf.Prob_conf(pcode)
             except Exception as e:
                 errmsg = "failed to parse problem configuration: {0}" . format(e)
-                _write_msg(msg.DATA_ERROR)
-                _write_str(errmsg)
+                _write_msg(msg.DATA_ERROR, errmsg)
                 log.error(errmsg)
                 log.debug(traceback.format_exc())
                 continue
 
-            _write_msg(msg.DATA_OK)
-            _write_uint32(len(pconf.case))
+            # the data must not change until the task is judged
+            lock.acquire_shared()
+
+        try:
+            _write_msg(msg.DATA_OK, len(pconf.case))
 
             _check_msg(msg.START_JUDGE)
             lang = _read_str()
@@ -158,16 +372,43 @@ def connect(sock):
             input = _read_str()
             output = _read_str()
 
-            core.lang_dict[lang].judge(conn, pcode, pconf, src, input, output)
+            core.lang_dict[lang].judge(conn, pcode, pconf, src, input, output, slot)
+        finally:
+            lock.release_shared()
 
-    except snc.Error as e:
-        log.error("failed to communicate with orzoj-server because of network error")
-        control.set_termination_flag()
-        raise Error
-
-    except core.Error:
-        control.set_termination_flag()
-        raise Error
+def _serve_mux(conn, nslot, hash_algo, formats):
+    """work on @nslot tasks at the same time over @conn in multiplexed mode
+    
+    may raise Error, snc.Error or core.Error"""
+    log.info("working with {0} slots" . format(nslot))
+    slots = [core.Slot(i + 1) for i in range(nslot)]
+    mx = mux.Mux(conn, nslot)
+    error = list()
+
+    def _run(slot):
+        try:
+            _serve(mx.stream(slot.num), slot, hash_algo, formats)
+        except (Error, snc.Error, core.Error) as e:
+            error.append(e)
+        except Exception as e:
+            log.error("[slot {0}] error happens: {1}" . format(slot.num, e))
+            log.debug(traceback.format_exc())
+            error.append(Error())
+        finally:
+            # stop the other slots
+            control.set_termination_flag()
+            mx.close()
+
+    threads = list()
+    for slot in slots:
+        th = threading.Thread(target = _run, args = (slot, ), name = "work._serve_mux._run")
+        th.start()
+        threads.append(th)
+    for th in threads:
+        while th.is_alive():
+            th.join(1)
+    if error:
+        raise error[0]
 
 def _set_datacache(arg):
     os.chdir(arg[1])
@@ -176,6 +417,30 @@ def _set_id(arg):
     global _judge_id
     _judge_id = arg[1]
 
+def _ch_peer_listen(arg):
+    if len(arg) == 1:
+        return
+    if len(arg) > 3:
+        raise conf.UserError("Option {0} takes one or two arguments" . format(arg[0]))
+    global _peer_port, _peer_addr
+    _peer_port = int(arg[1])
+    if _peer_port <= 0 or _peer_port > 65535:
+        raise conf.UserError("port must be between 0 and 65536")
+    if len(arg) == 3:
+        _peer_addr = arg[2]
+
+def _set_peer_max_uploads(arg):
+    global _peer_max_uploads
+    _peer_max_uploads = int(arg[1])
+    if _peer_max_uploads < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
+def _set_nslot(arg):
+    global _nslot
+    _nslot = int(arg[1])
+    if _nslot < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
 def _ch_set_info(arg):
     if len(arg) == 1:
         return
@@ -187,4 +452,7 @@ def _ch_set_info(arg):
 conf.simple_conf_handler("DataCache", _set_datacache)
 conf.simple_conf_handler("JudgeId", _set_id)
 conf.register_handler("SetInfo", _ch_set_info)
+conf.register_handler("PeerListen", _ch_peer_listen, no_dup = True)
+conf.simple_conf_handler("PeerMaxUploads", _set_peer_max_uploads, default = "4")
+conf.simple_conf_handler("Slots", _set_nslot, default = "1")
 
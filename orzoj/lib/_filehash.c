@@ -0,0 +1,397 @@
+/*
+ * $File: _filehash.c
+ * $Author: Jiakai <jia.kai66@gmail.com>
+ *
+ * usable compilation flags: ORZOJ_HAVE_XXHASH
+ */
+/*
+This file is part of orzoj
+
+Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+
+Orzoj is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orzoj is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// compute file digests for directory synchronization
+//
+// files are read into a large buffer of each thread and hashed by
+// several threads at the same time, without holding the GIL; they are
+// not mapped into memory, since accessing a mapping of a file truncated
+// meanwhile raises SIGBUS and kills the process
+//
+// supported algorithms:
+//	sha1		-- the algorithm used by orzoj before 0xff000004
+//	sha256		-- via OpenSSL
+//	xxh3-128	-- only if compiled with ORZOJ_HAVE_XXHASH; very fast,
+//					but not cryptographic, so only suitable for
+//					detecting changed files
+
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+
+#ifdef ORZOJ_HAVE_XXHASH
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#endif
+
+// size of the buffer of each thread, into which a file is read at a time
+#define READ_BUF_SIZE		(1 << 20)
+
+#define DIGEST_LEN_MAX		EVP_MAX_MD_SIZE
+
+enum Algo_t
+{
+	ALGO_SHA1,
+	ALGO_SHA256,
+	ALGO_XXH3_128
+};
+
+static const struct Algo_name
+{
+	const char *name;
+	enum Algo_t algo;
+} algo_names[] =
+{
+#ifdef ORZOJ_HAVE_XXHASH
+	{"xxh3-128", ALGO_XXH3_128},
+#endif
+	{"sha256", ALGO_SHA256},
+	{"sha1", ALGO_SHA1},
+	{NULL, 0}
+};
+
+struct File_task
+{
+	const char *path;
+	unsigned char digest[DIGEST_LEN_MAX];
+	unsigned int digest_len;
+	int err;	// errno on failure, 0 on success
+	const char *err_func;
+};
+
+struct Hash_ctx
+{
+	enum Algo_t algo;
+	struct File_task *task;
+	int ntask, next;
+	pthread_mutex_t lock;
+};
+
+static PyObject *filehash_error_obj;
+
+// return a tuple of names of supported algorithms, the most preferred first
+// module function
+static PyObject* algorithms(PyObject *self, PyObject *args);
+
+// args: (algo:str, paths:list of str, nthread:int)
+// return a list of binary digests of files in @paths, in the same order
+// if @nthread <= 0, the number of online processors is used
+// may raise error if any file can not be read
+// module function
+static PyObject* hash_files(PyObject *self, PyObject *args);
+
+static void* thread_hash(void *arg);
+
+// hash the file until EOF, reading it into @buf of READ_BUF_SIZE bytes
+// return 1 on success, 0 on failure (task->err and task->err_func are set)
+static int hash_one(enum Algo_t algo, struct File_task *task, unsigned char *buf);
+
+static PyMethodDef
+	methods_module[] =
+	{
+		{"algorithms", (PyCFunction)algorithms, METH_NOARGS, NULL},
+		{"hash_files", (PyCFunction)hash_files, METH_VARARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	};
+
+PyObject* algorithms(PyObject *self, PyObject *args)
+{
+	int cnt = 0, i;
+	PyObject *ret;
+	while (algo_names[cnt].name)
+		cnt ++;
+	if (!(ret = PyTuple_New(cnt)))
+		return NULL;
+	for (i = 0; i < cnt; i ++)
+	{
+		PyObject *name = PyString_FromString(algo_names[i].name);
+		if (!name)
+		{
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(ret, i, name);
+	}
+	return ret;
+}
+
+PyObject* hash_files(PyObject *self, PyObject *args)
+{
+	const char *algo_name;
+	PyObject *paths, *ret = NULL;
+	int nthread, i;
+	struct Hash_ctx ctx;
+	pthread_t *threads = NULL;
+	const struct Algo_name *a;
+
+	if (!PyArg_ParseTuple(args, "sO!i:hash_files", &algo_name,
+				&PyList_Type, &paths, &nthread))
+		return NULL;
+
+	for (a = algo_names; a->name; a ++)
+		if (!strcmp(a->name, algo_name))
+			break;
+	if (!a->name)
+		return PyErr_Format(filehash_error_obj, "unsupported algorithm: %s", algo_name);
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.algo = a->algo;
+	ctx.ntask = PyList_GET_SIZE(paths);
+
+	if (!(ret = PyList_New(ctx.ntask)))
+		return NULL;
+	if (!ctx.ntask)
+		return ret;
+
+	ctx.task = (struct File_task*)calloc(ctx.ntask, sizeof(struct File_task));
+	if (!ctx.task)
+		goto NOMEM;
+
+	// the list is not modified while the GIL is released, since
+	// the paths are borrowed from strings owned by the list
+	// and we hold a reference to it through @args
+	for (i = 0; i < ctx.ntask; i ++)
+	{
+		PyObject *p = PyList_GET_ITEM(paths, i);
+		if (!PyString_Check(p))
+		{
+			PyErr_SetString(PyExc_TypeError, "paths must be a list of str");
+			goto FAIL;
+		}
+		ctx.task[i].path = PyString_AS_STRING(p);
+	}
+
+	if (nthread <= 0)
+		nthread = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthread <= 0)
+		nthread = 1;
+	if (nthread > ctx.ntask)
+		nthread = ctx.ntask;
+
+	if (!(threads = (pthread_t*)malloc(sizeof(pthread_t) * nthread)))
+		goto NOMEM;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	Py_BEGIN_ALLOW_THREADS
+	int nstarted = 0;
+	for (i = 0; i < nthread; i ++)
+	{
+		if (pthread_create(threads + i, NULL, thread_hash, &ctx))
+			break;
+		nstarted ++;
+	}
+	if (!nstarted) // hash in this thread
+		thread_hash(&ctx);
+	for (i = 0; i < nstarted; i ++)
+		pthread_join(threads[i], NULL);
+	Py_END_ALLOW_THREADS
+
+	pthread_mutex_destroy(&ctx.lock);
+
+	for (i = 0; i < ctx.ntask; i ++)
+	{
+		struct File_task *t = ctx.task + i;
+		PyObject *digest;
+		if (t->err)
+		{
+			PyErr_Format(filehash_error_obj, "failed to hash file [func %s] [filename '%s']: %s",
+					t->err_func, t->path, strerror(t->err));
+			goto FAIL;
+		}
+		if (!(digest = PyString_FromStringAndSize((char*)t->digest, t->digest_len)))
+			goto FAIL;
+		PyList_SET_ITEM(ret, i, digest);
+	}
+
+	free(threads);
+	free(ctx.task);
+	return ret;
+
+NOMEM:
+	PyErr_NoMemory();
+FAIL:
+	free(threads);
+	free(ctx.task);
+	Py_XDECREF(ret);
+	return NULL;
+}
+
+void* thread_hash(void *arg)
+{
+	struct Hash_ctx *ctx = (struct Hash_ctx*)arg;
+	unsigned char *buf = (unsigned char*)malloc(READ_BUF_SIZE);
+	while (1)
+	{
+		int cur;
+		pthread_mutex_lock(&ctx->lock);
+		cur = ctx->next ++;
+		pthread_mutex_unlock(&ctx->lock);
+		if (cur >= ctx->ntask)
+			break;
+		if (buf)
+			hash_one(ctx->algo, ctx->task + cur, buf);
+		else
+		{
+			ctx->task[cur].err = ENOMEM;
+			ctx->task[cur].err_func = "malloc";
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+int hash_one(enum Algo_t algo, struct File_task *task, unsigned char *buf)
+{
+#define ERROR(_func_) \
+	do \
+	{ \
+		task->err = errno ? errno : EIO; \
+		task->err_func = _func_; \
+		goto FAIL; \
+	} while (0)
+
+	int fd;
+	ssize_t len;
+	EVP_MD_CTX *md_ctx = NULL;
+#ifdef ORZOJ_HAVE_XXHASH
+	XXH3_state_t *xxh_state = NULL;
+#endif
+
+	if ((fd = open(task->path, O_RDONLY)) < 0)
+	{
+		task->err = errno;
+		task->err_func = "open";
+		return 0;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	// OpenSSL does not set errno, so a stale value would be reported
+	errno = 0;
+	switch (algo)
+	{
+		case ALGO_SHA1:
+		case ALGO_SHA256:
+			if (!(md_ctx = EVP_MD_CTX_new()))
+				ERROR("EVP_MD_CTX_new");
+			if (!EVP_DigestInit_ex(md_ctx, algo == ALGO_SHA1 ? EVP_sha1() : EVP_sha256(), NULL))
+				ERROR("EVP_DigestInit_ex");
+			break;
+		case ALGO_XXH3_128:
+#ifdef ORZOJ_HAVE_XXHASH
+			if (!(xxh_state = XXH3_createState()))
+				ERROR("XXH3_createState");
+			XXH3_128bits_reset(xxh_state);
+#endif
+			break;
+	}
+
+	// a file truncated or extended meanwhile is hashed as read
+	while ((len = read(fd, buf, READ_BUF_SIZE)))
+	{
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ERROR("read");
+		}
+
+		if (md_ctx)
+		{
+			errno = 0;
+			if (!EVP_DigestUpdate(md_ctx, buf, len))
+				ERROR("EVP_DigestUpdate");
+		}
+#ifdef ORZOJ_HAVE_XXHASH
+		else XXH3_128bits_update(xxh_state, buf, len);
+#endif
+	}
+
+	if (md_ctx)
+	{
+		errno = 0;
+		if (!EVP_DigestFinal_ex(md_ctx, task->digest, &task->digest_len))
+			ERROR("EVP_DigestFinal_ex");
+		EVP_MD_CTX_free(md_ctx);
+	}
+#ifdef ORZOJ_HAVE_XXHASH
+	else
+	{
+		XXH128_canonical_t c;
+		XXH128_canonicalFromHash(&c, XXH3_128bits_digest(xxh_state));
+		memcpy(task->digest, c.digest, sizeof(c.digest));
+		task->digest_len = sizeof(c.digest);
+		XXH3_freeState(xxh_state);
+	}
+#endif
+
+	close(fd);
+	return 1;
+
+FAIL:
+	if (md_ctx)
+		EVP_MD_CTX_free(md_ctx);
+#ifdef ORZOJ_HAVE_XXHASH
+	if (xxh_state)
+		XXH3_freeState(xxh_state);
+#endif
+	close(fd);
+	return 0;
+
+#undef ERROR
+}
+
+
+#ifndef PyMODINIT_FUNC	/* declarations for DLL import/export */
+#define PyMODINIT_FUNC extern void
+#endif
+
+PyMODINIT_FUNC
+init_filehash(void)
+{
+	PyObject *m = Py_InitModule3("_filehash", methods_module, NULL);
+	if (!m)
+		return;
+
+	filehash_error_obj = PyErr_NewException("_filehash.error", NULL, NULL);
+	if (!filehash_error_obj)
+		return;
+
+	Py_INCREF(filehash_error_obj);
+	PyModule_AddObject(m, "error", filehash_error_obj);
+}
@@ -81,7 +81,10 @@ static unsigned int ssl_locks_count = 0;
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 typedef int Socket_t;
 
 #define CLOSE_SOCKET close
@@ -113,9 +116,39 @@ typedef SOCKET Socket_t;
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+// maximal number of servers whose TLS sessions are kept for resumption
+#define SESSION_CACHE_SIZE	16
+
+#define PEER_NAME_LEN	(NI_MAXHOST + NI_MAXSERV + 2)
+
+// name, HMAC secret and AES key of TLS session tickets; the secret and key
+// are 16 bytes before OpenSSL 1.1.0 and 32 bytes since then
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define TICKET_KEYS_LEN	80
+#else
+#define TICKET_KEYS_LEN	48
+#endif
+
+// buffered data are written when exceeding this size, which is the
+// maximal size of the data in a TLS record
+#define WBUF_FLUSH_SIZE	16384
+
+// the write buffer is freed after being flushed if larger than this size
+#define WBUF_KEEP_SIZE	65536
+
+// size of the read buffer, enough for the data of a TLS record
+#define RBUF_SIZE	16384
+
+// backlog of listening sockets, large enough for many judges connecting
+// to orzoj-server at the same time (e.g. after it is restarted)
+#define LISTEN_BACKLOG	SOMAXCONN
 
 typedef struct {
 	PyObject_HEAD
@@ -125,13 +158,70 @@ typedef struct {
 typedef struct {
 	PyObject_HEAD
 	Snc_obj_socket *socket;
-	SSL_CTX *ssl_ctx;
 	SSL *ssl;
 	double timeout_default;
+	char peer[PEER_NAME_LEN]; // "host:port" of the peer, used on client side
+	char *wbuf; // data written but not sent yet
+	Py_ssize_t wbuf_len, wbuf_size;
+	char rbuf[RBUF_SIZE]; // data received but not read yet, from rbuf_pos to rbuf_len
+	int rbuf_pos, rbuf_len;
+	int nonblock; // whether the socket is in non-blocking mode
 } Snc_obj_snc;
 
+// SSL contexts are shared by all connections with the same certificate files,
+// so that they are loaded only once and TLS sessions can be resumed
+typedef struct Ctx_cache_entry
+{
+	struct Ctx_cache_entry *next;
+	int is_server;
+	char *fname_cert, *fname_priv_key, *fname_ca;
+	time_t mtime_cert, mtime_priv_key, mtime_ca;
+	SSL_CTX *ctx;
+} Ctx_cache_entry;
+
+// the last TLS session with a server, used to resume the next connection to it
+typedef struct
+{
+	SSL_CTX *ctx;
+	char peer[PEER_NAME_LEN];
+	SSL_SESSION *sess;
+	unsigned long last_use;
+} Session_cache_entry;
+
+// only accessed with the GIL held
+static Ctx_cache_entry *ctx_cache = NULL;
+
+// keys used by server contexts to encrypt session tickets, so that clients
+// can resume their sessions after the server restarts; random keys chosen
+// by OpenSSL for each context are used if not set
+static unsigned char ticket_keys[TICKET_KEYS_LEN];
+static int ticket_keys_set = 0;
+
+// whether server contexts accept TLSv1 and TLSv1.1, which judges older than
+// msg.PROTOCOL_VERSION_TLS12 use; client contexts always require TLS 1.2
+static int accept_tlsv1 = 0;
+
+// accessed from the new session callback, which may be called without the GIL
+static Session_cache_entry session_cache[SESSION_CACHE_SIZE];
+static unsigned long session_cache_clock = 0;
+
+// file where the session cache is saved whenever a session is added, and
+// loaded by client contexts, so that the sessions can be resumed after the
+// process restarts; not used if NULL
+static char *session_file = NULL;
+
+#ifdef WITH_THREAD
+static PyThread_type_lock session_cache_lock = NULL;
+#define SESSION_CACHE_LOCK PyThread_acquire_lock(session_cache_lock, 1)
+#define SESSION_CACHE_UNLOCK PyThread_release_lock(session_cache_lock)
+#else
+#define SESSION_CACHE_LOCK
+#define SESSION_CACHE_UNLOCK
+#endif
+
 
-static PyObject *snc_error_obj, *snc_error_timeout_obj;
+static PyObject *snc_error_obj, *snc_error_timeout_obj,
+				*snc_error_want_read_obj, *snc_error_want_write_obj;
 
 
 // if @host is NULL, it will be regarded as server and socket is automatically binded,
@@ -161,32 +251,225 @@ static int socket_wait(Socket_t sockfd, double timeout);
 static PyObject* socket_close(Snc_obj_socket *self, void*);
 static void socket_close_do(Snc_obj_socket *self);
 
+// return: the file descriptor of the socket
+// object method
+static PyObject* socket_fileno(Snc_obj_socket *self, void*);
+
+// enable TCP keepalive, so that a dead peer is detected after the
+// connection has been idle for @idle seconds (where supported, otherwise
+// the system default is used), followed by @count probes sent every
+// @interval seconds
+// args: (idle:int, interval:int, count:int)
+// object method
+static PyObject* socket_set_keepalive(Snc_obj_socket *self, PyObject *args);
+
 static void socket_dealloc(Snc_obj_socket *self);
 
 // set SO_RCVTIMEO and SO_SNDTIMEO for @sockfd to @val seconds
 // return whether succeeds, and set snc_error_obj if necessary
 static int set_timeout(Socket_t sockfd, double val);
 
+// return 1 on success, 0 on failure (with Python exception set)
+static int set_nonblock(Socket_t sockfd, int flag);
+
+// if @nonblock is nonzero, the socket is set to non-blocking mode, and the
+// handshake is not done (see snc_do_handshake)
 static Snc_obj_snc* snc_new(Snc_obj_socket *sock, int is_server, double timeout_default,
-		const char *fname_cert, const char *fname_priv_key, const char *fname_ca);
+		const char *fname_cert, const char *fname_priv_key, const char *fname_ca,
+		int nonblock);
 
-// args: is the same as snc_new
+// args: is the same as snc_new, @nonblock is optional (default 0)
 // module function
 static PyObject* snc_new_ex(PyObject *self, PyObject *args);
 
-// read exactly @len bytes
+// set the keys of session tickets issued by server contexts, including
+// those already created
+// args: (keys:str) (of TICKET_KEYS_LEN bytes, available as a module constant)
+// module function
+static PyObject* set_ticket_keys(PyObject *self, PyObject *args);
+
+// set whether server contexts created later accept TLSv1 and TLSv1.1
+// args: (flag:int)
+// module function
+static PyObject* set_accept_tlsv1(PyObject *self, PyObject *args);
+
+// set the file of the session cache, which is loaded by client contexts
+// created later
+// args: (fname:str)
+// module function
+static PyObject* set_session_file(PyObject *self, PyObject *args);
+
+// return the shared SSL context for the given certificate files, creating it
+// if not cached or any of the files has been modified
+// return NULL on failure (with Python exception set)
+static SSL_CTX* ctx_get(int is_server,
+		const char *fname_cert, const char *fname_priv_key, const char *fname_ca);
+
+static SSL_CTX* ctx_new(int is_server,
+		const char *fname_cert, const char *fname_priv_key, const char *fname_ca);
+
+static void ctx_cache_entry_free(Ctx_cache_entry *entry);
+
+// get the modification time of @fname, or 0 if failed
+static time_t get_mtime(const char *fname);
+
+// set the cached session with @peer in @ssl to be resumed, if any
+static void session_cache_get(SSL *ssl, const char *peer);
+
+// called by OpenSSL when a new session is established (for TLS 1.3, when
+// a session ticket is received after the handshake)
+// return: 1 if @sess is kept
+static int session_cache_new_cb(SSL *ssl, SSL_SESSION *sess);
+
+// remove the sessions of @ctx
+static void session_cache_remove_ctx(SSL_CTX *ctx);
+
+// add the sessions in session_file to the cache as sessions of @ctx;
+// errors are ignored, in which case full handshakes are done
+static void session_cache_load(SSL_CTX *ctx);
+
+// write the cache to session_file, replacing it atomically; must be called
+// with the cache locked, and errors are ignored
+static void session_cache_save(void);
+
+// whether the TLS session was resumed instead of doing a full handshake
+// return: bool
+// object method
+static PyObject* snc_session_reused(Snc_obj_snc *self, void *);
+
+// read exactly @len bytes; buffered data are sent first
 // args: (len:int, timeout:float)
 // object method
 static PyObject* snc_read(Snc_obj_snc *self, PyObject *args);
 
-// write exactly @len bytes
+// fill @buf (a writable buffer, e.g. bytearray or memoryview) with exactly
+// len(@buf) bytes, like snc_read
+// args: (buf:buffer, timeout:float)
+// return: the number of bytes read
+// object method
+static PyObject* snc_readinto(Snc_obj_snc *self, PyObject *args);
+
+// read an unsigned 32-bit integer in network byte order, like snc_read
+// args: (timeout:float)
+// return: int
+// object method
+static PyObject* snc_read_uint32(Snc_obj_snc *self, PyObject *args);
+
+// read exactly @size bytes and write them to file descriptor @fd,
+// computing their digest with the OpenSSL digest named @digest if it is
+// not None
+// args: (fd:int, size:long, digest:str or None, timeout:float)
+// return: the digest (str), or None if @digest is None
+// object method
+static PyObject* snc_recv_to_file(Snc_obj_snc *self, PyObject *args);
+
+// check the connection, send the write buffer and set timeout before reading
+// return 1 on success, 0 on failure (with Python exception set)
+static int read_prepare(Snc_obj_snc *self, double timeout);
+
+// read a TLS record into the read buffer, which must be empty
+// return 1 on success, 0 on failure (with Python exception set)
+static int rbuf_fill(Snc_obj_snc *self);
+
+// read exactly @len bytes to @buf through the read buffer
+// return 1 on success, 0 on failure (with Python exception set)
+static int rbuf_read(Snc_obj_snc *self, char *buf, Py_ssize_t len);
+
+// write all of @data, together with buffered data
 // args: (data:str, timeout:float)
 // object method
 static PyObject* snc_write(Snc_obj_snc *self, PyObject *args);
 
+// append @data to the write buffer, which is only sent when it is large
+// enough to fill a TLS record, or by flush, write, write_frame or read
+// args: (data:str, timeout:float)
+// object method
+static PyObject* snc_write_buffered(Snc_obj_snc *self, PyObject *args);
+
+// write buffered data and all of @parts, in as few TLS records as possible
+// args: (parts:sequence of str, timeout:float)
+// object method
+static PyObject* snc_write_frame(Snc_obj_snc *self, PyObject *args);
+
+// write buffered data
+// args: (timeout:float)
+// object method
+static PyObject* snc_flush(Snc_obj_snc *self, PyObject *args);
+
+// buffer @len bytes of @data, and send the buffer if it becomes
+// large enough; large data are sent directly after the buffer
+// return 1 on success, 0 on failure (with Python exception set)
+static int wbuf_write(Snc_obj_snc *self, const char *data, Py_ssize_t len);
+
+// send the write buffer
+// return 1 on success, 0 on failure (with Python exception set)
+static int wbuf_flush(Snc_obj_snc *self);
+
+// return 1 on success, 0 on failure (with Python exception set)
+static int ssl_write_all(Snc_obj_snc *self, const char *data, Py_ssize_t len);
+
+// wait at most @timeout seconds until the connection becomes readable
+// (i.e. decrypted data are pending, or the socket is readable);
+// the SSL state is not changed, so it can be called while another thread
+// is writing, but readable does not imply application data are available
+// (see snc_has_data)
+// args: (timeout:float)
+// return: bool
+// object method
+static PyObject* snc_wait_readable(Snc_obj_snc *self, PyObject *args);
+
+// check without blocking whether application data can be read,
+// processing any non-application records (e.g. TLS session tickets)
+// already received; also returns True if reading would fail, so that
+// the error is reported by the following read
+// return: bool
+// object method
+static PyObject* snc_has_data(Snc_obj_snc *self, void *);
+
 // object method
 static PyObject* snc_shutdown(Snc_obj_snc *self, void *);
 
+// methods below are for connections in non-blocking mode, which can be
+// driven by select, epoll, etc. on the file descriptor; error_want_read
+// (or error_want_write) is raised if the operation should be retried
+// when the file descriptor becomes readable (or writable);
+// the other methods should not be used until the handshake is done,
+// and they may also raise these errors in non-blocking mode
+
+// return: the file descriptor of the socket
+// object method
+static PyObject* snc_fileno(Snc_obj_snc *self, void *);
+
+// continue the handshake, and check the certificate of the peer when done
+// object method
+static PyObject* snc_do_handshake(Snc_obj_snc *self, void *);
+
+// read at most @maxlen bytes
+// args: (maxlen:int)
+// return: str, empty if the peer has closed the connection
+// object method
+static PyObject* snc_recv(Snc_obj_snc *self, PyObject *args);
+
+// write part of @data (buffered data are sent first)
+// args: (data:str)
+// return: the number of bytes written
+// object method
+static PyObject* snc_send(Snc_obj_snc *self, PyObject *args);
+
+// return: the number of bytes received and decrypted but not read yet,
+// which can be read without waiting for the file descriptor
+// object method
+static PyObject* snc_pending(Snc_obj_snc *self, void *);
+
+// raise error_want_read, error_want_write or other errors according to
+// return value @ret of SSL function @func
+// return NULL
+static PyObject* snc_set_nonblock_error(Snc_obj_snc *self, const char *func, int ret);
+
+// return 1 if the certificate of the peer is verified, otherwise set
+// Python exception and return 0
+static int check_verify_result(Snc_obj_snc *self);
+
 static void snc_dealloc(Snc_obj_snc *self);
 
 static int os_init(void);
@@ -212,19 +495,38 @@ static PyMethodDef
 	{
 		{"socket", (PyCFunction)socket_new_ex, METH_VARARGS, NULL},
 		{"snc", (PyCFunction)snc_new_ex, METH_VARARGS, NULL},
+		{"set_ticket_keys", (PyCFunction)set_ticket_keys, METH_VARARGS, NULL},
+		{"set_accept_tlsv1", (PyCFunction)set_accept_tlsv1, METH_VARARGS, NULL},
+		{"set_session_file", (PyCFunction)set_session_file, METH_VARARGS, NULL},
 		{NULL, NULL, 0, NULL}
 	},
 	methods_socket[] = 
 	{
 		{"accept", (PyCFunction)socket_accept, METH_VARARGS, NULL},
 		{"close", (PyCFunction)socket_close, METH_NOARGS, NULL},
+		{"fileno", (PyCFunction)socket_fileno, METH_NOARGS, NULL},
+		{"set_keepalive", (PyCFunction)socket_set_keepalive, METH_VARARGS, NULL},
 		{NULL, NULL, 0, NULL}
 	},
 	methods_snc[] = 
 	{
 		{"read", (PyCFunction)snc_read, METH_VARARGS, NULL},
+		{"readinto", (PyCFunction)snc_readinto, METH_VARARGS, NULL},
+		{"read_uint32", (PyCFunction)snc_read_uint32, METH_VARARGS, NULL},
+		{"recv_to_file", (PyCFunction)snc_recv_to_file, METH_VARARGS, NULL},
 		{"write", (PyCFunction)snc_write, METH_VARARGS, NULL},
+		{"write_buffered", (PyCFunction)snc_write_buffered, METH_VARARGS, NULL},
+		{"write_frame", (PyCFunction)snc_write_frame, METH_VARARGS, NULL},
+		{"flush", (PyCFunction)snc_flush, METH_VARARGS, NULL},
+		{"wait_readable", (PyCFunction)snc_wait_readable, METH_VARARGS, NULL},
+		{"has_data", (PyCFunction)snc_has_data, METH_NOARGS, NULL},
+		{"session_reused", (PyCFunction)snc_session_reused, METH_NOARGS, NULL},
 		{"shutdown", (PyCFunction)snc_shutdown, METH_NOARGS, NULL},
+		{"fileno", (PyCFunction)snc_fileno, METH_NOARGS, NULL},
+		{"do_handshake", (PyCFunction)snc_do_handshake, METH_NOARGS, NULL},
+		{"recv", (PyCFunction)snc_recv, METH_VARARGS, NULL},
+		{"send", (PyCFunction)snc_send, METH_VARARGS, NULL},
+		{"pending", (PyCFunction)snc_pending, METH_NOARGS, NULL},
 		{NULL, NULL, 0, NULL}
 	};
 
@@ -291,7 +593,7 @@ Snc_obj_socket* socket_new(const char *host, int port, int use_ipv6, double time
 				goto FAIL;
 
 			Py_BEGIN_ALLOW_THREADS
-			ret = listen(sockfd, 5);
+			ret = listen(sockfd, LISTEN_BACKLOG);
 			Py_END_ALLOW_THREADS
 
 			if (ret)
@@ -318,7 +620,7 @@ Snc_obj_socket* socket_new(const char *host, int port, int use_ipv6, double time
 				goto FAIL;
 
 			Py_BEGIN_ALLOW_THREADS
-			ret = listen(sockfd, 5);
+			ret = listen(sockfd, LISTEN_BACKLOG);
 			Py_END_ALLOW_THREADS
 
 			if (ret)
@@ -516,6 +818,49 @@ void socket_close_do(Snc_obj_socket *self)
 	Py_END_ALLOW_THREADS
 }
 
+PyObject* socket_fileno(Snc_obj_socket *self, void *___)
+{
+	if (!self->sockfd)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to use a closed socket");
+		return NULL;
+	}
+	return PyInt_FromLong((long)self->sockfd);
+}
+
+PyObject* socket_set_keepalive(Snc_obj_socket *self, PyObject *args)
+{
+	int idle, interval, count, on = 1;
+
+	if (!PyArg_ParseTuple(args, "iii:set_keepalive", &idle, &interval, &count))
+		return NULL;
+
+	if (!self->sockfd)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to use a closed socket");
+		return NULL;
+	}
+
+	if (setsockopt(self->sockfd, SOL_SOCKET, SO_KEEPALIVE, (char *)&on, sizeof(on)))
+		return socket_set_error();
+
+#ifdef TCP_KEEPIDLE
+	if (setsockopt(self->sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)))
+		return socket_set_error();
+#endif
+#ifdef TCP_KEEPINTVL
+	if (setsockopt(self->sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)))
+		return socket_set_error();
+#endif
+#ifdef TCP_KEEPCNT
+	if (setsockopt(self->sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)))
+		return socket_set_error();
+#endif
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 PyObject* socket_close(Snc_obj_socket *self, void *___)
 {
 	socket_close_do(self);
@@ -572,13 +917,38 @@ int set_timeout(Socket_t sockfd, double val)
 
 #endif
 
+int set_nonblock(Socket_t sockfd, int flag)
+{
+#ifdef PLATFORM_WINDOWS
+	u_long arg = flag;
+	if (ioctlsocket(sockfd, FIONBIO, &arg) == SOCKET_ERROR)
+	{
+		socket_set_error();
+		return 0;
+	}
+#else
+	int fl = fcntl(sockfd, F_GETFL);
+	if (fl < 0 || fcntl(sockfd, F_SETFL, flag ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK)))
+	{
+		socket_set_error();
+		return 0;
+	}
+#endif
+	return 1;
+}
+
 Snc_obj_snc* snc_new(Snc_obj_socket *sock, int is_server, double timeout_default,
-		const char *fname_cert, const char *fname_priv_key, const char *fname_ca)
+		const char *fname_cert, const char *fname_priv_key, const char *fname_ca,
+		int nonblock)
 {
 	print_debug("fname_cert=%s fname_priv_key=%s fname_ca=%s",
 			fname_cert, fname_priv_key, fname_ca);
 	Snc_obj_snc *self = NULL;
-	int ret, ret1;
+	SSL_CTX *ctx;
+	int ret;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	char hostbuf[NI_MAXHOST], servbuf[NI_MAXSERV];
 
 	if (!set_timeout(sock->sockfd, timeout_default))
 		return NULL;
@@ -588,87 +958,73 @@ Snc_obj_snc* snc_new(Snc_obj_socket *sock, int is_server, double timeout_default
 		return NULL;
 
 	self->ssl = NULL;
-	self->ssl_ctx = NULL;
 	self->socket = NULL;
 	self->timeout_default = timeout_default;
+	self->peer[0] = 0;
+	self->wbuf = NULL;
+	self->wbuf_len = self->wbuf_size = 0;
+	self->rbuf_pos = self->rbuf_len = 0;
+	self->nonblock = nonblock;
 
 	ERR_clear_error();
 
-	SNC_BEGIN_ALLOW_THREADS
-	if (is_server)
-		self->ssl_ctx = SSL_CTX_new(TLSv1_server_method());
-	else 
-		self->ssl_ctx = SSL_CTX_new(TLSv1_client_method());
-	SNC_END_ALLOW_THREADS
-
-	if (self->ssl_ctx == NULL)
-	{
-		snc_set_error("SSL_CTX_new", ERR_get_error());
-		goto FAIL;
-	}
-
-	SSL_CTX_set_mode(self->ssl_ctx, SSL_MODE_AUTO_RETRY);
-
-	if (!SSL_CTX_load_verify_locations(self->ssl_ctx, fname_ca, NULL))
-	{
-		snc_set_error("SSL_CTX_load_verify_locations", ERR_get_error());
+	if ((ctx = ctx_get(is_server, fname_cert, fname_priv_key, fname_ca)) == NULL)
 		goto FAIL;
-	}
 
-	if (!SSL_CTX_use_certificate_file(self->ssl_ctx, fname_cert, SSL_FILETYPE_PEM))
-	{
-		snc_set_error("SSL_CTX_use_certificate_file", ERR_get_error());
-		goto FAIL;
-	}
+	SNC_BEGIN_ALLOW_THREADS
+	self->ssl = SSL_new(ctx); // the context is referenced until SSL_free
+	SNC_END_ALLOW_THREADS
 
-	if (!SSL_CTX_use_PrivateKey_file(self->ssl_ctx, fname_priv_key, SSL_FILETYPE_PEM))
+	if (self->ssl == NULL)
 	{
-		snc_set_error("SSL_CTX_use_PrivateKey_file", ERR_get_error());
+		snc_set_error("SSL_new", ERR_get_error());
 		goto FAIL;
 	}
 
-	if (!SSL_CTX_check_private_key(self->ssl_ctx))
+	if (!SSL_set_fd(self->ssl, sock->sockfd))
 	{
-		snc_set_error("SSL_CTX_check_private_key", ERR_get_error());
+		snc_set_error("SSL_set_fd", ERR_get_error());
 		goto FAIL;
 	}
 
-	// use bilateral authentication
-	SSL_CTX_set_verify(self->ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
-
-	SNC_BEGIN_ALLOW_THREADS
-	self->ssl = SSL_new(self->ssl_ctx);
-	SNC_END_ALLOW_THREADS
+	SSL_set_app_data(self->ssl, self);
 
-	if (self->ssl == NULL)
+	if (!is_server && !getpeername(sock->sockfd, (struct sockaddr*)&addr, &addrlen) &&
+			!getnameinfo((struct sockaddr*)&addr, addrlen, hostbuf, NI_MAXHOST,
+				servbuf, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV))
 	{
-		snc_set_error("SSL_new", ERR_get_error());
-		goto FAIL;
+		snprintf(self->peer, PEER_NAME_LEN, "%s:%s", hostbuf, servbuf);
+		session_cache_get(self->ssl, self->peer);
 	}
 
-	if (!SSL_set_fd(self->ssl, sock->sockfd))
+	if (nonblock)
 	{
-		snc_set_error("SSL_set_fd", ERR_get_error());
-		goto FAIL;
+		if (!set_nonblock(sock->sockfd, 1))
+			goto FAIL;
+		// the same data are not necessarily passed again when retrying
+		SSL_set_mode(self->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+				SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		if (is_server)
+			SSL_set_accept_state(self->ssl);
+		else SSL_set_connect_state(self->ssl);
+		self->socket = sock;
+		Py_INCREF(sock);
+		return self;
 	}
 
 	SNC_BEGIN_ALLOW_THREADS
 	if  (is_server)
-		ret1 = SSL_accept(self->ssl);
-	else ret1 = SSL_connect(self->ssl);
+		ret = SSL_accept(self->ssl);
+	else ret = SSL_connect(self->ssl);
 	SNC_END_ALLOW_THREADS
 
-	if ((ret = SSL_get_verify_result(self->ssl)) != X509_V_OK)
-	{
-		PyErr_Format(snc_error_obj, "Certificate doesn't verify. Verify result: %d "
-				"(see man 3 SSL_get_verify_result for details)", ret);
+	if (!check_verify_result(self))
 		goto FAIL;
-	}
 
-	if (ret1 != 1)
+	if (ret != 1)
 	{
 		snc_set_error(is_server ? "SSL_accept" : "SSL_connect",
-				SSL_get_error(self->ssl, ret1));
+				SSL_get_error(self->ssl, ret));
 		goto FAIL;
 	}
 
@@ -684,102 +1040,544 @@ FAIL:
 PyObject* snc_new_ex(PyObject *self, PyObject *args)
 {
 	Snc_obj_socket *sock;
-	int is_server;
+	int is_server, nonblock = 0;
 	double timeout;
 	const char *fname_cert, *fname_priv_key, *fname_ca;
 
-	if (!PyArg_ParseTuple(args, "O!idsss:snc", &type_socket,
+	if (!PyArg_ParseTuple(args, "O!idsss|i:snc", &type_socket,
 				&sock, &is_server, &timeout,
-				&fname_cert, &fname_priv_key, &fname_ca))
+				&fname_cert, &fname_priv_key, &fname_ca, &nonblock))
 		return NULL;
 
 	return (PyObject*)snc_new(sock, is_server, timeout,
-			fname_cert, fname_priv_key, fname_ca);
+			fname_cert, fname_priv_key, fname_ca, nonblock);
 }
 
-PyObject* snc_read(Snc_obj_snc *self, PyObject *args)
+PyObject* set_ticket_keys(PyObject *self, PyObject *args)
 {
-	int len, tot = 0, ret;
-	double timeout;
-	PyObject *buf;
-	if (self->socket == NULL)
+	const char *keys;
+	int len;
+	Ctx_cache_entry *entry;
+
+	if (!PyArg_ParseTuple(args, "s#:set_ticket_keys", &keys, &len))
+		return NULL;
+	if (len != TICKET_KEYS_LEN)
 	{
-		PyErr_SetString(snc_error_obj, "attempt to read from a closed socket");
+		PyErr_Format(PyExc_ValueError, "session ticket keys should be %d bytes",
+				TICKET_KEYS_LEN);
 		return NULL;
 	}
-	if (!PyArg_ParseTuple(args, "id:read", &len, &timeout))
+
+	memcpy(ticket_keys, keys, TICKET_KEYS_LEN);
+	ticket_keys_set = 1;
+
+	for (entry = ctx_cache; entry; entry = entry->next)
+		if (entry->is_server &&
+				!SSL_CTX_set_tlsext_ticket_keys(entry->ctx, ticket_keys, TICKET_KEYS_LEN))
+			return snc_set_error("SSL_CTX_set_tlsext_ticket_keys", ERR_get_error());
+
+	Py_RETURN_NONE;
+}
+
+PyObject* set_accept_tlsv1(PyObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, "i:set_accept_tlsv1", &accept_tlsv1))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyObject* set_session_file(PyObject *self, PyObject *args)
+{
+	const char *fname;
+	char *dup;
+
+	if (!PyArg_ParseTuple(args, "s:set_session_file", &fname))
 		return NULL;
+	if ((dup = strdup(fname)) == NULL)
+		return PyErr_NoMemory();
+
+	SESSION_CACHE_LOCK;
+	free(session_file);
+	session_file = dup;
+	SESSION_CACHE_UNLOCK;
+
+	Py_RETURN_NONE;
+}
+
+PyObject* snc_read(Snc_obj_snc *self, PyObject *args)
+{
+	int len;
+	double timeout;
+	PyObject *buf;
 
-	if (!set_timeout(self->socket->sockfd, timeout))
+	if (!PyArg_ParseTuple(args, "id:read", &len, &timeout))
+		return NULL;
+	if (!read_prepare(self, timeout))
 		return NULL;
 
 	buf = PyString_FromStringAndSize(NULL, len);
 	if (!buf)
 		return NULL;
 
-	while (tot < len)
+	if (!rbuf_read(self, PyString_AS_STRING(buf), len))
 	{
-		SNC_BEGIN_ALLOW_THREADS
-		ret = SSL_read(self->ssl, PyString_AS_STRING(buf) + tot, len - tot);
-		SNC_END_ALLOW_THREADS
-
-		if (ret <= 0)
-		{
-			Py_XDECREF(buf);
-			snc_set_error("SSL_read", SSL_get_error(self->ssl, ret));
-			return NULL;
-		}
-
-		tot += ret;
+		Py_DECREF(buf);
+		return NULL;
 	}
 
 	return buf;
 }
 
-PyObject* snc_write(Snc_obj_snc *self, PyObject *args)
+PyObject* snc_readinto(Snc_obj_snc *self, PyObject *args)
 {
 	Py_buffer buf;
 	double timeout;
-	int tot = 0, ret;
+	Py_ssize_t len;
+	int ok;
 
-	if (self->socket == NULL)
-	{
-		PyErr_SetString(snc_error_obj, "attempt to write to a closed socket");
+	if (!PyArg_ParseTuple(args, "w*d:readinto", &buf, &timeout))
 		return NULL;
-	}
-	if (!PyArg_ParseTuple(args, "s*d:write", &buf, &timeout))
+
+	len = buf.len;
+	ok = read_prepare(self, timeout) && rbuf_read(self, buf.buf, len);
+	PyBuffer_Release(&buf);
+
+	if (!ok)
 		return NULL;
+	return PyInt_FromSsize_t(len);
+}
 
-	while (tot < buf.len)
-	{
-		SNC_BEGIN_ALLOW_THREADS
-		ret = SSL_write(self->ssl, ((char*)buf.buf) + tot, buf.len - tot);
-		SNC_END_ALLOW_THREADS
+PyObject* snc_read_uint32(Snc_obj_snc *self, PyObject *args)
+{
+	double timeout;
+	uint32_t val;
 
-		if (ret <= 0)
+	if (!PyArg_ParseTuple(args, "d:read_uint32", &timeout))
+		return NULL;
+	if (!read_prepare(self, timeout) || !rbuf_read(self, (char*)&val, sizeof(val)))
+		return NULL;
+
+	return PyInt_FromSize_t(ntohl(val));
+}
+
+PyObject* snc_recv_to_file(Snc_obj_snc *self, PyObject *args)
+{
+	int fd, ret;
+	PY_LONG_LONG size;
+	const char *digest_name;
+	double timeout;
+	const EVP_MD *md = NULL;
+	EVP_MD_CTX *md_ctx = NULL;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len = 0;
+	Py_ssize_t len, tot;
+
+	if (!PyArg_ParseTuple(args, "iLzd:recv_to_file", &fd, &size, &digest_name, &timeout))
+		return NULL;
+	if (!read_prepare(self, timeout))
+		return NULL;
+
+	if (digest_name)
+	{
+		if ((md = EVP_get_digestbyname(digest_name)) == NULL)
 		{
-			PyBuffer_Release(&buf);
-			snc_set_error("SSL_write", SSL_get_error(self->ssl, ret));
+			PyErr_Format(PyExc_ValueError, "unsupported digest: %s", digest_name);
 			return NULL;
 		}
-
-		tot += ret;
+		if ((md_ctx = EVP_MD_CTX_create()) == NULL)
+			return PyErr_NoMemory();
+		if (!EVP_DigestInit_ex(md_ctx, md, NULL))
+		{
+			snc_set_error("EVP_DigestInit_ex", ERR_get_error());
+			goto FAIL;
+		}
 	}
 
-	PyBuffer_Release(&buf);
+	while (size > 0)
+	{
+		if (self->rbuf_pos == self->rbuf_len && !rbuf_fill(self))
+			goto FAIL;
+
+		len = self->rbuf_len - self->rbuf_pos;
+		if (len > size)
+			len = size;
+
+		if (md_ctx)
+			EVP_DigestUpdate(md_ctx, self->rbuf + self->rbuf_pos, len);
+
+		for (tot = 0; tot < len; )
+		{
+			Py_BEGIN_ALLOW_THREADS
+			ret = write(fd, self->rbuf + self->rbuf_pos + tot, len - tot);
+			Py_END_ALLOW_THREADS
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				PyErr_SetFromErrno(PyExc_IOError);
+				goto FAIL;
+			}
+			tot += ret;
+		}
+
+		self->rbuf_pos += len;
+		size -= len;
+	}
 
+	if (md_ctx)
+	{
+		EVP_DigestFinal_ex(md_ctx, digest, &digest_len);
+		EVP_MD_CTX_destroy(md_ctx);
+		return PyString_FromStringAndSize((char*)digest, digest_len);
+	}
 	Py_INCREF(Py_None);
 	return Py_None;
+
+FAIL:
+	if (md_ctx)
+		EVP_MD_CTX_destroy(md_ctx);
+	return NULL;
 }
 
-void snc_shutdown_do(Snc_obj_snc *self)
+int read_prepare(Snc_obj_snc *self, double timeout)
 {
-	int ret;
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to read from a closed socket");
+		return 0;
+	}
+
+	if (self->wbuf_len && !wbuf_flush(self))
+		return 0;
+
+	return set_timeout(self->socket->sockfd, timeout);
+}
+
+int rbuf_fill(Snc_obj_snc *self)
+{
+	int ret;
+
+	SNC_BEGIN_ALLOW_THREADS
+	ret = SSL_read(self->ssl, self->rbuf, RBUF_SIZE);
+	SNC_END_ALLOW_THREADS
+
+	if (ret <= 0)
+	{
+		snc_set_error("SSL_read", SSL_get_error(self->ssl, ret));
+		return 0;
+	}
+
+	self->rbuf_pos = 0;
+	self->rbuf_len = ret;
+	return 1;
+}
+
+int rbuf_read(Snc_obj_snc *self, char *buf, Py_ssize_t len)
+{
+	Py_ssize_t size;
+	int ret;
+
+	while (len > 0)
+	{
+		if (self->rbuf_pos < self->rbuf_len)
+		{
+			size = self->rbuf_len - self->rbuf_pos;
+			if (size > len)
+				size = len;
+			memcpy(buf, self->rbuf + self->rbuf_pos, size);
+			self->rbuf_pos += size;
+			buf += size;
+			len -= size;
+			continue;
+		}
+
+		if (len >= RBUF_SIZE)
+		{
+			// large data are read directly
+			SNC_BEGIN_ALLOW_THREADS
+			ret = SSL_read(self->ssl, buf, len > INT_MAX ? INT_MAX : len);
+			SNC_END_ALLOW_THREADS
+
+			if (ret <= 0)
+			{
+				snc_set_error("SSL_read", SSL_get_error(self->ssl, ret));
+				return 0;
+			}
+			buf += ret;
+			len -= ret;
+		}
+		else if (!rbuf_fill(self))
+			return 0;
+	}
+
+	return 1;
+}
+
+PyObject* snc_write(Snc_obj_snc *self, PyObject *args)
+{
+	Py_buffer buf;
+	double timeout;
+	int ok;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to write to a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "s*d:write", &buf, &timeout))
+		return NULL;
+
+	if (!self->wbuf_len)
+		ok = ssl_write_all(self, buf.buf, buf.len);
+	else ok = wbuf_write(self, buf.buf, buf.len) && wbuf_flush(self);
+
+	PyBuffer_Release(&buf);
+
+	if (!ok)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject* snc_write_buffered(Snc_obj_snc *self, PyObject *args)
+{
+	Py_buffer buf;
+	double timeout;
+	int ok;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to write to a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "s*d:write_buffered", &buf, &timeout))
+		return NULL;
+
+	ok = wbuf_write(self, buf.buf, buf.len);
+	PyBuffer_Release(&buf);
+
+	if (!ok)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject* snc_write_frame(Snc_obj_snc *self, PyObject *args)
+{
+	PyObject *parts, *seq;
+	Py_buffer buf;
+	double timeout;
+	Py_ssize_t i, n;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to write to a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "Od:write_frame", &parts, &timeout))
+		return NULL;
+
+	if ((seq = PySequence_Fast(parts, "parts must be a sequence")) == NULL)
+		return NULL;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < n; i ++)
+	{
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &buf, PyBUF_SIMPLE))
+			goto FAIL;
+		if (!wbuf_write(self, buf.buf, buf.len))
+		{
+			PyBuffer_Release(&buf);
+			goto FAIL;
+		}
+		PyBuffer_Release(&buf);
+	}
+	Py_DECREF(seq);
+
+	if (!wbuf_flush(self))
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+
+FAIL:
+	Py_DECREF(seq);
+	return NULL;
+}
+
+PyObject* snc_flush(Snc_obj_snc *self, PyObject *args)
+{
+	double timeout;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to write to a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "d:flush", &timeout))
+		return NULL;
+
+	if (!wbuf_flush(self))
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+int wbuf_write(Snc_obj_snc *self, const char *data, Py_ssize_t len)
+{
+	Py_ssize_t size;
+	char *ptr;
+
+	if (len >= WBUF_FLUSH_SIZE)
+	{
+		// copying large data does not save any TLS record
+		return wbuf_flush(self) && ssl_write_all(self, data, len);
+	}
+
+	if (self->wbuf_len + len > self->wbuf_size)
+	{
+		size = self->wbuf_size ? self->wbuf_size : 1024;
+		while (size < self->wbuf_len + len)
+			size *= 2;
+		if ((ptr = (char*)realloc(self->wbuf, size)) == NULL)
+		{
+			PyErr_NoMemory();
+			return 0;
+		}
+		self->wbuf = ptr;
+		self->wbuf_size = size;
+	}
+
+	memcpy(self->wbuf + self->wbuf_len, data, len);
+	self->wbuf_len += len;
+
+	if (self->wbuf_len >= WBUF_FLUSH_SIZE)
+		return wbuf_flush(self);
+	return 1;
+}
+
+int wbuf_flush(Snc_obj_snc *self)
+{
+	Py_ssize_t len = self->wbuf_len;
+
+	// data are discarded on failure, since the connection is broken anyway
+	self->wbuf_len = 0;
+	if (len && !ssl_write_all(self, self->wbuf, len))
+		return 0;
+
+	if (self->wbuf_size > WBUF_KEEP_SIZE)
+	{
+		free(self->wbuf);
+		self->wbuf = NULL;
+		self->wbuf_size = 0;
+	}
+	return 1;
+}
+
+int ssl_write_all(Snc_obj_snc *self, const char *data, Py_ssize_t len)
+{
+	Py_ssize_t tot = 0;
+	int ret;
+
+	while (tot < len)
+	{
+		SNC_BEGIN_ALLOW_THREADS
+		ret = SSL_write(self->ssl, data + tot, len - tot > INT_MAX ? INT_MAX : len - tot);
+		SNC_END_ALLOW_THREADS
+
+		if (ret <= 0)
+		{
+			snc_set_error("SSL_write", SSL_get_error(self->ssl, ret));
+			return 0;
+		}
+
+		tot += ret;
+	}
+
+	return 1;
+}
+
+PyObject* snc_wait_readable(Snc_obj_snc *self, PyObject *args)
+{
+	double timeout;
+	fd_set fds;
+	struct timeval tv;
+	int ret;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to wait on a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "d:wait_readable", &timeout))
+		return NULL;
+
+	if (self->rbuf_pos < self->rbuf_len || SSL_pending(self->ssl) > 0)
+		Py_RETURN_TRUE;
+
+	if (timeout < 0)
+		timeout = 0;
+	tv.tv_sec = floor(timeout);
+	tv.tv_usec = (timeout - floor(timeout)) * 1e6;
+	FD_ZERO(&fds);
+	FD_SET(self->socket->sockfd, &fds);
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = select(self->socket->sockfd + 1, &fds, NULL, NULL, &tv);
+	Py_END_ALLOW_THREADS
+
+#ifdef PLATFORM_WINDOWS
+	if (ret == SOCKET_ERROR)
+#else
+	if (ret < 0)
+#endif
+		return socket_set_error();
+
+	if (ret)
+		Py_RETURN_TRUE;
+	Py_RETURN_FALSE;
+}
+
+PyObject* snc_has_data(Snc_obj_snc *self, void *___)
+{
+	char c;
+	int ret, err;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to read from a closed socket");
+		return NULL;
+	}
+
+	if (self->rbuf_pos < self->rbuf_len || SSL_pending(self->ssl) > 0)
+		Py_RETURN_TRUE;
+
+	if (!set_nonblock(self->socket->sockfd, 1))
+		return NULL;
+
+	SNC_BEGIN_ALLOW_THREADS
+	ret = SSL_peek(self->ssl, &c, 1);
+	SNC_END_ALLOW_THREADS
+
+	err = ret > 0 ? SSL_ERROR_NONE : SSL_get_error(self->ssl, ret);
+
+	if (!self->nonblock && !set_nonblock(self->socket->sockfd, 0))
+		return NULL;
+
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		Py_RETURN_FALSE;
+	Py_RETURN_TRUE;
+}
+
+void snc_shutdown_do(Snc_obj_snc *self)
+{
+	int ret;
 	if (self->ssl)
 	{
 		if (self->socket)
 		{
 			set_timeout(self->socket->sockfd, self->timeout_default);
+			if (self->wbuf_len && !wbuf_flush(self))
+				PyErr_Clear();
 			SNC_BEGIN_ALLOW_THREADS
 			ret = SSL_shutdown(self->ssl);
 			if (ret == 0) // according to the manual page, should call SSL_shutdown again
@@ -791,14 +1589,514 @@ void snc_shutdown_do(Snc_obj_snc *self)
 		SSL_free(self->ssl);
 		SNC_END_ALLOW_THREADS
 	}
-	if (self->ssl_ctx)
+	self->ssl = NULL;
+	free(self->wbuf);
+	self->wbuf = NULL;
+	self->wbuf_len = self->wbuf_size = 0;
+}
+
+PyObject* snc_session_reused(Snc_obj_snc *self, void *___)
+{
+	if (self->ssl && SSL_session_reused(self->ssl))
+		Py_RETURN_TRUE;
+	Py_RETURN_FALSE;
+}
+
+time_t get_mtime(const char *fname)
+{
+	struct stat st;
+	if (stat(fname, &st))
+		return 0;
+	return st.st_mtime;
+}
+
+SSL_CTX* ctx_get(int is_server,
+		const char *fname_cert, const char *fname_priv_key, const char *fname_ca)
+{
+	Ctx_cache_entry *entry, **prev;
+	time_t mtime_cert = get_mtime(fname_cert),
+		   mtime_priv_key = get_mtime(fname_priv_key),
+		   mtime_ca = get_mtime(fname_ca);
+
+	for (prev = &ctx_cache; (entry = *prev) != NULL; prev = &entry->next)
+		if (entry->is_server == is_server &&
+				!strcmp(entry->fname_cert, fname_cert) &&
+				!strcmp(entry->fname_priv_key, fname_priv_key) &&
+				!strcmp(entry->fname_ca, fname_ca))
+		{
+			if (entry->mtime_cert == mtime_cert &&
+					entry->mtime_priv_key == mtime_priv_key &&
+					entry->mtime_ca == mtime_ca)
+				return entry->ctx;
+
+			// certificate files changed, existing connections still
+			// hold references to the old context
+			print_debug("certificate files changed, reloading");
+			*prev = entry->next;
+			ctx_cache_entry_free(entry);
+			break;
+		}
+
+	entry = (Ctx_cache_entry*)calloc(1, sizeof(Ctx_cache_entry));
+	if (!entry)
+	{
+		PyErr_NoMemory();
+		return NULL;
+	}
+	entry->is_server = is_server;
+	entry->mtime_cert = mtime_cert;
+	entry->mtime_priv_key = mtime_priv_key;
+	entry->mtime_ca = mtime_ca;
+	entry->fname_cert = strdup(fname_cert);
+	entry->fname_priv_key = strdup(fname_priv_key);
+	entry->fname_ca = strdup(fname_ca);
+	if (!entry->fname_cert || !entry->fname_priv_key || !entry->fname_ca)
 	{
-		SNC_BEGIN_ALLOW_THREADS
-		SSL_CTX_free(self->ssl_ctx);
-		SNC_END_ALLOW_THREADS
+		ctx_cache_entry_free(entry);
+		PyErr_NoMemory();
+		return NULL;
 	}
-	self->ssl = NULL;
-	self->ssl_ctx = NULL;
+
+	if ((entry->ctx = ctx_new(is_server, fname_cert, fname_priv_key, fname_ca)) == NULL)
+	{
+		ctx_cache_entry_free(entry);
+		return NULL;
+	}
+
+	entry->next = ctx_cache;
+	ctx_cache = entry;
+	return entry->ctx;
+}
+
+void ctx_cache_entry_free(Ctx_cache_entry *entry)
+{
+	if (entry->ctx)
+	{
+		session_cache_remove_ctx(entry->ctx);
+		SSL_CTX_free(entry->ctx);
+	}
+	free(entry->fname_cert);
+	free(entry->fname_priv_key);
+	free(entry->fname_ca);
+	free(entry);
+}
+
+SSL_CTX* ctx_new(int is_server,
+		const char *fname_cert, const char *fname_priv_key, const char *fname_ca)
+{
+	SSL_CTX *ctx;
+
+	int legacy = is_server && accept_tlsv1;
+
+	// TLS 1.2 and above, or TLSv1 and above if legacy
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ctx = SSL_CTX_new(is_server ? TLS_server_method() : TLS_client_method());
+	if (ctx != NULL && !SSL_CTX_set_min_proto_version(ctx,
+				legacy ? TLS1_VERSION : TLS1_2_VERSION))
+	{
+		snc_set_error("SSL_CTX_set_min_proto_version", ERR_get_error());
+		goto FAIL;
+	}
+	// TLSv1 and TLSv1.1 are refused above security level 0 since
+	// OpenSSL 3.0
+	if (ctx != NULL && legacy)
+		SSL_CTX_set_security_level(ctx, 0);
+#else
+	ctx = SSL_CTX_new(is_server ? SSLv23_server_method() : SSLv23_client_method());
+	if (ctx != NULL)
+		SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+				(legacy ? 0 : SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1));
+#endif
+
+	if (ctx == NULL)
+	{
+		snc_set_error("SSL_CTX_new", ERR_get_error());
+		return NULL;
+	}
+
+	SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+
+	if (!SSL_CTX_load_verify_locations(ctx, fname_ca, NULL))
+	{
+		snc_set_error("SSL_CTX_load_verify_locations", ERR_get_error());
+		goto FAIL;
+	}
+
+	if (!SSL_CTX_use_certificate_file(ctx, fname_cert, SSL_FILETYPE_PEM))
+	{
+		snc_set_error("SSL_CTX_use_certificate_file", ERR_get_error());
+		goto FAIL;
+	}
+
+	if (!SSL_CTX_use_PrivateKey_file(ctx, fname_priv_key, SSL_FILETYPE_PEM))
+	{
+		snc_set_error("SSL_CTX_use_PrivateKey_file", ERR_get_error());
+		goto FAIL;
+	}
+
+	if (!SSL_CTX_check_private_key(ctx))
+	{
+		snc_set_error("SSL_CTX_check_private_key", ERR_get_error());
+		goto FAIL;
+	}
+
+	// use bilateral authentication
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+	if (is_server)
+	{
+		// session tickets are enabled by default; the session id context
+		// is required for resuming sessions with client certificates
+		if (!SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"orzoj", 5))
+		{
+			snc_set_error("SSL_CTX_set_session_id_context", ERR_get_error());
+			goto FAIL;
+		}
+		if (ticket_keys_set &&
+				!SSL_CTX_set_tlsext_ticket_keys(ctx, ticket_keys, TICKET_KEYS_LEN))
+		{
+			snc_set_error("SSL_CTX_set_tlsext_ticket_keys", ERR_get_error());
+			goto FAIL;
+		}
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		// one ticket is enough, since a client only keeps the last one
+		SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+	}
+	else
+	{
+		SSL_CTX_set_session_cache_mode(ctx,
+				SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, session_cache_new_cb);
+		session_cache_load(ctx);
+	}
+
+	return ctx;
+
+FAIL:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+void session_cache_get(SSL *ssl, const char *peer)
+{
+	int i;
+	SESSION_CACHE_LOCK;
+	for (i = 0; i < SESSION_CACHE_SIZE; i ++)
+		if (session_cache[i].sess && session_cache[i].ctx == SSL_get_SSL_CTX(ssl) &&
+				!strcmp(session_cache[i].peer, peer))
+		{
+			// failure is ignored, in which case a full handshake is done
+			SSL_set_session(ssl, session_cache[i].sess);
+			session_cache[i].last_use = ++ session_cache_clock;
+			break;
+		}
+	SESSION_CACHE_UNLOCK;
+}
+
+int session_cache_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	Snc_obj_snc *self = (Snc_obj_snc*)SSL_get_app_data(ssl);
+	SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+	int i, victim = 0;
+
+	if (!self || !self->peer[0])
+		return 0;
+
+	SESSION_CACHE_LOCK;
+	for (i = 0; i < SESSION_CACHE_SIZE; i ++)
+	{
+		if (session_cache[i].sess && session_cache[i].ctx == ctx &&
+				!strcmp(session_cache[i].peer, self->peer))
+		{
+			victim = i;
+			break;
+		}
+		if (session_cache[i].last_use < session_cache[victim].last_use)
+			victim = i;
+	}
+	if (session_cache[victim].sess)
+		SSL_SESSION_free(session_cache[victim].sess);
+	session_cache[victim].ctx = ctx;
+	strcpy(session_cache[victim].peer, self->peer);
+	session_cache[victim].sess = sess;
+	session_cache[victim].last_use = ++ session_cache_clock;
+	session_cache_save();
+	SESSION_CACHE_UNLOCK;
+
+	print_debug("new session with %s", self->peer);
+	return 1;
+}
+
+void session_cache_remove_ctx(SSL_CTX *ctx)
+{
+	int i;
+	SESSION_CACHE_LOCK;
+	for (i = 0; i < SESSION_CACHE_SIZE; i ++)
+		if (session_cache[i].sess && session_cache[i].ctx == ctx)
+		{
+			SSL_SESSION_free(session_cache[i].sess);
+			memset(&session_cache[i], 0, sizeof(Session_cache_entry));
+		}
+	SESSION_CACHE_UNLOCK;
+}
+
+// format of session_file: for each session, the peer name terminated by
+// '\n', followed by the session in PEM
+void session_cache_load(SSL_CTX *ctx)
+{
+	FILE *fin;
+	char peer[PEER_NAME_LEN + 1];
+	SSL_SESSION *sess;
+	int i, victim, len;
+
+	SESSION_CACHE_LOCK;
+	if (session_file == NULL || (fin = fopen(session_file, "r")) == NULL)
+	{
+		SESSION_CACHE_UNLOCK;
+		return;
+	}
+
+	while (fgets(peer, sizeof(peer), fin))
+	{
+		len = strlen(peer);
+		if (len < 2 || peer[len - 1] != '\n')
+			break;
+		peer[len - 1] = 0;
+		if ((sess = PEM_read_SSL_SESSION(fin, NULL, NULL, NULL)) == NULL)
+			break;
+
+		// keep the sessions already in the cache, which are newer
+		victim = -1;
+		for (i = 0; i < SESSION_CACHE_SIZE; i ++)
+		{
+			if (session_cache[i].sess && session_cache[i].ctx == ctx &&
+					!strcmp(session_cache[i].peer, peer))
+			{
+				victim = -1;
+				break;
+			}
+			if (!session_cache[i].sess && victim == -1)
+				victim = i;
+		}
+		if (victim == -1)
+		{
+			SSL_SESSION_free(sess);
+			continue;
+		}
+		session_cache[victim].ctx = ctx;
+		strcpy(session_cache[victim].peer, peer);
+		session_cache[victim].sess = sess;
+		session_cache[victim].last_use = ++ session_cache_clock;
+		print_debug("session with %s loaded", peer);
+	}
+	ERR_clear_error();
+
+	fclose(fin);
+	SESSION_CACHE_UNLOCK;
+}
+
+void session_cache_save(void)
+{
+	FILE *fout;
+	char *fname_tmp;
+	int i, ok = 1;
+#ifdef PLATFORM_UNIX
+	int fd;
+#endif
+
+	if (session_file == NULL)
+		return;
+	if ((fname_tmp = malloc(strlen(session_file) + 5)) == NULL)
+		return;
+	sprintf(fname_tmp, "%s.tmp", session_file);
+
+	// the sessions contain their master secrets
+#ifdef PLATFORM_UNIX
+	fd = open(fname_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	fout = fd == -1 ? NULL : fdopen(fd, "w");
+	if (fout == NULL && fd != -1)
+		close(fd);
+#else
+	fout = fopen(fname_tmp, "w");
+#endif
+	if (fout == NULL)
+	{
+		free(fname_tmp);
+		return;
+	}
+
+	for (i = 0; i < SESSION_CACHE_SIZE && ok; i ++)
+		if (session_cache[i].sess)
+			ok = fprintf(fout, "%s\n", session_cache[i].peer) > 0 &&
+				PEM_write_SSL_SESSION(fout, session_cache[i].sess);
+	ERR_clear_error();
+
+	if (fclose(fout) || !ok)
+		ok = 0;
+#ifdef PLATFORM_WINDOWS
+	// rename() does not replace an existing file on Windows
+	if (ok)
+		remove(session_file);
+#endif
+	if (!ok || rename(fname_tmp, session_file))
+		remove(fname_tmp);
+	free(fname_tmp);
+}
+
+PyObject* snc_fileno(Snc_obj_snc *self, void *___)
+{
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to use a closed socket");
+		return NULL;
+	}
+	return PyInt_FromLong((long)self->socket->sockfd);
+}
+
+PyObject* snc_do_handshake(Snc_obj_snc *self, void *___)
+{
+	int ret;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to use a closed socket");
+		return NULL;
+	}
+
+	ERR_clear_error();
+	SNC_BEGIN_ALLOW_THREADS
+	ret = SSL_do_handshake(self->ssl);
+	SNC_END_ALLOW_THREADS
+
+	if (ret != 1)
+		return snc_set_nonblock_error(self, "SSL_do_handshake", ret);
+
+	if (!check_verify_result(self))
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyObject* snc_recv(Snc_obj_snc *self, PyObject *args)
+{
+	int maxlen, ret;
+	PyObject *buf;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to read from a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "i:recv", &maxlen))
+		return NULL;
+	if (maxlen <= 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "maxlen must be positive");
+		return NULL;
+	}
+
+	if (self->rbuf_pos < self->rbuf_len)
+	{
+		if (maxlen > self->rbuf_len - self->rbuf_pos)
+			maxlen = self->rbuf_len - self->rbuf_pos;
+		buf = PyString_FromStringAndSize(self->rbuf + self->rbuf_pos, maxlen);
+		if (buf)
+			self->rbuf_pos += maxlen;
+		return buf;
+	}
+
+	buf = PyString_FromStringAndSize(NULL, maxlen);
+	if (!buf)
+		return NULL;
+
+	ERR_clear_error();
+	SNC_BEGIN_ALLOW_THREADS
+	ret = SSL_read(self->ssl, PyString_AS_STRING(buf), maxlen);
+	SNC_END_ALLOW_THREADS
+
+	if (ret <= 0)
+	{
+		Py_DECREF(buf);
+		if (SSL_get_error(self->ssl, ret) == SSL_ERROR_ZERO_RETURN)
+			return PyString_FromStringAndSize(NULL, 0);
+		return snc_set_nonblock_error(self, "SSL_read", ret);
+	}
+
+	if (ret < maxlen && _PyString_Resize(&buf, ret))
+		return NULL;
+	return buf;
+}
+
+PyObject* snc_send(Snc_obj_snc *self, PyObject *args)
+{
+	Py_buffer buf;
+	int ret;
+
+	if (self->socket == NULL)
+	{
+		PyErr_SetString(snc_error_obj, "attempt to write to a closed socket");
+		return NULL;
+	}
+	if (!PyArg_ParseTuple(args, "s*:send", &buf))
+		return NULL;
+
+	if (self->wbuf_len && !wbuf_flush(self))
+	{
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+
+	if (!buf.len)
+	{
+		PyBuffer_Release(&buf);
+		return PyInt_FromLong(0);
+	}
+
+	ERR_clear_error();
+	SNC_BEGIN_ALLOW_THREADS
+	ret = SSL_write(self->ssl, buf.buf, buf.len > INT_MAX ? INT_MAX : buf.len);
+	SNC_END_ALLOW_THREADS
+
+	PyBuffer_Release(&buf);
+
+	if (ret <= 0)
+		return snc_set_nonblock_error(self, "SSL_write", ret);
+	return PyInt_FromLong(ret);
+}
+
+PyObject* snc_pending(Snc_obj_snc *self, void *___)
+{
+	if (self->ssl == NULL)
+		return PyInt_FromLong(0);
+	return PyInt_FromLong(self->rbuf_len - self->rbuf_pos + SSL_pending(self->ssl));
+}
+
+PyObject* snc_set_nonblock_error(Snc_obj_snc *self, const char *func, int ret)
+{
+	switch (SSL_get_error(self->ssl, ret))
+	{
+		case SSL_ERROR_WANT_READ:
+			PyErr_SetString(snc_error_want_read_obj, func);
+			return NULL;
+		case SSL_ERROR_WANT_WRITE:
+			PyErr_SetString(snc_error_want_write_obj, func);
+			return NULL;
+	}
+	return snc_set_error(func, SSL_get_error(self->ssl, ret));
+}
+
+int check_verify_result(Snc_obj_snc *self)
+{
+	long ret;
+	if ((ret = SSL_get_verify_result(self->ssl)) != X509_V_OK)
+	{
+		PyErr_Format(snc_error_obj, "Certificate doesn't verify. Verify result: %ld "
+				"(see man 3 SSL_get_verify_result for details)", ret);
+		return 0;
+	}
+	return 1;
 }
 
 PyObject* snc_shutdown(Snc_obj_snc *self, void *___)
@@ -975,6 +2273,10 @@ int ssl_init()
         return 0;
 #endif
 	OpenSSL_add_all_algorithms();
+#ifdef WITH_THREAD
+	if (session_cache_lock == NULL && (session_cache_lock = PyThread_allocate_lock()) == NULL)
+		return 0;
+#endif
 	return 1;
 }
 
@@ -1033,8 +2335,27 @@ init_snc(void)
 	if (PyModule_AddObject(m, "error", snc_error_obj) < 0)
 		return;
 
+	if (PyModule_AddIntConstant(m, "TICKET_KEYS_LEN", TICKET_KEYS_LEN) < 0)
+		return;
+
 	Py_INCREF(snc_error_timeout_obj);
 	if (PyModule_AddObject(m, "error_timeout", snc_error_timeout_obj) < 0)
 		return;
+
+	snc_error_want_read_obj = PyErr_NewException("_snc.error_want_read", snc_error_obj, NULL);
+	if (!snc_error_want_read_obj)
+		return;
+
+	snc_error_want_write_obj = PyErr_NewException("_snc.error_want_write", snc_error_obj, NULL);
+	if (!snc_error_want_write_obj)
+		return;
+
+	Py_INCREF(snc_error_want_read_obj);
+	if (PyModule_AddObject(m, "error_want_read", snc_error_want_read_obj) < 0)
+		return;
+
+	Py_INCREF(snc_error_want_write_obj);
+	if (PyModule_AddObject(m, "error_want_write", snc_error_want_write_obj) < 0)
+		return;
 }
 
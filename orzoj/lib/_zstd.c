@@ -0,0 +1,685 @@
+/*
+ * $File: _zstd.c
+ * $Author: Jiakai <jia.kai66@gmail.com>
+ */
+/*
+This file is part of orzoj
+
+Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+
+Orzoj is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Orzoj is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// zstd streams on file descriptors, used for archives in directory
+// synchronization
+//
+// the objects provide the subset of file object methods used by tarfile
+// in stream mode ("w|" and "r|"); the GIL is released while compressing
+// or decompressing
+//
+// there are also streams in memory, used to compress messages between
+// orzoj-server and orzoj-judge (see zstream.py)
+
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <zstd.h>
+
+typedef struct {
+	PyObject_HEAD
+	int fd;
+	ZSTD_CCtx *cctx;
+	void *buf_out;
+	size_t buf_out_size;
+} Zstd_obj_compressor;
+
+typedef struct {
+	PyObject_HEAD
+	int fd;
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer zin;
+	size_t buf_in_size;
+	size_t zret; // last return value of ZSTD_decompressStream, 0 if a frame is complete
+	int eof, pending;
+} Zstd_obj_decompressor;
+
+typedef struct {
+	PyObject_HEAD
+	ZSTD_CCtx *cctx;
+} Zstd_obj_stream_compressor;
+
+typedef struct {
+	PyObject_HEAD
+	ZSTD_DCtx *dctx;
+} Zstd_obj_stream_decompressor;
+
+static PyObject *zstd_error_obj;
+
+// compress a string in memory, used to estimate compressibility of files
+// args: (data:str, level:int)
+// module function
+static PyObject* compress(PyObject *self, PyObject *args);
+
+// return a compressor writing compressed data to file descriptor @fd,
+// which is not closed by the compressor
+// args: (fd:int, level:int, nthread:int)
+// @nthread is the number of extra compression threads, 0 for none
+// module function
+static PyObject* compressor_new(PyObject *self, PyObject *args);
+
+// args: (data:str)
+// object method
+static PyObject* compressor_write(Zstd_obj_compressor *self, PyObject *args);
+
+// finish the frame and flush all data; the compressor can not be used any more
+// object method
+static PyObject* compressor_close(Zstd_obj_compressor *self, void *);
+
+static void compressor_dealloc(Zstd_obj_compressor *self);
+
+// compress @len bytes in @data (or finish the frame if @end is nonzero)
+// and write to self->fd, GIL should have been released
+// return NULL on success, or the name of failed function (with errno set
+// or *zerr set to a zstd error message)
+static const char* compressor_do(Zstd_obj_compressor *self, const void *data,
+		size_t len, int end, const char **zerr);
+
+// return a decompressor reading compressed data from file descriptor @fd,
+// which is not closed by the decompressor
+// args: (fd:int)
+// module function
+static PyObject* decompressor_new(PyObject *self, PyObject *args);
+
+// return at most @size bytes of decompressed data, or an empty string
+// at the end of data
+// args: (size:int)
+// object method
+static PyObject* decompressor_read(Zstd_obj_decompressor *self, PyObject *args);
+
+static PyObject* decompressor_close(Zstd_obj_decompressor *self, void *);
+
+static void decompressor_dealloc(Zstd_obj_decompressor *self);
+
+// return a compressor in memory, whose output of each call to compress()
+// can be decompressed at once, while the history of previous calls is
+// still used for compression
+// args: (level:int)
+// module function
+static PyObject* stream_compressor_new(PyObject *self, PyObject *args);
+
+// compress @data and return the compressed data
+// args: (data:str)
+// object method
+static PyObject* stream_compressor_compress(Zstd_obj_stream_compressor *self, PyObject *args);
+
+static void stream_compressor_dealloc(Zstd_obj_stream_compressor *self);
+
+// return a decompressor in memory for the data from a stream compressor
+// module function
+static PyObject* stream_decompressor_new(PyObject *self, PyObject *___);
+
+// decompress @data and return all the data that can be decompressed
+// args: (data:str)
+// object method
+static PyObject* stream_decompressor_decompress(Zstd_obj_stream_decompressor *self,
+		PyObject *args);
+
+static void stream_decompressor_dealloc(Zstd_obj_stream_decompressor *self);
+
+static PyObject* set_error(const char *func, const char *zerr);
+
+static PyMethodDef
+	methods_module[] =
+	{
+		{"compress", (PyCFunction)compress, METH_VARARGS, NULL},
+		{"compressor", (PyCFunction)compressor_new, METH_VARARGS, NULL},
+		{"decompressor", (PyCFunction)decompressor_new, METH_VARARGS, NULL},
+		{"stream_compressor", (PyCFunction)stream_compressor_new, METH_VARARGS, NULL},
+		{"stream_decompressor", (PyCFunction)stream_decompressor_new, METH_NOARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	},
+	methods_compressor[] =
+	{
+		{"write", (PyCFunction)compressor_write, METH_VARARGS, NULL},
+		{"close", (PyCFunction)compressor_close, METH_NOARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	},
+	methods_decompressor[] =
+	{
+		{"read", (PyCFunction)decompressor_read, METH_VARARGS, NULL},
+		{"close", (PyCFunction)decompressor_close, METH_NOARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	},
+	methods_stream_compressor[] =
+	{
+		{"compress", (PyCFunction)stream_compressor_compress, METH_VARARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	},
+	methods_stream_decompressor[] =
+	{
+		{"decompress", (PyCFunction)stream_decompressor_decompress, METH_VARARGS, NULL},
+		{NULL, NULL, 0, NULL}
+	};
+
+static PyTypeObject
+	type_compressor =
+	{
+		PyVarObject_HEAD_INIT(0, 0)
+		"zstd.compressor",                          /*tp_name*/
+		sizeof(Zstd_obj_compressor),                /*tp_basicsize*/
+	},
+	type_decompressor =
+	{
+		PyVarObject_HEAD_INIT(0, 0)
+		"zstd.decompressor",                        /*tp_name*/
+		sizeof(Zstd_obj_decompressor),              /*tp_basicsize*/
+	},
+	type_stream_compressor =
+	{
+		PyVarObject_HEAD_INIT(0, 0)
+		"zstd.stream_compressor",                   /*tp_name*/
+		sizeof(Zstd_obj_stream_compressor),         /*tp_basicsize*/
+	},
+	type_stream_decompressor =
+	{
+		PyVarObject_HEAD_INIT(0, 0)
+		"zstd.stream_decompressor",                 /*tp_name*/
+		sizeof(Zstd_obj_stream_decompressor),       /*tp_basicsize*/
+	};
+
+static void set_type_attr(void)
+{
+	type_compressor.tp_dealloc = (destructor)(compressor_dealloc);
+	type_compressor.tp_getattro = PyObject_GenericGetAttr;
+	type_compressor.tp_methods = methods_compressor;
+
+	type_decompressor.tp_dealloc = (destructor)(decompressor_dealloc);
+	type_decompressor.tp_getattro = PyObject_GenericGetAttr;
+	type_decompressor.tp_methods = methods_decompressor;
+
+	type_stream_compressor.tp_dealloc = (destructor)(stream_compressor_dealloc);
+	type_stream_compressor.tp_getattro = PyObject_GenericGetAttr;
+	type_stream_compressor.tp_methods = methods_stream_compressor;
+
+	type_stream_decompressor.tp_dealloc = (destructor)(stream_decompressor_dealloc);
+	type_stream_decompressor.tp_getattro = PyObject_GenericGetAttr;
+	type_stream_decompressor.tp_methods = methods_stream_decompressor;
+}
+
+PyObject* compress(PyObject *self, PyObject *args)
+{
+	const char *data;
+	int len, level;
+	size_t bound, ret_size;
+	PyObject *ret;
+
+	if (!PyArg_ParseTuple(args, "s#i:compress", &data, &len, &level))
+		return NULL;
+
+	bound = ZSTD_compressBound(len);
+	if (!(ret = PyString_FromStringAndSize(NULL, bound)))
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret_size = ZSTD_compress(PyString_AS_STRING(ret), bound, data, len, level);
+	Py_END_ALLOW_THREADS
+
+	if (ZSTD_isError(ret_size))
+	{
+		Py_DECREF(ret);
+		return set_error("ZSTD_compress", ZSTD_getErrorName(ret_size));
+	}
+
+	_PyString_Resize(&ret, ret_size);
+	return ret;
+}
+
+PyObject* compressor_new(PyObject *self, PyObject *args)
+{
+	int fd, level, nthread;
+	Zstd_obj_compressor *obj;
+	size_t zret;
+
+	if (!PyArg_ParseTuple(args, "iii:compressor", &fd, &level, &nthread))
+		return NULL;
+
+	if (!(obj = PyObject_New(Zstd_obj_compressor, &type_compressor)))
+		return NULL;
+
+	obj->fd = fd;
+	obj->buf_out_size = ZSTD_CStreamOutSize();
+	obj->buf_out = malloc(obj->buf_out_size);
+	obj->cctx = ZSTD_createCCtx();
+
+	if (!obj->buf_out || !obj->cctx)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+
+	zret = ZSTD_CCtx_setParameter(obj->cctx, ZSTD_c_compressionLevel, level);
+	if (ZSTD_isError(zret))
+	{
+		Py_DECREF(obj);
+		return set_error("ZSTD_CCtx_setParameter", ZSTD_getErrorName(zret));
+	}
+
+	// fails if libzstd is built without multithread support, in which
+	// case single thread compression is used
+	if (nthread > 0)
+		ZSTD_CCtx_setParameter(obj->cctx, ZSTD_c_nbWorkers, nthread);
+
+	return (PyObject*)obj;
+}
+
+PyObject* compressor_write(Zstd_obj_compressor *self, PyObject *args)
+{
+	const char *data, *func, *zerr = NULL;
+	int len;
+
+	if (!PyArg_ParseTuple(args, "s#:write", &data, &len))
+		return NULL;
+
+	if (!self->cctx)
+		return set_error("write", "compressor closed");
+
+	Py_BEGIN_ALLOW_THREADS
+	func = compressor_do(self, data, len, 0, &zerr);
+	Py_END_ALLOW_THREADS
+
+	if (func)
+		return set_error(func, zerr);
+
+	Py_RETURN_NONE;
+}
+
+PyObject* compressor_close(Zstd_obj_compressor *self, void *___)
+{
+	const char *func, *zerr = NULL;
+
+	if (!self->cctx)
+		Py_RETURN_NONE;
+
+	Py_BEGIN_ALLOW_THREADS
+	func = compressor_do(self, NULL, 0, 1, &zerr);
+	Py_END_ALLOW_THREADS
+
+	ZSTD_freeCCtx(self->cctx);
+	self->cctx = NULL;
+
+	if (func)
+		return set_error(func, zerr);
+
+	Py_RETURN_NONE;
+}
+
+const char* compressor_do(Zstd_obj_compressor *self, const void *data,
+		size_t len, int end, const char **zerr)
+{
+	ZSTD_inBuffer zin = {data, len, 0};
+	while (1)
+	{
+		ZSTD_outBuffer zout = {self->buf_out, self->buf_out_size, 0};
+		size_t remaining = ZSTD_compressStream2(self->cctx, &zout, &zin,
+				end ? ZSTD_e_end : ZSTD_e_continue);
+		const char *ptr = (const char*)self->buf_out;
+
+		if (ZSTD_isError(remaining))
+		{
+			*zerr = ZSTD_getErrorName(remaining);
+			return "ZSTD_compressStream2";
+		}
+
+		while (zout.pos)
+		{
+			ssize_t s = write(self->fd, ptr, zout.pos);
+			if (s < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return "write";
+			}
+			ptr += s;
+			zout.pos -= s;
+		}
+
+		if (end ? !remaining : zin.pos == zin.size)
+			return NULL;
+	}
+}
+
+void compressor_dealloc(Zstd_obj_compressor *self)
+{
+	if (self->cctx)
+		ZSTD_freeCCtx(self->cctx);
+	free(self->buf_out);
+	PyObject_Del(self);
+}
+
+PyObject* decompressor_new(PyObject *self, PyObject *args)
+{
+	int fd;
+	Zstd_obj_decompressor *obj;
+
+	if (!PyArg_ParseTuple(args, "i:decompressor", &fd))
+		return NULL;
+
+	if (!(obj = PyObject_New(Zstd_obj_decompressor, &type_decompressor)))
+		return NULL;
+
+	obj->fd = fd;
+	obj->buf_in_size = ZSTD_DStreamInSize();
+	obj->zin.src = malloc(obj->buf_in_size);
+	obj->zin.size = obj->zin.pos = 0;
+	obj->zret = 0;
+	obj->eof = obj->pending = 0;
+	obj->dctx = ZSTD_createDCtx();
+
+	if (!obj->zin.src || !obj->dctx)
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+
+	return (PyObject*)obj;
+}
+
+PyObject* decompressor_read(Zstd_obj_decompressor *self, PyObject *args)
+{
+	int size;
+	const char *func = NULL, *zerr = NULL;
+	PyObject *ret;
+	ZSTD_outBuffer zout;
+
+	if (!PyArg_ParseTuple(args, "i:read", &size))
+		return NULL;
+
+	if (!self->dctx)
+		return set_error("read", "decompressor closed");
+
+	if (size <= 0 || self->eof)
+		return PyString_FromString("");
+
+	if (!(ret = PyString_FromStringAndSize(NULL, size)))
+		return NULL;
+
+	zout.dst = PyString_AS_STRING(ret);
+	zout.size = size;
+	zout.pos = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	while (zout.pos < zout.size)
+	{
+		if (self->zin.pos == self->zin.size && !self->pending)
+		{
+			ssize_t len = read(self->fd, (void*)self->zin.src, self->buf_in_size);
+			if (len < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				func = "read";
+				break;
+			}
+			if (!len)
+			{
+				if (self->zret)
+				{
+					func = "ZSTD_decompressStream";
+					zerr = "truncated data";
+				}
+				self->eof = 1;
+				break;
+			}
+			self->zin.size = len;
+			self->zin.pos = 0;
+		}
+		self->zret = ZSTD_decompressStream(self->dctx, &zout, &self->zin);
+		if (ZSTD_isError(self->zret))
+		{
+			func = "ZSTD_decompressStream";
+			zerr = ZSTD_getErrorName(self->zret);
+			break;
+		}
+		self->pending = (zout.pos == zout.size);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (func)
+	{
+		Py_DECREF(ret);
+		return set_error(func, zerr);
+	}
+
+	_PyString_Resize(&ret, zout.pos);
+	return ret;
+}
+
+PyObject* decompressor_close(Zstd_obj_decompressor *self, void *___)
+{
+	if (self->dctx)
+	{
+		ZSTD_freeDCtx(self->dctx);
+		self->dctx = NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+void decompressor_dealloc(Zstd_obj_decompressor *self)
+{
+	if (self->dctx)
+		ZSTD_freeDCtx(self->dctx);
+	free((void*)self->zin.src);
+	PyObject_Del(self);
+}
+
+PyObject* stream_compressor_new(PyObject *self, PyObject *args)
+{
+	int level;
+	Zstd_obj_stream_compressor *obj;
+	size_t zret;
+
+	if (!PyArg_ParseTuple(args, "i:stream_compressor", &level))
+		return NULL;
+
+	if (!(obj = PyObject_New(Zstd_obj_stream_compressor, &type_stream_compressor)))
+		return NULL;
+
+	if (!(obj->cctx = ZSTD_createCCtx()))
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+
+	zret = ZSTD_CCtx_setParameter(obj->cctx, ZSTD_c_compressionLevel, level);
+	if (ZSTD_isError(zret))
+	{
+		Py_DECREF(obj);
+		return set_error("ZSTD_CCtx_setParameter", ZSTD_getErrorName(zret));
+	}
+
+	return (PyObject*)obj;
+}
+
+PyObject* stream_compressor_compress(Zstd_obj_stream_compressor *self, PyObject *args)
+{
+	const char *data;
+	int len;
+	size_t remaining = 0;
+	PyObject *ret;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+
+	if (!PyArg_ParseTuple(args, "s#:compress", &data, &len))
+		return NULL;
+
+	// the frame header is written by the first call
+	zout.size = ZSTD_compressBound(len) + ZSTD_CStreamOutSize() / 64;
+	if (!(ret = PyString_FromStringAndSize(NULL, zout.size)))
+		return NULL;
+	zout.pos = 0;
+	zin.src = data;
+	zin.size = len;
+	zin.pos = 0;
+
+	while (1)
+	{
+		zout.dst = PyString_AS_STRING(ret);
+		Py_BEGIN_ALLOW_THREADS
+		remaining = ZSTD_compressStream2(self->cctx, &zout, &zin, ZSTD_e_flush);
+		Py_END_ALLOW_THREADS
+
+		if (ZSTD_isError(remaining))
+		{
+			Py_DECREF(ret);
+			return set_error("ZSTD_compressStream2", ZSTD_getErrorName(remaining));
+		}
+		if (!remaining)
+			break;
+
+		// not expected since the buffer is large enough
+		zout.size *= 2;
+		if (_PyString_Resize(&ret, zout.size))
+			return NULL;
+	}
+
+	_PyString_Resize(&ret, zout.pos);
+	return ret;
+}
+
+void stream_compressor_dealloc(Zstd_obj_stream_compressor *self)
+{
+	if (self->cctx)
+		ZSTD_freeCCtx(self->cctx);
+	PyObject_Del(self);
+}
+
+PyObject* stream_decompressor_new(PyObject *self, PyObject *___)
+{
+	Zstd_obj_stream_decompressor *obj;
+
+	if (!(obj = PyObject_New(Zstd_obj_stream_decompressor, &type_stream_decompressor)))
+		return NULL;
+
+	if (!(obj->dctx = ZSTD_createDCtx()))
+	{
+		Py_DECREF(obj);
+		return PyErr_NoMemory();
+	}
+
+	return (PyObject*)obj;
+}
+
+PyObject* stream_decompressor_decompress(Zstd_obj_stream_decompressor *self,
+		PyObject *args)
+{
+	const char *data;
+	int len;
+	size_t zret;
+	PyObject *ret;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+
+	if (!PyArg_ParseTuple(args, "s#:decompress", &data, &len))
+		return NULL;
+
+	zout.size = ZSTD_DStreamOutSize();
+	if (!(ret = PyString_FromStringAndSize(NULL, zout.size)))
+		return NULL;
+	zout.pos = 0;
+	zin.src = data;
+	zin.size = len;
+	zin.pos = 0;
+
+	while (1)
+	{
+		zout.dst = PyString_AS_STRING(ret);
+		Py_BEGIN_ALLOW_THREADS
+		zret = ZSTD_decompressStream(self->dctx, &zout, &zin);
+		Py_END_ALLOW_THREADS
+
+		if (ZSTD_isError(zret))
+		{
+			Py_DECREF(ret);
+			return set_error("ZSTD_decompressStream", ZSTD_getErrorName(zret));
+		}
+
+		// all output is flushed if the output buffer is not full
+		if (zin.pos == zin.size && zout.pos < zout.size)
+			break;
+
+		if (zout.pos == zout.size)
+		{
+			zout.size *= 2;
+			if (_PyString_Resize(&ret, zout.size))
+				return NULL;
+		}
+	}
+
+	_PyString_Resize(&ret, zout.pos);
+	return ret;
+}
+
+void stream_decompressor_dealloc(Zstd_obj_stream_decompressor *self)
+{
+	if (self->dctx)
+		ZSTD_freeDCtx(self->dctx);
+	PyObject_Del(self);
+}
+
+PyObject* set_error(const char *func, const char *zerr)
+{
+	if (zerr)
+		PyErr_Format(zstd_error_obj, "zstd error [func %s]: %s", func, zerr);
+	else
+		PyErr_Format(zstd_error_obj, "zstd error [func %s]: %s", func, strerror(errno));
+	return NULL;
+}
+
+
+#ifndef PyMODINIT_FUNC	/* declarations for DLL import/export */
+#define PyMODINIT_FUNC extern void
+#endif
+
+PyMODINIT_FUNC
+init_zstd(void)
+{
+	PyObject *m;
+
+	set_type_attr();
+
+	if (PyType_Ready(&type_compressor) < 0 ||
+			PyType_Ready(&type_decompressor) < 0 ||
+			PyType_Ready(&type_stream_compressor) < 0 ||
+			PyType_Ready(&type_stream_decompressor) < 0)
+		return;
+
+	m = Py_InitModule3("_zstd", methods_module, NULL);
+	if (!m)
+		return;
+
+	zstd_error_obj = PyErr_NewException("_zstd.error", NULL, NULL);
+	if (!zstd_error_obj)
+		return;
+
+	Py_INCREF(zstd_error_obj);
+	PyModule_AddObject(m, "error", zstd_error_obj);
+
+	PyModule_AddIntConstant(m, "LEVEL_MAX", ZSTD_maxCLevel());
+}
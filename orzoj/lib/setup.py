@@ -26,16 +26,43 @@ import subprocess, platform
 
 cflags = None
 libs = None
+cflags_hash = None
+cflags_zstd = None
+libs_zstd = None
 
 if platform.system() == "Linux":
     cflags = ["-Wall", "-DORZOJ_DEBUG"]
     cflags.extend(subprocess.check_output(["pkg-config", "--cflags", "openssl"]).split())
     libs = subprocess.check_output(["pkg-config", "--libs", "openssl"]).split()
 
+    # xxHash is optional; only its header is needed since it is inlined
+    cflags_hash = list(cflags)
+    if subprocess.call(["pkg-config", "--exists", "libxxhash"]) == 0:
+        cflags_hash.append("-DORZOJ_HAVE_XXHASH")
+        cflags_hash.extend(subprocess.check_output(["pkg-config", "--cflags", "libxxhash"]).split())
+    cflags_hash.append("-pthread")
+
+    # zstd is optional, needed for compressed archives in data synchronization
+    if subprocess.call(["pkg-config", "--exists", "libzstd"]) == 0:
+        cflags_zstd = ["-Wall"]
+        cflags_zstd.extend(subprocess.check_output(["pkg-config", "--cflags", "libzstd"]).split())
+        libs_zstd = subprocess.check_output(["pkg-config", "--libs", "libzstd"]).split()
+
 
 module = Extension("orzoj._snc", sources = ["_snc.c"], 
         extra_compile_args = cflags,
         extra_link_args = libs)
 
-setup(name = "orzoj", ext_modules = [module])
+module_hash = Extension("orzoj._filehash", sources = ["_filehash.c"],
+        extra_compile_args = cflags_hash,
+        extra_link_args = libs and libs + ["-pthread"])
+
+ext_modules = [module, module_hash]
+
+if libs_zstd:
+    ext_modules.append(Extension("orzoj._zstd", sources = ["_zstd.c"],
+        extra_compile_args = cflags_zstd,
+        extra_link_args = libs_zstd))
+
+setup(name = "orzoj", ext_modules = ext_modules)
 
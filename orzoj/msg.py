@@ -22,29 +22,85 @@
 
 """definition of network messages"""
 
+import time
+
+from orzoj import snc
+
 TELL_ONLINE_INTERVAL = 0.5
+# the interval of TELL_ONLINE before PROTOCOL_VERSION_HEARTBEAT
 
 ERROR = 0xffffffff
 
-PROTOCOL_VERSION = 0xff000001
+PROTOCOL_VERSION = 0xff000008
+# the oldest judge protocol version orzoj-server still accepts;
+# features introduced later are only used if the judge declares
+# a version not less than the one noted with the feature
+PROTOCOL_VERSION_MIN = 0xff000001
+
+# PREFETCH_DATA is available since this version
+PROTOCOL_VERSION_PREFETCH = 0xff000002
+
+# peer address in HELLO and SYNCDIR_PEERS are available since this version
+PROTOCOL_VERSION_PEER = 0xff000003
+
+# negotiation of the checksum algorithm used in SYNCDIR_BEGIN, and
+# SHA-256 checksums in SYNCDIR_PEERS, are available since this version
+PROTOCOL_VERSION_HASH = 0xff000004
+
+# archive formats in HELLO and SYNCDIR_FTRANS are available since this version
+PROTOCOL_VERSION_ARCHIVE = 0xff000005
+
+# the number of slots in HELLO and MUX_BEGIN are available since this version
+PROTOCOL_VERSION_SLOT = 0xff000006
+
+# compression methods in HELLO and CONNECT_OK are available since this version
+PROTOCOL_VERSION_COMPRESS = 0xff000007
+
+# heartbeat intervals in HELLO and CONNECT_OK are available since this version
+PROTOCOL_VERSION_HEARTBEAT = 0xff000008
+
+# judges older than this version only use TLSv1, and can only connect
+# to orzoj-server if AcceptTLSv1 is set
+PROTOCOL_VERSION_TLS12 = 0xff000007
 
 # s2c: server to client(i.e. orzoj-judge)
 # c2s: client to server
 
 (
 # packet format: (TELL_ONLINE)
-# used when server or judge is wating for some task to be finished
+# used when server or judge is wating for some task to be finished;
+# sent only if no other message has been sent within the heartbeat
+# interval negotiated in HELLO and CONNECT_OK (see tell_online())
 TELL_ONLINE, # s2c, c2s
 
 # packet format: (HELLO, id:string, PROTOCOL_VERSION:uint32_t,
-# cnt:uint32_t, for(0<=i<cnt) supported language[i]:string)
+# cnt:uint32_t, for(0<=i<cnt) supported language[i]:string,
+# [since PROTOCOL_VERSION_PEER] peer_addr:string, peer_port:uint32_t,
+# [since PROTOCOL_VERSION_HASH] nalgo:uint32_t, for(0<=i<nalgo) checksum algorithm[i]:string,
+# [since PROTOCOL_VERSION_ARCHIVE] nfmt:uint32_t, for(0<=i<nfmt) archive format[i]:string,
+# [since PROTOCOL_VERSION_SLOT] nslot:uint32_t,
+# [since PROTOCOL_VERSION_COMPRESS] ncomp:uint32_t, for(0<=i<ncomp) compression method[i]:string,
+# [since PROTOCOL_VERSION_HEARTBEAT] heartbeat:uint32_t)
+# where peer_port is 0 if the judge does not serve data to other judges,
+# empty peer_addr means the address seen by orzoj-server,
+# nslot is the number of tasks the judge can work on at the same time,
+# and heartbeat is the maximal heartbeat interval in milliseconds
+# the judge accepts
 HELLO, # c2s
 
 # packet format: (DUPLICATED_ID)
 DUPLICATED_ID, # s2c 
 # packet format: (ID_TOO_LONG)
 ID_TOO_LONG, # s2c 
-# packet format: (CONNECT_OK)
+# packet format: (CONNECT_OK, [since PROTOCOL_VERSION_HASH] checksum algorithm:string,
+# [since PROTOCOL_VERSION_COMPRESS] compression method:string,
+# [since PROTOCOL_VERSION_HEARTBEAT] heartbeat:uint32_t)
+# where the algorithm is chosen by orzoj-server from those listed in HELLO,
+# and is used for all the following SYNCDIR_BEGIN; "sha1" is used by
+# older judges; the compression method is also chosen from HELLO, or
+# empty for none, and everything after CONNECT_OK is compressed by it
+# (see zstream.py); heartbeat is the heartbeat interval in milliseconds
+# used by both sides, not greater than the one in HELLO
 CONNECT_OK, # s2c
 
 # query system info ans give answers
@@ -98,15 +154,72 @@ SYNCDIR_BEGIN, #s2c
 SYNCDIR_FILELIST, #c2s
 # packet format: (SYNCDIR_FILELIST, nfile:int, filenum[i]:int)
 #            where filenum is the index of the file in the list sent by server
+# if SYNCDIR_PEERS is sent, the client replies with another SYNCDIR_FILELIST
+# containing the files it still needs
 SYNCDIR_FTRANS, # s2c
 # tell the client that filetrans is ready
-# packet format: (SYNCDIR_FTRANS)
-SYNCDIR_DONE # c2s
-) = range(29)
-
-def write_msg(conn, m, timeout = 0):
-    conn.write_uint32(m, timeout)
+# packet format: (SYNCDIR_FTRANS, [since PROTOCOL_VERSION_ARCHIVE] narchive:uint32_t,
+# for(0<=i<narchive) archive format[i]:string), followed by OFTP transfers
+# of the archives (one tar.gz before PROTOCOL_VERSION_ARCHIVE); the formats
+# are chosen by orzoj-server from those listed in HELLO, and "tar" (without
+# compression) is always supported
+SYNCDIR_DONE, # c2s
+
+# synchronize the data directory of a problem before any task
+# needs it, while the judge is idle; the SYNCDIR_* messages of
+# the synchronization follow immediately
+# packet format: (PREFETCH_DATA, problem code:string)
+PREFETCH_DATA, # s2c
+
+# ask the client to fetch some of the requested files from other judges,
+# and check them against the checksums in SYNCDIR_BEGIN
+# packet format: (SYNCDIR_PEERS, npeer:int, for(0<=i<npeer) (addr[i]:string,
+# port[i]:int, nfile[i]:int, for(0<=j<nfile[i]) (filenum[i][j]:int,
+# [since PROTOCOL_VERSION_HASH] sha256[i][j]:string)))
+# since PROTOCOL_VERSION_HASH, fetched files are checked against the SHA-256
+# checksums instead, because the negotiated algorithm may not be cryptographic
+SYNCDIR_PEERS, # s2c
+
+# messages between two judges, one serving the data cache to the other
+# packet format: (PEER_GET_FILE, directory:string, filename:string)
+PEER_GET_FILE, # c2s
+# packet format: (PEER_FILE_OK), followed by OFTP transfer of the file
+PEER_FILE_OK, # s2c
+# packet format: (PEER_FILE_ERROR)
+PEER_FILE_ERROR, # s2c
+# packet format: (PEER_END)
+PEER_END, # c2s
+
+# sent after QUERY_INFO's to a judge declaring more than one slot;
+# everything after it is multiplexed (see mux.py): stream i (1 <= i <= nslot)
+# carries the messages of slot i, starting with those following CONNECT_OK
+# and QUERY_INFO's for a judge with only one slot (TELL_ONLINE,
+# PREFETCH_DATA, PREPARE_DATA, ...)
+# packet format: (MUX_BEGIN, nslot:uint32_t)
+MUX_BEGIN # s2c
+) = range(36)
+
+def write_msg(conn, m, *fields, **kwargs):
+    """write message @m followed by @fields in a single frame, where
+    int and long fields are written as uint32, and str and unicode fields
+    as string; the only keyword argument accepted is timeout"""
+    parts = [snc.pack_uint32(m)]
+    for i in fields:
+        if isinstance(i, basestring):
+            parts.append(snc.pack_str(i))
+        else:
+            parts.append(snc.pack_uint32(i))
+    now = time.time()
+    conn.write_frame(parts, kwargs.get("timeout", 0))
+    conn.last_msg_time = now
 
 def read_msg(conn, timeout = 0):
     return conn.read_uint32(timeout)
 
+def tell_online(conn):
+    """send TELL_ONLINE via @conn, unless some message has been sent
+    within the heartbeat interval of @conn; it should be called at least
+    every conn.heartbeat_interval seconds while waiting"""
+    if time.time() - conn.last_msg_time >= conn.heartbeat_interval:
+        write_msg(conn, TELL_ONLINE)
+
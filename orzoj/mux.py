@@ -0,0 +1,209 @@
+# $File: mux.py
+# $Author: Jiakai <jia.kai66@gmail.com>
+#
+# This file is part of orzoj
+#
+# Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+#
+# Orzoj is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Orzoj is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""multiplex several streams over one snc connection, so that a judge
+with several slots can work on several tasks at the same time
+
+after msg.MUX_BEGIN, everything sent over the connection is in frames of
+    (stream id:uint32, len:uint32, data:len bytes)
+and the data of a stream form exactly what would be sent over a
+connection to a judge with only one slot"""
+
+import struct, threading, time, os, hashlib
+from collections import deque
+
+from orzoj import snc, log
+
+_HEADER = struct.Struct("!II")
+
+# the reading thread stops reading while a stream has more than this
+# number of bytes not consumed, so a slow stream can not use up memory
+# (other streams are also delayed, but only until it is consumed)
+_BUF_MAX = 1024 * 1024
+
+_FRAME_FLUSH_SIZE = 16384
+# buffered data of a stream are sent when exceeding this size
+
+_WAIT_INTERVAL = 1
+# the interval in seconds to check whether the connection is closed
+# while waiting for data
+
+class Mux:
+    def __init__(self, conn, nstream):
+        """@conn is an instance of snc.snc, which must not be used
+        directly any more; streams are numbered from 1 to @nstream"""
+        self._conn = conn
+        self._conn_lock = threading.Lock()
+        # all operations on @conn are serialized, since an SSL connection
+        # can not be used by several threads at the same time
+        self._cd = threading.Condition()
+        self._buf = dict()
+        # dict of <stream id> => deque of str
+        self._buf_len = dict()
+        # dict of <stream id> => number of bytes in the buffer
+        for sid in range(1, nstream + 1):
+            self._buf[sid] = deque()
+            self._buf_len[sid] = 0
+        self._error = False
+        self._closed = False
+        self._thread = threading.Thread(target = self._run_read, name = "mux.Mux._run_read")
+        self._thread.daemon = True
+        self._thread.start()
+
+    def stream(self, sid):
+        """return the stream with id @sid, which has the same interface
+        as snc.snc"""
+        ret = _Stream(self, sid)
+        ret.heartbeat_interval = self._conn.heartbeat_interval
+        return ret
+
+    def close(self):
+        """stop reading; the underlying connection is not closed"""
+        with self._cd:
+            self._closed = True
+            self._cd.notify_all()
+
+    def _send(self, sid, parts, timeout):
+        """send the strings in the list @parts in one frame"""
+        if self._error or self._closed:
+            raise snc.Error
+        size = sum(len(i) for i in parts)
+        with self._conn_lock:
+            self._conn.write_frame([_HEADER.pack(sid, size)] + parts, timeout)
+
+    def _recv(self, sid, size, timeout):
+        if timeout < 0:
+            deadline = None
+        else:
+            deadline = time.time() + timeout + snc.network_timeout()
+        with self._cd:
+            while self._buf_len[sid] < size:
+                if self._error or self._closed:
+                    raise snc.Error
+                if deadline is None:
+                    self._cd.wait()
+                else:
+                    t = deadline - time.time()
+                    if t <= 0:
+                        log.error("failed to read from stream {0}: timed out" . format(sid))
+                        raise snc.Error
+                    self._cd.wait(t)
+            buf = self._buf[sid]
+            ret = list()
+            while size:
+                s = buf.popleft()
+                if len(s) > size:
+                    buf.appendleft(s[size:])
+                    s = s[:size]
+                ret.append(s)
+                size -= len(s)
+                self._buf_len[sid] -= len(s)
+            self._cd.notify_all()
+            return "".join(ret)
+
+    def _run_read(self):
+        conn = self._conn
+        try:
+            while not self._closed:
+                if not conn.wait_readable(_WAIT_INTERVAL):
+                    continue
+                with self._conn_lock:
+                    if not conn.has_data():
+                        continue
+                    (sid, size) = _HEADER.unpack(conn.read(_HEADER.size))
+                    data = conn.read(size)
+                with self._cd:
+                    if sid not in self._buf:
+                        log.warning("data received for unknown stream {0}" . format(sid))
+                        continue
+                    self._buf[sid].append(data)
+                    self._buf_len[sid] += size
+                    self._cd.notify_all()
+                    while self._buf_len[sid] > _BUF_MAX and not self._closed:
+                        self._cd.wait()
+        except snc.Error:
+            pass
+        except Exception as e:
+            log.error("failed to read multiplexed connection: {0}" . format(e))
+        finally:
+            with self._cd:
+                self._error = True
+                self._cd.notify_all()
+
+
+class _Stream(snc.snc):
+    def __init__(self, mux, sid):
+        self._mux = mux
+        self._sid = sid
+        self._snc = None
+        self._wbuf = list()
+        self._wbuf_len = 0
+
+    def read(self, len, timeout = 0):
+        if self._wbuf:
+            self.flush(timeout)
+        return self._mux._recv(self._sid, len, timeout)
+
+    def readinto(self, buf, timeout = 0):
+        size = len(buf)
+        buf[:] = self.read(size, timeout)
+        return size
+
+    def read_uint32(self, timeout = 0):
+        return struct.unpack("!I", self.read(4, timeout))[0]
+
+    def recv_to_file(self, fd, size, digest = None, timeout = 0):
+        h = None
+        if digest:
+            h = hashlib.new(digest)
+        while size:
+            data = self.read(min(size, _FRAME_FLUSH_SIZE), timeout)
+            size -= len(data)
+            if h:
+                h.update(data)
+            while data:
+                data = data[os.write(fd, data):]
+        if h:
+            return h.digest()
+
+    def write(self, data, timeout = 0):
+        self.write_frame([data], timeout)
+
+    def write_buffered(self, data, timeout = 0):
+        self._wbuf.append(data)
+        self._wbuf_len += len(data)
+        if self._wbuf_len >= _FRAME_FLUSH_SIZE:
+            self.flush(timeout)
+
+    def write_frame(self, parts, timeout = 0):
+        self._wbuf.extend(parts)
+        self.flush(timeout)
+
+    def flush(self, timeout = 0):
+        if self._wbuf:
+            parts = self._wbuf
+            self._wbuf = list()
+            self._wbuf_len = 0
+            self._mux._send(self._sid, parts, timeout)
+
+    def close(self):
+        pass
+
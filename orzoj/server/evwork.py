@@ -0,0 +1,576 @@
+# $File: evwork.py
+# $Author: Jiakai <jia.kai66@gmail.com>
+#
+# This file is part of orzoj
+#
+# Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+#
+# Orzoj is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Orzoj is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""serve all judges in one thread driven by evloop, instead of a thread
+for each judge (and each slot) as work.thread_new_judge_connection does;
+the protocol is the same, and the task queue and the other registries
+in work are shared"""
+
+import sys, time, os.path, struct, traceback, select
+
+from orzoj import log, snc, msg, structures, control, conf, sync_dir, evloop, zstream
+from orzoj.server import web, work
+
+_nworker = 0
+
+_CASE_RESULT = struct.Struct("!5I")
+# the uint32 fields of structures.case_result
+
+_judges = set()
+# connected instances of _Judge_conn
+
+_serving = set()
+# Futures of _Judge_conn.run not finished yet
+
+def enabled():
+    return _nworker > 0
+
+def run(sock):
+    """accept judges on the listening socket @sock and serve them,
+    until the termination flag is set"""
+    global _nworker, _judges
+    evloop.init(_nworker)
+    evloop.add_handler(sock.fileno(), evloop.EV_READ, lambda events: _accept(sock))
+    log.info("serving judges in event loop mode, with {0} worker threads" .
+            format(_nworker))
+    evloop.run(control.test_termination_flag)
+    evloop.remove_handler(sock.fileno())
+    # the coroutine serving each judge fails once its connection is closed,
+    # and cleans up as usual (its tasks are queued again and the judge is
+    # unregistered on the website)
+    for i in list(_judges):
+        i.shutdown()
+    evloop.run(lambda: not _serving)
+    evloop.stop()
+
+def _accept(sock):
+    # accept all the pending connections, so that the backlog does not
+    # overflow when many judges connect at the same time
+    while select.select([sock.fileno()], [], [], 0)[0]:
+        try:
+            (conn, addr) = sock.accept(1)
+        except snc.ErrorTimeout:
+            return
+        except snc.Error:
+            control.set_termination_flag()
+            return
+        log.info("connected by {0!r}" . format(addr))
+        fut = evloop.spawn(_Judge_conn(conn, addr).run(), "evwork._Judge_conn.run")
+        _serving.add(fut)
+        fut.add_callback(_serving.discard)
+
+
+class _Task_waiter:
+    def __init__(self):
+        """used with work._Task_queue.get_or_watch; wake() may be called
+        in any thread, and completes the current Future"""
+        self.future = None
+
+    def reset(self):
+        self.future = evloop.Future()
+
+    def wake(self):
+        evloop.call_threadsafe(self._wake, self.future)
+
+    def _wake(self, fut):
+        fut.set_result()
+
+
+class _Judge_conn:
+    def __init__(self, sock, addr):
+        """serve a new connection, which should be orzoj-judge;
+        @sock and @addr are returned by snc.socket.accept"""
+        self._sock = sock
+        self._addr = addr
+        self._conn = None
+        self._muxed = False
+        self._slots = list()
+        self._slot_error = None
+        # sys.exc_info() of the first exception raised by a slot
+        self._web_registered = False
+        self._judge = structures.judge()
+        self._lang_id_set = set()
+        self._synced = dict()
+        # dict of <problem code> => <data signature when last synchronized>
+        self._syncing = set()
+        # problem codes being prefetched by some slot
+
+    def close(self):
+        if self._conn:
+            self._conn.close()
+            self._conn = None
+        else:
+            self._sock.close()
+        _judges.discard(self)
+
+    def shutdown(self):
+        """close the connection, so that run() fails and cleans up"""
+        if self._conn:
+            self._conn.close()
+        else:
+            self._sock.close()
+
+    def run(self):
+        judge = self._judge
+        _judges.add(self)
+        try:
+            self._conn = evloop.Conn(self._sock)
+            yield self._conn.handshake()
+            yield self._hello()
+
+            if judge.nslot > 1:
+                yield self._serve_mux()
+            else:
+                self._slots.append(work._Judge_slot(self._conn, 0))
+                yield self._serve_slot(self._slots[0])
+
+        except snc.Error:
+            log.warning("[judge {0!r}] failed because of network error" . format(judge.id))
+            yield self._clean()
+        except work._internal_error:
+            yield self._clean()
+        except web.Error:
+            log.warning("[judge {0!r}] failed because of error while communicating with website" . format(judge.id))
+            if not self._muxed:
+                self._write_error(self._conn)
+            yield self._clean()
+        except sync_dir.Error:
+            log.warning("[judge {0!r}] failed to synchronize data directory" .
+                    format(judge.id))
+            yield self._clean()
+        except Exception as e:
+            log.warning("[judge {0!r}] error happens: {1}" .
+                    format(judge.id, e))
+            log.debug(traceback.format_exc())
+            yield self._clean()
+        else:
+            # stopped by the termination flag
+            yield self._clean()
+        self.close()
+
+    def _hello(self):
+        judge = self._judge
+        conn = self._conn
+        def _write_msg(m, *fields):
+            msg.write_msg(conn, m, *fields)
+
+        def _check_msg(m):
+            if m != (yield conn.read_uint32()):
+                log.warning("[judge {0!r}] message check error" .
+                        format(judge.id))
+                raise work._internal_error
+
+        yield _check_msg(msg.HELLO)
+        judge_id = yield conn.read_str()
+
+        if len(judge_id) > work._id_max_len:
+            _write_msg(msg.ID_TOO_LONG)
+            raise work._internal_error
+
+        with work._judge_id_set_lock:
+            if judge_id in work._judge_id_set:
+                _write_msg(msg.DUPLICATED_ID)
+                log.warning("another judge declares duplicated id {0!r}" .
+                        format(judge_id))
+                raise work._internal_error
+
+            work._judge_id_set.add(judge_id)
+
+        judge.id = judge_id
+        del judge_id
+
+        judge.protocol_version = yield conn.read_uint32()
+        if judge.protocol_version < msg.PROTOCOL_VERSION_MIN or \
+                judge.protocol_version > msg.PROTOCOL_VERSION:
+            log.warning("[judge {0!r}] version check error" .
+                    format(judge.id))
+            _write_msg(msg.ERROR)
+            raise work._internal_error
+        if judge.protocol_version < msg.PROTOCOL_VERSION_TLS12:
+            log.warning("[judge {0!r}] is connected by TLSv1, please upgrade it" .
+                    format(judge.id))
+
+        cnt = yield conn.read_uint32()
+        while cnt:
+            cnt -= 1
+            lang = yield conn.read_str()
+            judge.lang_supported.add(lang)
+            self._lang_id_set.add(work._get_lang_id(lang))
+
+        if judge.protocol_version >= msg.PROTOCOL_VERSION_PEER:
+            judge.peer_addr = yield conn.read_str()
+            judge.peer_port = yield conn.read_uint32()
+            if judge.peer_port and not judge.peer_addr:
+                if self._addr:
+                    judge.peer_addr = self._addr.rsplit(':', 1)[0]
+                else:
+                    judge.peer_port = 0
+
+        if judge.protocol_version >= msg.PROTOCOL_VERSION_HASH:
+            algos = set()
+            cnt = yield conn.read_uint32()
+            while cnt:
+                cnt -= 1
+                algos.add((yield conn.read_str()))
+            algos.intersection_update(sync_dir.algorithms())
+            for i in work._sync_hash_algos:
+                if i in algos:
+                    judge.hash_algo = i
+                    break
+            else:
+                log.warning("[judge {0!r}] no common checksum algorithm" .
+                        format(judge.id))
+                _write_msg(msg.ERROR)
+                raise work._internal_error
+
+        if judge.protocol_version >= msg.PROTOCOL_VERSION_ARCHIVE:
+            formats = list()
+            cnt = yield conn.read_uint32()
+            while cnt:
+                cnt -= 1
+                formats.append((yield conn.read_str()))
+            judge.archive_format = sync_dir.choose_archive_format(formats)
+
+        if judge.protocol_version >= msg.PROTOCOL_VERSION_SLOT:
+            judge.nslot = max(min((yield conn.read_uint32()), work._judge_slots_max), 1)
+
+        if judge.protocol_version >= msg.PROTOCOL_VERSION_COMPRESS:
+            methods = list()
+            cnt = yield conn.read_uint32()
+            while cnt:
+                cnt -= 1
+                methods.append((yield conn.read_str()))
+            judge.compression = zstream.choose(methods)
+
+        if judge.protocol_version >= msg.PROTOCOL_VERSION_HEARTBEAT:
+            judge.heartbeat_interval = max(min((yield conn.read_uint32()) / 1000.0,
+                snc.heartbeat_interval()), msg.TELL_ONLINE_INTERVAL)
+
+        _write_msg(msg.CONNECT_OK, *work._connect_ok_fields(judge))
+        if judge.compression:
+            conn.begin_compress(judge.compression)
+        conn.heartbeat_interval = judge.heartbeat_interval
+
+        query_ans = dict()
+        for i in (yield evloop.run_in_thread(web.get_query_list)):
+            _write_msg(msg.QUERY_INFO, i)
+            yield _check_msg(msg.ANS_QUERY)
+            query_ans[i] = yield conn.read_str()
+
+        yield evloop.run_in_thread(web.register_new_judge, judge, query_ans)
+        self._web_registered = True
+
+        log.info("[judge {0!r}] successfully connected" . format(judge.id))
+
+    def _clean(self):
+        global _judges
+        for slot in self._slots:
+            if slot.cur_task:
+                # the loop must not be blocked even if the queue is full
+                work._task_queue.put(slot.cur_task, False)
+                slot.cur_task = None
+
+        judge = self._judge
+        work._forget_judge(judge)
+
+        if self._web_registered:
+            try:
+                yield evloop.run_in_thread(web.remove_judge, judge)
+            except web.Error:
+                log.warning("[judge {0!r}] failed to unregister on website" . format(judge.id))
+
+        log.info("[judge {0!r}] disconnected" . format(judge.id))
+
+    def _write_error(self, conn):
+        try:
+            msg.write_msg(conn, msg.ERROR)
+        except snc.Error:
+            pass
+
+    def _serve_slot(self, slot):
+        while not control.test_termination_flag() and self._slot_error is None:
+            yield self._solve_task(slot)
+
+    def _serve_mux(self):
+        """serve all the slots of the judge in multiplexed mode,
+        re-raise the first exception raised by a slot"""
+        judge = self._judge
+        msg.write_msg(self._conn, msg.MUX_BEGIN, judge.nslot)
+        self._muxed = True
+        streams = self._conn.begin_mux(judge.nslot)
+        for i in range(judge.nslot):
+            self._slots.append(work._Judge_slot(streams[i], i + 1))
+        log.info("[judge {0!r}] working with {1} slots" . format(judge.id, len(self._slots)))
+
+        def _run(slot):
+            try:
+                yield self._serve_slot(slot)
+            except Exception as e:
+                if self._slot_error is None:
+                    self._slot_error = sys.exc_info()
+                    if isinstance(e, web.Error):
+                        self._write_error(slot.conn)
+                # stop the other slots
+                self._conn.stop_streams()
+
+        slots = [evloop.spawn(_run(slot), "evwork._Judge_conn._serve_mux._run")
+                for slot in self._slots]
+        for i in slots:
+            yield i
+        if self._slot_error is not None:
+            raise self._slot_error[0], self._slot_error[1], self._slot_error[2]
+
+    def _get_task(self):
+        """take a task from the queue in a worker thread, since the data
+        directories are scanned for data locality"""
+        return evloop.run_in_thread(work._task_queue.get, self._lang_id_set,
+                self._judge.id)
+
+    def _wait_task(self, slot):
+        """wait for a task while sending TELL_ONLINE, like
+        work.thread_new_judge_connection._wait_task; return None when the
+        queue changes without a task usable, or when it is time to look for
+        data to prefetch again"""
+        judge = self._judge
+        conn = slot.conn
+        waiter = _Task_waiter()
+        waiter.reset()
+        try:
+            (task, expire) = yield evloop.run_in_thread(work._task_queue.get_or_watch,
+                    self._lang_id_set, waiter, judge.id)
+            if task is not None:
+                yield evloop.Return(task)
+            timeout = work._PREFETCH_RESCAN_INTERVAL
+            if expire is not None:
+                timeout = max(min(timeout, expire - time.time()), 0)
+            timer = evloop.call_later(timeout, waiter.future.set_result)
+            yield evloop.wait(waiter.future, conn.heartbeat_interval,
+                    lambda: msg.tell_online(conn))
+            evloop.cancel_timer(timer)
+        finally:
+            work._task_queue.unwatch(waiter)
+        yield evloop.Return((yield self._get_task()))
+
+    def _solve_task(self, slot):
+        judge = self._judge
+        conn = slot.conn
+        def _write_msg(m, *fields):
+            msg.write_msg(conn, m, *fields)
+
+        def _read_msg():
+            return conn.read_uint32()
+
+        def _check_msg(m):
+            if m != (yield _read_msg()):
+                log.warning("[judge {0!r} message check error" .
+                        format(judge.id))
+                raise work._internal_error
+
+        def _tell_online():
+            msg.tell_online(conn)
+
+        def _stop_web_report(tell_online = True):
+            th_report.stop()
+            fut = evloop.Future()
+            th_report.notify_sent(lambda: evloop.call_threadsafe(fut.set_result))
+            if tell_online:
+                yield evloop.wait(fut, conn.heartbeat_interval, _tell_online)
+            else:
+                yield fut
+
+        task = yield self._get_task()
+        if task is None:
+            if (yield self._prefetch(slot)):
+                return
+            task = yield self._wait_task(slot)
+            if task is None:
+                return
+
+        log.info("[judge {0!r}] received task #{1} for problem {2!r}" .
+                format(self._slot_name(slot), task.id, task.prob))
+
+        slot.cur_task = task
+
+        th_report = web.Report_channel()
+
+        if not os.path.isdir(task.prob):
+            slot.cur_task = None
+            log.error("No data for problem {0!r}, task #{1} discarded" .
+                    format(task.prob, task.id))
+            th_report.report(web.report_no_data, [task])
+            yield _stop_web_report()
+            return
+
+        th_report.report(web.report_sync_data, [task, judge])
+        _write_msg(msg.PREPARE_DATA, task.prob)
+
+        data_sig = yield evloop.run_in_thread(work._prefetch_list.get_signature, task.prob)
+        speed = yield sync_dir.send_async(task.prob, conn,
+                work._get_peers(judge, task.prob, data_sig),
+                judge.hash_algo, judge.archive_format)
+        if speed:
+            log.info("[judge {0!r}] file transfer speed: {1!r} kb/s" .
+                    format(judge.id, speed))
+
+        m = yield _read_msg()
+
+        if m == msg.DATA_ERROR:
+            slot.cur_task = None
+            reason = yield conn.read_str()
+            log.error("[judge {0!r}] [task #{1}] [prob: {2!r}] data error:\n{3}" .
+                    format(judge.id, task.id, task.prob, reason))
+            th_report.report(web.report_error, [task, "data error"])
+            yield _stop_web_report()
+            return
+        elif m != msg.DATA_OK:
+            log.warning("[judge {0!r}] message check error" . format(judge.id))
+            th_report.report(web.report_error, [task, "message check error"])
+            yield _stop_web_report(False)
+            raise work._internal_error
+
+        ncase = yield conn.read_uint32()
+        self._synced[task.prob] = data_sig
+        work._peer_registry.add(task.prob, judge, data_sig)
+        work._data_locality.add(task.prob, judge.id, self._lang_id_set, data_sig)
+
+        _write_msg(msg.START_JUDGE, task.lang, task.src, task.input, task.output)
+
+        while True:
+            m = yield _read_msg()
+            if m == msg.START_JUDGE_OK:
+                break
+            if m != msg.START_JUDGE_WAIT:
+                log.warning("[judge {0!r}] message check error" .
+                        format(judge.id))
+                th_report.report(web.report_error, [task, "message check error"])
+                yield _stop_web_report(False)
+                raise work._internal_error
+
+        th_report.report(web.report_compiling, [task])
+
+        while True:
+            m = yield _read_msg()
+            if m == msg.TELL_ONLINE:
+                continue
+
+            if m == msg.COMPILE_SUCCEED:
+                th_report.report(web.report_compile_success, [task, ncase])
+                break
+            else:
+                if m != msg.COMPILE_FAIL:
+                    th_report.report(web.report_error, [task, "message check error"])
+                    log.warning("[judge {0!r}] message check error" .
+                            format(judge.id))
+                    yield _stop_web_report(False)
+                    raise work._internal_error
+                slot.cur_task = None
+                th_report.report(web.report_compile_failure, [task, (yield conn.read_str())])
+                yield _stop_web_report()
+                return
+
+        prob_res = list()
+
+        for i in range(ncase):
+            if not web.report_cases():
+                th_report.lazy_report(web.report_judge_progress, [task, i])
+            while True:
+                m = yield _read_msg()
+                if m == msg.REPORT_CASE:
+                    break
+                if m != msg.TELL_ONLINE:
+                    log.warning("[judge {0!r}] message check error" .
+                            format(judge.id))
+                    th_report.report(web.report_error, [task, "message check error"])
+                    yield _stop_web_report(False)
+                    raise work._internal_error
+            result = structures.case_result()
+            (result.exe_status, result.score, result.full_score, result.time,
+                    result.memory) = _CASE_RESULT.unpack((yield conn.read(_CASE_RESULT.size)))
+            result.extra_info = yield conn.read_str()
+            prob_res.append(result)
+            if web.report_cases():
+                th_report.report_case(web.report_case_result, [task, i, result])
+
+        th_report.clean_lazy()
+        th_report.report(web.report_prob_result, [task, prob_res])
+
+        yield _check_msg(msg.REPORT_JUDGE_FINISH)
+
+        slot.cur_task = None
+        yield _stop_web_report()
+
+        if th_report.check_error():
+            log.warning("[judge {0!r}] error while reporting judge results for task #{1}" .
+                    format(judge.id, task.id))
+        else:
+            log.info("[judge {0!r}] finished task #{1} normally" .
+                    format(self._slot_name(slot), task.id))
+
+    def _slot_name(self, slot):
+        """the judge id with slot number, for logging"""
+        if slot.num:
+            return "{0}#{1}" . format(self._judge.id, slot.num)
+        return self._judge.id
+
+    def _prefetch(self, slot):
+        """synchronize the data of a problem which is likely to be judged soon
+        but has not been synchronized to this judge yet,
+        return whether any data are synchronized"""
+        judge = self._judge
+        # the data directories are scanned in a worker thread, with copies
+        # of the registries of this judge, which other slots may change
+        found = yield evloop.run_in_thread(work._find_prefetch, judge,
+                self._lang_id_set, dict(self._synced), set(self._syncing))
+        if found is None:
+            yield evloop.Return(False)
+        (pcode, data_sig) = found
+        if self._synced.get(pcode) == data_sig or pcode in self._syncing:
+            # taken by another slot meanwhile
+            yield evloop.Return(False)
+        self._syncing.add(pcode)
+
+        try:
+            log.info("[judge {0!r}] prefetching data for problem {1!r}" .
+                    format(self._slot_name(slot), pcode))
+            msg.write_msg(slot.conn, msg.PREFETCH_DATA, pcode)
+            speed = yield sync_dir.send_async(pcode, slot.conn,
+                    work._get_peers(judge, pcode, data_sig),
+                    judge.hash_algo, judge.archive_format)
+            if speed:
+                log.info("[judge {0!r}] file transfer speed: {1!r} kb/s" .
+                        format(self._slot_name(slot), speed))
+            self._synced[pcode] = data_sig
+        finally:
+            self._syncing.discard(pcode)
+        work._peer_registry.add(pcode, judge, data_sig)
+        work._data_locality.add(pcode, judge.id, self._lang_id_set, data_sig)
+        yield evloop.Return(True)
+
+
+def _set_event_loop(arg):
+    global _nworker
+    _nworker = int(arg[1])
+    if _nworker < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+    if _nworker and not conf.is_unix:
+        raise conf.UserError("Option {0} is only supported on Unix" . format(arg[0]))
+
+conf.simple_conf_handler("EventLoop", _set_event_loop, default = "0")
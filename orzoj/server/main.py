@@ -24,7 +24,7 @@
 
 import sys, optparse, time, threading, os
 from orzoj import log, conf, control, daemon, snc
-from orzoj.server import work
+from orzoj.server import work, evwork, web
 
 SERVER_VERSION = 0x00000101
 # major(16 bit),minor(8 bit),revision(8 bit)
@@ -68,8 +68,12 @@ def run_server():
     log.info("orzoj-server started, listening on {0}" .
             format(_port))
 
+    web.start_report_threads()
     threading.Thread(target = work.thread_work, name = "work.thread_work").start()
 
+    if evwork.enabled():
+        evwork.run(s)
+
     while not control.test_termination_flag():
         try:
             (conn, addr) = s.accept(1)
@@ -80,19 +84,32 @@ def run_server():
             break
 
         log.info("connected by {0!r}" . format(addr))
-        work.thread_new_judge_connection(conn).start()
+        work.thread_new_judge_connection(conn, addr).start()
 
     s.close()
-    while threading.active_count() > 1:
-        log.debug("waiting for threads, current active count: {0}" .
-                format(threading.active_count()))
-        for i in threading.enumerate():
-            log.debug("active thread: {0!r}" . format(i.name))
-        time.sleep(1)
+    work.stop()
+    # the reports of the judges are sent before the reporting threads stop
+    _wait_threads(lambda th: not web.is_report_thread(th))
+    web.stop_report_threads()
+    _wait_threads(lambda th: True)
 
     daemon.pid_end()
 
 
+def _wait_threads(pred):
+    """wait for the threads other than the current one for which
+    @pred(<thread>) is True to exit"""
+    while True:
+        threads = [i for i in threading.enumerate()
+                if i is not threading.current_thread() and pred(i)]
+        if not threads:
+            return
+        log.debug("waiting for threads, current active count: {0}" .
+                format(len(threads)))
+        for i in threads:
+            log.debug("active thread: {0!r}" . format(i.name))
+        time.sleep(1)
+
 def _set_port(arg):
     global _port
     _port = int(arg[1])
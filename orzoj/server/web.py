@@ -41,12 +41,26 @@ version 1:
 
     website can send 'relogin' for requesting a new login
 
+    requests are sent over persistent (keep-alive) HTTP connections if
+    the website supports them
+
+report_batch:
+    if WebReportBatch is more than 1, reports of the status of tasks
+    (report_* functions) are collected from all tasks and sent together:
+
+    data: action=report_batch, reports=array(<data of each report, in order>)
+    return: NULL
+
+    the website should handle the reports in the given order, as if they
+    were sent one by one
+
 """
 
 _VERSION = 1
 _DYNAMIC_PASSWD_MAXLEN = 128
 
-import urllib2, urllib, sys, hashlib, threading, time
+import urllib2, urllib, urlparse, httplib, sys, hashlib, threading, time, select, socket
+from collections import deque
 
 from orzoj import conf, log, structures, control, phpserialize
 
@@ -56,10 +70,27 @@ _retry_cnt = None
 _retry_wait = None
 _timeout = None
 _web_addr = None
+_web_conn_class = None
+_web_host = None
+_web_path = None
 _sched_interval = None
+_fetch_batch = None
+_long_poll = None
 _thread_req_id = dict()
 _lock_thread_req_id = threading.Lock()
 _lock_relogin = threading.Lock()
+_report_batch = None
+_report_interval = None
+_report_threads = None
+_report_thread_list = list()
+# threads started by start_report_threads
+_case_report_interval = None # negative if report_case_result is not used
+_tls = threading.local()
+
+_CONN_POOL_MAX = 8
+# the maximal number of idle connections kept to the website
+_conn_pool = list()
+_lock_conn_pool = threading.Lock()
 
 class _internal_error(Exception):
     def __init__(self, msg):
@@ -93,7 +124,7 @@ def report_error(task, msg):
     Note:
         'data' is the data sent to website
         'return' is the data received from website"""
-    _read({"action":"report_error", "task":task.id, "msg":msg})
+    _report({"action":"report_error", "task":task.id, "msg":msg})
 
 def get_query_list():
     """return a list containing the queries for judge info
@@ -133,6 +164,25 @@ def remove_judge(judge):
     return: NULL"""
     _read({"action":"remove_judge", "judge":judge.id_num})
 
+_TASK_OPTIONAL_FIELDS = ("priority", "deadline")
+_TASK_SERVER_FIELDS = ("queue_time", )
+# fields of structures.task set by orzoj-server, not by the website
+
+def _parse_task(ret):
+    """convert a task of type "src" returned by website to structures.task"""
+    v = structures.task()
+    for i in v.__dict__:
+        if i in _TASK_SERVER_FIELDS:
+            continue
+        if i in _TASK_OPTIONAL_FIELDS and ret.get(i) is None:
+            continue
+        v.__dict__[i] = ret[i]
+    v.id = int(v.id)
+    v.priority = int(v.priority)
+    if v.deadline is not None:
+        v.deadline = float(v.deadline)
+    return v
+
 _fetch_task_prev = None
 def fetch_task():
     """try to fetch a new task. return None if no new task available.
@@ -144,7 +194,8 @@ def fetch_task():
             "none" -- no new task
                       args: none
             "src"  -- new source file to be judged
-                      args: id, prob, lang, src, input, output (see structures.py)"""
+                      args: id, prob, lang, src, input, output,
+                            [priority, deadline] (see structures.py)"""
     global _fetch_task_prev
     try:
         ret = _read({"action":"fetch_task", "prev": _fetch_task_prev})
@@ -154,30 +205,71 @@ def fetch_task():
             return
         if t == "src":
             _fetch_task_prev = {'type':'src', 'id':ret['id']}
-            v = structures.task()
-            for i in v.__dict__:
-                v.__dict__[i] = ret[i]
-            v.id = int(v.id)
-            return v
+            return _parse_task(ret)
         raise _internal_error("unknown task type: {0!r}" . format(t))
     except Exception as e:
         log.error("failed to fetch task: {0}" . format(e))
         raise Error
 
+def fetch_tasks():
+    """fetch at most _fetch_batch new tasks and return a list of them,
+    which is empty if no new task available; if _long_poll is positive,
+    the website may wait at most _long_poll seconds for a new task before
+    returning "none". fetch_task is used if neither option is set, since
+    older websites do not know this action.
+
+    data: action=fetch_tasks, max=...(:int), wait=...(seconds:int),
+        prev=array("type"=>"list", "id"=>array(<ids of tasks received last time>))|None
+    return: array("type"=>type, <type specified arguments>)
+        type:
+            "none" -- no new task
+                      args: none
+            "list" -- new tasks to be judged, at most <max>
+                      args: tasks=array(<task as returned by fetch_task with type "src">)"""
+    global _fetch_task_prev, _fetch_batch, _long_poll
+    if _fetch_batch == 1 and not _long_poll:
+        v = fetch_task()
+        if v is None:
+            return []
+        return [v]
+    try:
+        ret = _read({"action":"fetch_tasks", "max":_fetch_batch, "wait":_long_poll,
+            "prev":_fetch_task_prev}, timeout = _long_poll)
+        _fetch_task_prev = None
+        t = ret["type"]
+        if t == "none":
+            return []
+        if t == "list":
+            tasks = list()
+            for i in phpserialize.dict_to_list(ret["tasks"]):
+                if i["type"] != "src":
+                    raise _internal_error("unknown task type: {0!r}" . format(i["type"]))
+                tasks.append(_parse_task(i))
+            _fetch_task_prev = {"type":"list", "id":[v.id for v in tasks]}
+            return tasks
+        raise _internal_error("unknown task type: {0!r}" . format(t))
+    except Exception as e:
+        log.error("failed to fetch tasks: {0}" . format(e))
+        raise Error
+
+def is_long_poll():
+    """whether fetch_tasks waits on the website for new tasks"""
+    return _long_poll > 0
+
 def report_no_data(task):
     """tell the website that there are no data for the task
     this function does not raise exceptions
     
     data: action=report_no_data, task=...(id:int)
     return: NULL"""
-    _read({"action":"report_no_data", "task":task.id})
+    _report({"action":"report_no_data", "task":task.id})
 
 def report_judge_waiting(task):
     """judge is waiting because it's serving another orzoj-server
 
     data: action=report_judge_waiting, task=...(id:int)
     return: NULL"""
-    _read({"action":"report_judge_waiting", "task":task.id})
+    _report({"action":"report_judge_waiting", "task":task.id})
 
 def report_sync_data(task, judge):
     """@task will be judged on @judge and now it's synchronizing data
@@ -185,28 +277,28 @@ def report_sync_data(task, judge):
     data: action=report_sync_data, task=...(id:int), judge=...(id:int)
     return: NULL
     """
-    _read({"action":"report_sync_data", "task":task.id, "judge":judge.id_num})
+    _report({"action":"report_sync_data", "task":task.id, "judge":judge.id_num})
 
 def report_compiling(task):
     """now compiling @task
 
     data: action=report_compiling, task=...(id:int)
     return: NULL"""
-    _read({"action":"report_compiling", "task":task.id})
+    _report({"action":"report_compiling", "task":task.id})
 
 def report_compile_success(task, ncase):
     """successfully compiled
 
     data: action=report_compile_success, task=...(id:int), ncase=...
     return: NULL"""
-    _read({"action": "report_compile_success", "task": task.id, "ncase": ncase})
+    _report({"action": "report_compile_success", "task": task.id, "ncase": ncase})
 
 def report_compile_failure(task, info):
     """failed to compile
 
     data: action=report_compile_failure, task=...(id:int), info=...
     return: NULL"""
-    _read({"action":"report_compile_failure", "task":task.id, "info":info})
+    _report({"action":"report_compile_failure", "task":task.id, "info":info})
 
 def report_judge_progress(task, now):
     """
@@ -214,7 +306,25 @@ def report_judge_progress(task, now):
 
     data: action=report_judge_progress, task=...(id:int), now=...
     return: NULL"""
-    _read({"action":"report_judge_progress", "task":task.id, "now": now})
+    _report({"action":"report_judge_progress", "task":task.id, "now": now})
+
+def report_cases():
+    """whether the result of each case should be reported by
+    report_case_result as soon as it is received"""
+    return _case_report_interval >= 0
+
+def report_case_result(task, num, result):
+    """
+    @num: case number, starting from 0
+    @result: case_result
+
+    data: action=report_case_result, task=...(id:int), case=...,
+        exe_status=..., score=..., ... (see case_result in structures.py)
+    return: NULL
+    """
+    data = {"action":"report_case_result", "task":task.id, "case":num}
+    data.update(result.__dict__)
+    _report(data)
 
 def report_prob_result(task, result):
     """
@@ -228,20 +338,309 @@ def report_prob_result(task, result):
     d = structures.case_result().__dict__
     for i in d:
         data[i] = [case.__dict__[i] for case in result]
-    _read(data)
+    _report(data)
+
+def _report(data):
+    """send a report, or collect it if a batch is being made in this thread"""
+    batch = getattr(_tls, "batch", None)
+    if batch is None:
+        _read(data)
+    else:
+        batch.append(data)
+
+
+class Report_channel:
+    def __init__(self):
+        """reports of one task, which are sent in order by one of the
+        thread_report threads at a time (together with reports of other tasks
+        if WebReportBatch is more than 1); reports of different channels are
+        sent in parallel"""
+        self._on_error = threading.Event()
+        self._pending = 0 # number of reports not sent yet
+        self._lazy = None
+        self._stopped = False
+        self._on_sent = None
+
+    def report(self, func, args):
+        """@func should be one of the report_* functions"""
+        _report_queue.put(self, func, args, _report_interval)
+
+    def report_case(self, func, args):
+        """like report, but for the result of a case, which waits at most
+        WebReportCases seconds to be sent together with other reports"""
+        _report_queue.put(self, func, args, _case_report_interval)
+
+    def lazy_report(self, func, args):
+        """like report, but the report is only sent when nothing else
+        is waiting, and is replaced by the next lazy report of this channel"""
+        _report_queue.put_lazy(self, func, args)
+
+    def clean_lazy(self):
+        _report_queue.put_lazy(self, None, None)
+
+    def check_error(self):
+        return self._on_error.is_set()
+
+    def stop(self):
+        """no more reports would be added; the lazy report is dropped"""
+        _report_queue.stop(self)
+
+    def wait(self, timeout):
+        """wait at most @timeout seconds until all the reports are sent,
+        return whether they are"""
+        return _report_queue.wait(self, timeout)
+
+    def notify_sent(self, func):
+        """call @func() once all the reports are sent, either at once or
+        later in the reporting thread; should be called after stop()"""
+        _report_queue.notify_sent(self, func)
+
+
+class _Report_queue:
+    def __init__(self):
+        self._cd = threading.Condition()
+        self._queue = deque()
+        # deque of tuple(<channel>, <func>, <args>, <deadline>)
+        self._lazy = dict()
+        # dict of <channel> => tuple(<func>, <args>, <deadline>)
+        self._busy = set()
+        # channels whose reports are being sent by some thread, whose other
+        # reports must wait to keep them in order
+        self._closed = False
+
+    def put(self, ch, func, args, delay):
+        """the report is sent at most @delay seconds later"""
+        with self._cd:
+            self._queue.append((ch, func, args, time.time() + delay))
+            ch._pending += 1
+            self._cd.notify_all()
+
+    def put_lazy(self, ch, func, args):
+        with self._cd:
+            if ch._stopped:
+                return
+            if func is None:
+                self._lazy.pop(ch, None)
+            else:
+                self._lazy[ch] = (func, args, time.time() + _report_interval)
+            self._cd.notify_all()
+
+    def stop(self, ch):
+        with self._cd:
+            ch._stopped = True
+            self._lazy.pop(ch, None)
+            self._cd.notify_all()
+
+    def wait(self, ch, timeout):
+        with self._cd:
+            if ch._pending or ch in self._lazy:
+                self._cd.wait(timeout)
+            return not ch._pending and ch not in self._lazy
+
+    def notify_sent(self, ch, func):
+        with self._cd:
+            if ch._pending or ch in self._lazy:
+                ch._on_sent = func
+                return
+        func()
+
+    def close(self):
+        """let get() return None once all the reports are taken"""
+        with self._cd:
+            self._closed = True
+            self._cd.notify_all()
+
+    def get(self):
+        """wait until a batch should be sent and return a list of
+        tuple(<channel>, <func>, <args>), lazy reports last; the channels
+        in the batch are busy until done() is called
+
+        return None if closed and no report is left"""
+        global _report_batch, _report_interval
+        with self._cd:
+            while True:
+                ready = [i for i in self._queue if i[0] not in self._busy]
+                lazy = [ch for ch in self._lazy if ch not in self._busy]
+                n = len(ready) + len(lazy)
+                if not n:
+                    if self._closed and not self._queue and not self._lazy:
+                        return None
+                    self._cd.wait()
+                    continue
+                if n >= _report_batch or self._closed or control.test_termination_flag():
+                    break
+                deadline = min([i[3] for i in ready] + [self._lazy[ch][2] for ch in lazy])
+                t = deadline - time.time()
+                if t <= 0:
+                    break
+                self._cd.wait(t)
+            ret = [i[:3] for i in ready[:_report_batch]]
+            taken = set(id(i) for i in ready[:_report_batch])
+            self._queue = deque(i for i in self._queue if id(i) not in taken)
+            for ch in lazy[:_report_batch - len(ret)]:
+                v = self._lazy.pop(ch)
+                ch._pending += 1
+                ret.append((ch, v[0], v[1]))
+            for i in ret:
+                self._busy.add(i[0])
+            return ret
+
+    def done(self, items):
+        notify = list()
+        with self._cd:
+            for i in items:
+                ch = i[0]
+                ch._pending -= 1
+                self._busy.discard(ch)
+                if ch._on_sent and not ch._pending and ch not in self._lazy:
+                    notify.append(ch._on_sent)
+                    ch._on_sent = None
+            self._cd.notify_all()
+        for func in notify:
+            func()
+
+_report_queue = _Report_queue()
+
+def start_report_threads():
+    """start WebReportThreads threads running thread_report"""
+    global _report_thread_list
+    for i in range(_report_threads):
+        th = threading.Thread(target = thread_report, name = "web.thread_report")
+        th.start()
+        _report_thread_list.append(th)
+
+def stop_report_threads():
+    """send the remaining reports and wait for the threads started by
+    start_report_threads to exit; no more reports should be added"""
+    global _report_thread_list
+    _report_queue.close()
+    for th in _report_thread_list:
+        th.join()
+    _report_thread_list = list()
+
+def is_report_thread(th):
+    return th in _report_thread_list
+
+def thread_report():
+    """send reports added through Report_channel, until stop_report_threads
+    is called"""
+    global _report_queue, _report_batch
+    while True:
+        items = _report_queue.get()
+        if items is None:
+            return
+        if _report_batch == 1:
+            _report_call(items[0])
+        else:
+            _tls.batch = list()
+            sent = list()
+            for i in items:
+                if _report_call(i):
+                    sent.append(i)
+            batch = _tls.batch
+            _tls.batch = None
+            try:
+                if batch:
+                    _read({"action":"report_batch", "reports":batch})
+            except Error:
+                for i in sent:
+                    i[0]._on_error.set()
+            except Exception as e:
+                log.error("error while communicating with orzoj-website: {0}" . format(e))
+                for i in sent:
+                    i[0]._on_error.set()
+        _report_queue.done(items)
+
+def _report_call(item):
+    """call the report function in @item, return whether it succeeds"""
+    (ch, func, args) = item
+    try:
+        func(*args)
+        return True
+    except Error:
+        ch._on_error.set()
+    except Exception as e:
+        log.error("error while communicating with orzoj-website: {0}" . format(e))
+        ch._on_error.set()
+    return False
 
 
 def _sha1sum(s):
     return hashlib.sha1(s).hexdigest()
 
-def _read(data, maxlen = None):
+def _is_closed(conn):
+    """whether the idle connection @conn has been closed by the website,
+    in which case it is readable (EOF)"""
+    if conn.sock is None:
+        return True
+    try:
+        return bool(select.select([conn.sock], [], [], 0)[0])
+    except (select.error, socket.error, ValueError):
+        return True
+
+def _post(data, timeout):
+    """POST @data to the website over a persistent connection and return
+    the response body"""
+    global _conn_pool, _lock_conn_pool
+    reused = False
+    conn = None
+    with _lock_conn_pool:
+        while _conn_pool and conn is None:
+            conn = _conn_pool.pop()
+            if _is_closed(conn):
+                conn.close()
+                conn = None
+    reused = conn is not None
+    while True:
+        if conn is None:
+            conn = _web_conn_class(_web_host, timeout = timeout)
+        conn.timeout = timeout
+        if conn.sock:
+            conn.sock.settimeout(timeout)
+        try:
+            conn.request("POST", _web_path, data,
+                    {"Content-Type" : "application/x-www-form-urlencoded"})
+        except (httplib.HTTPException, IOError):
+            conn.close()
+            if not reused:
+                raise
+            # the idle connection may have been closed by the website;
+            # the request has not been completely sent, so it can not have
+            # been handled and is safe to send again
+            conn = None
+            reused = False
+            continue
+        try:
+            resp = conn.getresponse()
+            ret = resp.read()
+        except (httplib.HTTPException, IOError):
+            # the website may have handled the request
+            conn.close()
+            raise
+        if resp.status != 200:
+            conn.close()
+            raise _internal_error("HTTP error {0} {1}" . format(resp.status, resp.reason))
+        if resp.will_close:
+            conn.close()
+        else:
+            with _lock_conn_pool:
+                if len(_conn_pool) < _CONN_POOL_MAX:
+                    _conn_pool.append(conn)
+                    conn = None
+            if conn:
+                conn.close()
+        return ret
+
+def _read(data, maxlen = None, timeout = 0):
     """if @maxlen is not None, data should be of dict type and is sent via GET method and without checksum
     and the data read is returned;
     otherwise @data will dumped by phpserialize and sent via POST method and the data read is returned
 
+    @timeout: extra seconds to wait for the response, besides _timeout
+
     Note: @maxlen is not None iff now trying to login
     """
-    global _retry_cnt, _web_addr, _thread_req_id, _lock_thread_req_id, _passwd
+    global _retry_cnt, _web_addr, _thread_req_id, _lock_thread_req_id, _passwd, _timeout
 
     def make_data():
         """return a tuple (checksum_base, data_sent)"""
@@ -268,7 +667,9 @@ def _read(data, maxlen = None):
     cnt = _retry_cnt
 
     while cnt:
-        if control.test_termination_flag():
+        # requests made while terminating (the remaining reports and
+        # unregistering judges) are tried once
+        if cnt < _retry_cnt and control.test_termination_flag():
             raise Error
         cnt -= 1
         try:
@@ -277,7 +678,7 @@ def _read(data, maxlen = None):
             if maxlen:
                 return urllib2.urlopen(url, None, _timeout).read(maxlen)
 
-            ret = urllib2.urlopen(_web_addr, data_sent, _timeout).read()
+            ret = _post(data_sent, _timeout + timeout)
 
             if ret == 'relogin':
                 if _lock_relogin.acquire(False):
@@ -372,8 +773,18 @@ def _set_web_timeout(arg):
     _timeout = int(arg[1])
 
 def _set_web_addr(arg):
-    global _web_addr
+    global _web_addr, _web_conn_class, _web_host, _web_path
     _web_addr = arg[1].rstrip('/') + "/orz.php"
+    url = urlparse.urlsplit(_web_addr)
+    if url.scheme == "http":
+        _web_conn_class = httplib.HTTPConnection
+    elif url.scheme == "https":
+        _web_conn_class = httplib.HTTPSConnection
+    else:
+        raise conf.UserError("Option {0}: unsupported URL scheme {1!r}" .
+                format(arg[0], url.scheme))
+    _web_host = url.netloc
+    _web_path = url.path
 
 def _set_web_retry_cnt(arg):
     global _retry_cnt
@@ -393,12 +804,52 @@ def _set_web_sched_interval(arg):
     if _sched_interval < 0.5:
         _sched_interval = 0.5
 
+def _set_fetch_batch(arg):
+    global _fetch_batch
+    _fetch_batch = int(arg[1])
+    if _fetch_batch < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
+def _set_long_poll(arg):
+    global _long_poll
+    _long_poll = int(arg[1])
+    if _long_poll < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _set_report_batch(arg):
+    global _report_batch
+    _report_batch = int(arg[1])
+    if _report_batch < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
+def _set_report_threads(arg):
+    global _report_threads
+    _report_threads = int(arg[1])
+    if _report_threads < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
+def _set_case_report_interval(arg):
+    global _case_report_interval
+    _case_report_interval = float(arg[1])
+
+def _set_report_interval(arg):
+    global _report_interval
+    _report_interval = float(arg[1])
+    if _report_interval < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
 conf.simple_conf_handler("Password", _set_static_password)
 conf.simple_conf_handler("WebTimeout", _set_web_timeout, "5")
 conf.simple_conf_handler("WebAddress", _set_web_addr)
 conf.simple_conf_handler("WebRetryCount", _set_web_retry_cnt, "5")
 conf.simple_conf_handler("WebRetryWait", _set_web_retry_wait, "2")
 conf.simple_conf_handler("WebSchedInterval", _set_web_sched_interval, "1")
+conf.simple_conf_handler("WebFetchBatch", _set_fetch_batch, "1")
+conf.simple_conf_handler("WebLongPoll", _set_long_poll, "0")
+conf.simple_conf_handler("WebReportBatch", _set_report_batch, "1")
+conf.simple_conf_handler("WebReportInterval", _set_report_interval, "0.5")
+conf.simple_conf_handler("WebReportThreads", _set_report_threads, "4")
+conf.simple_conf_handler("WebReportCases", _set_case_report_interval, "-1")
 
 conf.register_init_func(_login)
 
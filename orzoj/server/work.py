@@ -22,10 +22,10 @@
 
 """threads for waiting for tasks and managing judges"""
 
-import threading, time, os, os.path, traceback
+import threading, time, os, os.path, traceback, heapq, select, fcntl
 from collections import deque
 
-from orzoj import log, snc, msg, structures, control, conf, sync_dir
+from orzoj import log, snc, msg, structures, control, conf, sync_dir, mux, zstream
 from orzoj.server import web
 
 _max_queue_size = None
@@ -39,6 +39,23 @@ _judge_id_set_lock = threading.Lock()
 _refresh_interval = None
 _id_max_len = None
 
+_prefetch_list_file = None
+_prefetch_recent_max = None
+
+_peer_sources_max = None
+
+_judge_slots_max = None
+
+_locality_window = None
+_locality_max_delay = None
+
+_sync_hash_algos = ["xxh3-128", "sha256", "sha1"]
+# checksum algorithms for synchronizing data, the most preferred first
+
+_PREFETCH_RESCAN_INTERVAL = 5
+# the minimal interval in seconds between scanning the data
+# directory of a problem to find out whether it has changed
+
 class _internal_error(Exception):
     pass
 
@@ -47,125 +64,487 @@ def _get_lang_id(lang):
     with _lang_id_dict_lock:
         return _lang_id_dict.setdefault(lang, len(_lang_id_dict))
 
+class _Alarm:
+    def __init__(self):
+        """an event a thread can wait for with a timeout, set from any thread;
+        a pipe is used, since waiting on threading.Event or threading.Condition
+        with a timeout is implemented by polling"""
+        (self._rfd, self._wfd) = os.pipe()
+        fcntl.fcntl(self._wfd, fcntl.F_SETFL,
+                fcntl.fcntl(self._wfd, fcntl.F_GETFL) | os.O_NONBLOCK)
+        self._lock = threading.Lock()
+        self._set = False
+
+    def __del__(self):
+        os.close(self._rfd)
+        os.close(self._wfd)
+
+    def set(self):
+        with self._lock:
+            if self._set:
+                return
+            self._set = True
+        os.write(self._wfd, "\0")
+
+    def wait(self, timeout = None):
+        """wait at most @timeout seconds (as long as necessary if None)
+        until set, return whether it is set, which clears it"""
+        if not select.select([self._rfd], [], [], timeout)[0]:
+            return False
+        with self._lock:
+            self._set = False
+            os.read(self._rfd, 1)
+        return True
+
+class _Task_waiter(_Alarm):
+    """used with _Task_queue.get_or_watch by a thread waiting for a task"""
+    def wake(self):
+        self.set()
+
+def _wait_tell_online(conn, alarm, timeout = None):
+    """wait at most @timeout seconds (as long as necessary if None) until
+    @alarm is set, sending TELL_ONLINE via @conn whenever one is due;
+    return whether @alarm is set"""
+    deadline = None
+    if timeout is not None:
+        deadline = time.time() + timeout
+    while True:
+        now = time.time()
+        t = conn.last_msg_time + conn.heartbeat_interval - now
+        if deadline is not None:
+            t = min(t, deadline - now)
+        if alarm.wait(max(t, 0)):
+            return True
+        if deadline is not None and time.time() >= deadline:
+            return False
+        msg.tell_online(conn)
+
+def _task_key_id(task):
+    return (task.id, )
+
+def _task_key_priority(task):
+    return (-task.priority, task.id)
+
+def _task_key_deadline(task):
+    if task.deadline is None:
+        return (1, 0, task.id)
+    return (0, task.deadline, task.id)
+
+_TASK_ORDER = {"id" : _task_key_id, "priority" : _task_key_priority,
+        "deadline" : _task_key_deadline}
+# name => function mapping a task to its sort key, smaller keys are judged first
+
+_task_key = _task_key_id
+
 class _Task_queue:
     def __init__(self):
-        self._queue = dict()
-        # dict of <language id:int> => <task queue:deque>
+        """tasks are kept in heaps of entries [key, seq, task, alive];
+        an entry is shared by the heap of its language and the heaps of all
+        language sets (of judges) containing its language, and is marked
+        dead instead of being removed from every heap when the task is taken,
+        so selecting a task for a judge costs O(log n)"""
+        self._lang_heap = dict()
+        # dict of <language id:int> => <heap of entries>
+        self._set_heap = dict()
+        # dict of <language id set:frozenset> => <heap of entries>
+        self._seq = 0
         self._lock = threading.Lock()
+        self._not_full = threading.Condition(self._lock)
         self._size = 0
-
-    def put(self, task):
-        while self._is_full() and not control.test_termination_flag():
-            time.sleep(msg.TELL_ONLINE_INTERVAL)
+        self._closed = False
+        self._waiters = dict()
+        # dict of <_Task_waiter> => tuple(<language id set>, <judge id>)
+        self._rescan_time = dict()
+        # dict of <judge id> => <the last time its waiters were woken by _take>
+
+    def put(self, task, block = True):
+        """if @block is False, @task is put even if the queue is full"""
+        global _max_queue_size
         with self._lock:
-            if task.lang_id not in self._queue:
-                self._queue[task.lang_id] = deque()
-            self._queue[task.lang_id].append(task)
+            while block and self._size >= _max_queue_size and not self._closed:
+                self._not_full.wait()
+            entry = [_task_key(task), self._seq, task, True]
+            self._seq += 1
+            if task.lang_id not in self._lang_heap:
+                self._lang_heap[task.lang_id] = list()
+            heapq.heappush(self._lang_heap[task.lang_id], entry)
+            for (lang_id_set, heap) in self._set_heap.iteritems():
+                if task.lang_id in lang_id_set:
+                    if len(heap) > self._size * 2 + 16:
+                        self._compact(heap)
+                    heapq.heappush(heap, entry)
             self._size += 1
+            self._wake(task.lang_id)
+
+    def get(self, lang_id_set, judge_id = None):
+        """ return None if no usable
+        if @judge_id is not None, tasks whose data the judge already holds
+        are preferred, and tasks whose data are held by other judges may be
+        left for them (see _get)"""
+        sigs = self._signatures(lang_id_set, judge_id)
+        with self._lock:
+            return self._get(lang_id_set, judge_id, sigs)[0]
+
+    def get_or_watch(self, lang_id_set, waiter, judge_id = None):
+        """like get, but if no task is usable, @waiter.wake() is called
+        (possibly in another thread) whenever the queue changes (a usable
+        task is put, or is taken by another judge) or the queue is closed,
+        until unwatch(@waiter) is called;
+        return tuple(<task or None>, <the time when a task left for other
+        judges can be given to this judge, or None>)"""
+        sigs = self._signatures(lang_id_set, judge_id)
+        with self._lock:
+            ret = self._get(lang_id_set, judge_id, sigs)
+            if ret[0] is None:
+                self._waiters[waiter] = (lang_id_set, judge_id)
+                if self._closed:
+                    waiter.wake()
+            return ret
+
+    def unwatch(self, waiter):
+        with self._lock:
+            self._waiters.pop(waiter, None)
+
+    def forget_judge(self, judge_id):
+        with self._lock:
+            self._rescan_time.pop(judge_id, None)
 
-    def get(self, lang_id_set):
-        """ return None if no usable"""
-        ret = None
+    def close(self):
+        """wake the threads blocked in put and the waiters, at termination"""
+        with self._lock:
+            self._closed = True
+            self._not_full.notify_all()
+            for waiter in self._waiters:
+                waiter.wake()
+
+    def _signatures(self, lang_id_set, judge_id):
+        """return dict(<problem code> => <data signature>) for the tasks
+        _get would consider for data locality, or None if data locality is
+        not used; the data directories are scanned without holding self._lock"""
+        global _locality_window, _locality_max_delay, _prefetch_list
+        if judge_id is None or not _locality_window or not _locality_max_delay:
+            return None
         with self._lock:
-            min_tid = None
+            heap = self._get_set_heap(lang_id_set)
+            cand = self._pop_window(heap)
+            for entry in cand:
+                heapq.heappush(heap, entry)
+        pcodes = set(entry[2].prob for entry in cand)
+        return dict((i, _prefetch_list.get_signature(i)) for i in pcodes)
+
+    def _pop_window(self, heap):
+        """pop and return the first _locality_window live entries of @heap"""
+        ret = list()
+        while heap and len(ret) < _locality_window:
+            entry = heapq.heappop(heap)
+            if entry[3]:
+                ret.append(entry)
+        return ret
+
+    def _get(self, lang_id_set, judge_id, sigs):
+        """return tuple(<task or None>, <the time when a task left for other
+        judges can be given to this judge, or None>)
+
+        @sigs is returned by _signatures; problems not in it (queued meanwhile)
+        are taken as held by no judge
+
+        with data locality, the first _locality_window tasks are considered:
+        the first one whose data the judge holds is chosen; otherwise the
+        first one whose data no other judge waiting for a task (and supporting
+        its language) holds; otherwise none. A task waiting for more than
+        _locality_max_delay seconds is never skipped."""
+        global _locality_max_delay, _data_locality
+        heap = self._get_set_heap(lang_id_set)
+        if sigs is None:
+            while heap and not heap[0][3]:
+                heapq.heappop(heap)
+            if not heap:
+                return (None, None)
+            return (self._take(heapq.heappop(heap)), None)
+
+        cand = self._pop_window(heap)
+
+        now = time.time()
+        chosen = None
+        for entry in cand:
+            task = entry[2]
+            if now - task.queue_time >= _locality_max_delay or \
+                    _data_locality.is_held(task.prob, judge_id, sigs.get(task.prob)):
+                chosen = entry
+                break
+        expire = None
+        if chosen is None:
+            idle = set(jid for (lset, jid) in self._waiters.itervalues())
+            for entry in cand:
+                task = entry[2]
+                if not _data_locality.is_held_by_other(task.prob, task.lang_id, judge_id,
+                        sigs.get(task.prob), idle):
+                    chosen = entry
+                    break
+                t = task.queue_time + _locality_max_delay
+                if expire is None or t < expire:
+                    expire = t
+
+        for entry in cand:
+            if entry is not chosen:
+                heapq.heappush(heap, entry)
+        if chosen is None:
+            return (None, expire)
+        if chosen is not cand[0]:
+            log.debug("[judge {0!r}] task #{1} chosen before task #{2} for data locality" .
+                    format(judge_id, chosen[2].id, cand[0][2].id))
+        return (self._take(chosen), None)
+
+    def _take(self, entry):
+        """remove the task of @entry, which has been popped from a set heap,
+        and return it"""
+        entry[3] = False
+        task = entry[2]
+        # dead entries at the top of the heap of its language are removed here,
+        # others when the heap is compacted
+        lheap = self._lang_heap[task.lang_id]
+        while lheap and not lheap[0][3]:
+            heapq.heappop(lheap)
+        if len(lheap) > self._size * 2 + 16:
+            self._compact(lheap)
+        self._size -= 1
+        self._not_full.notify()
+        # let the other idle judges prefetch the data of the remaining tasks
+        self._wake(task.lang_id, True)
+        return task
+
+    def _wake(self, lang_id, rescan = False):
+        """wake the waiters of the judges supporting language @lang_id;
+        if @rescan is True, the waiters are only woken to look for data to
+        prefetch, which each judge does at most once per
+        _PREFETCH_RESCAN_INTERVAL seconds (it rescans at that interval anyway)"""
+        now = time.time()
+        for (waiter, (lang_id_set, judge_id)) in self._waiters.iteritems():
+            if lang_id not in lang_id_set:
+                continue
+            if rescan:
+                if now - self._rescan_time.get(judge_id, 0) < _PREFETCH_RESCAN_INTERVAL:
+                    continue
+                self._rescan_time[judge_id] = now
+            waiter.wake()
+
+    def _get_set_heap(self, lang_id_set):
+        """return the heap for @lang_id_set, which is built from the heaps
+        of languages when the set is seen for the first time"""
+        lang_id_set = frozenset(lang_id_set)
+        try:
+            return self._set_heap[lang_id_set]
+        except KeyError:
+            heap = list()
             for lid in lang_id_set:
                 try:
-                    q = self._queue[lid]
-                    task = q[0]
-                    if min_tid is None or task.id < min_tid:
-                        min_tid = task.id
-                        min_tid_q = q
-                except Exception: # KeyError or IndexError
+                    heap.extend(e for e in self._lang_heap[lid] if e[3])
+                except KeyError:
                     pass
-            if min_tid is not None:
-                ret = min_tid_q.popleft()
-                self._size -= 1
-        return ret
+            heapq.heapify(heap)
+            self._set_heap[lang_id_set] = heap
+            return heap
 
-    def _is_full(self):
-        global _max_queue_size
+    def _compact(self, heap):
+        heap[:] = [e for e in heap if e[3]]
+        heapq.heapify(heap)
+
+    def get_prob_list(self, lang_id_set):
+        """return a list of the problem codes of the tasks in the queue
+        whose language is in @lang_id_set, in the order they would be judged"""
         with self._lock:
-            return self._size >= _max_queue_size
+            entries = [e for e in self._get_set_heap(lang_id_set) if e[3]]
+        entries.sort()
+        ret = list()
+        for e in entries:
+            if e[2].prob not in ret:
+                ret.append(e[2].prob)
+        return ret
 
 _task_queue = _Task_queue()
 
-class _thread_web_communicate(threading.Thread):
+class _Prefetch_list:
+    def __init__(self):
+        """problems whose data should be synchronized to idle judges
+        before any task needs them"""
+        self._recent = deque()
+        # problem codes of recently fetched tasks, the newest at the end
+        self._explicit = list()
+        # problem codes listed in the file given by PrefetchList
+        self._explicit_mtime = None
+        self._signature = dict()
+        # dict of <problem code> => tuple(<scan time>, <signature>)
+        self._lock = threading.Lock()
 
-    class _callable:
-        def __init__(self, func, args, par):
-            self._func = func
-            self._args = args
-            self._par = par
+    def add_recent(self, pcode):
+        global _prefetch_recent_max
+        with self._lock:
+            try:
+                self._recent.remove(pcode)
+            except ValueError:
+                pass
+            self._recent.append(pcode)
+            while len(self._recent) > _prefetch_recent_max:
+                self._recent.popleft()
+
+    def get(self):
+        """return a list of problem codes, the most wanted first"""
+        self._load_explicit()
+        with self._lock:
+            ret = list(self._explicit)
+            for i in reversed(self._recent):
+                if i not in ret:
+                    ret.append(i)
+        return ret
 
-        def call(self):
-            if self._func is not None:
-                try:
-                    self._func(*self._args)
-                except web.Error:
-                    self._par._on_error.set()
-                except Exception as e:
-                    log.error("error while communicating with orzoj-website: {0}" . format(e))
-                    self._par._on_error.set()
-                self._func = None
+    def get_signature(self, pcode):
+        """return a value that changes whenever the data of @pcode changes,
+        or None if there are no data for @pcode"""
+        now = time.time()
+        with self._lock:
+            try:
+                (scan_time, sig) = self._signature[pcode]
+                if now - scan_time < _PREFETCH_RESCAN_INTERVAL:
+                    return sig
+            except KeyError:
+                pass
+        sig = None
+        try:
+            if os.path.isdir(pcode):
+                sig = list()
+                for i in sorted(os.listdir(pcode)):
+                    st = os.stat(os.path.join(pcode, i))
+                    sig.append((i, st.st_size, st.st_mtime))
+                sig = tuple(sig)
+        except Exception as e:
+            log.warning("failed to scan data directory of problem {0!r}: {1}" .
+                    format(pcode, e))
+            sig = None
+        with self._lock:
+            self._signature[pcode] = (now, sig)
+        return sig
 
+    def _load_explicit(self):
+        global _prefetch_list_file
+        if _prefetch_list_file is None:
+            return
+        try:
+            mtime = os.path.getmtime(_prefetch_list_file)
+            if mtime == self._explicit_mtime:
+                return
+            plist = list()
+            with open(_prefetch_list_file, "r") as f:
+                for line in f:
+                    line = line.split('#', 1)[0].strip()
+                    if line and line not in plist:
+                        plist.append(line)
+        except Exception as e:
+            if self._explicit_mtime is not None:
+                log.warning("failed to read prefetch list: {0}" . format(e))
+            mtime = None
+            plist = list()
+        with self._lock:
+            self._explicit = plist
+            self._explicit_mtime = mtime
+        if plist:
+            log.info("prefetch list loaded: {0!r}" . format(plist))
+
+_prefetch_list = _Prefetch_list()
 
+class _Peer_registry:
     def __init__(self):
-        threading.Thread.__init__(self)
-        self._is_stopped = False
-        self._on_error = threading.Event()
-        self._cd = threading.Condition()
-
-        self._queue = deque()
-        self._lazy = None
-
-    def lazy_report(self, func, args):
-        self._cd.acquire()
-        self._lazy = _thread_web_communicate._callable(func, args, self)
-        self._cd.notify()
-        self._cd.release()
-
-    def report(self, func, args):
-        self._cd.acquire()
-        self._queue.append(_thread_web_communicate._callable(func, args, self))
-        self._cd.notify()
-        self._cd.release()
-
-    def clean_lazy(self):
-        self._cd.acquire()
-        self._lazy = None
-        self._cd.notify()
-        self._cd.release()
-
-    def check_error(self):
-        return self._on_error.is_set()
-
-    def stop(self):
-        self._cd.acquire()
-        self._is_stopped = True
-        self._cd.notify()
-        self._cd.release()
+        """judges holding a verified copy of problem data, which can serve
+        the data to other judges"""
+        self._data = dict()
+        # dict of <problem code> => dict(<judge id> => tuple(<judge>, <data signature>))
+        self._use_cnt = dict()
+        # dict of <judge id> => <number of times chosen as a source>
+        self._lock = threading.Lock()
 
-    def run(self):
-        while True:
-            self._cd.acquire()
-            if self._is_stopped and len(self._queue) == 0:
-                return
+    def add(self, pcode, judge, data_sig):
+        """@judge has successfully synchronized the data of @pcode
+        whose signature is @data_sig"""
+        if not judge.peer_port or data_sig is None:
+            return
+        with self._lock:
+            self._data.setdefault(pcode, dict())[judge.id] = (judge, data_sig)
+            self._use_cnt.setdefault(judge.id, 0)
 
-            if len(self._queue):
-                cur_task = self._queue.popleft()
-            elif (self._lazy):
-                cur_task = self._lazy
-                self._lazy = None
-            else:
-                cur_task = None
+    def remove_judge(self, judge):
+        with self._lock:
+            for i in self._data.itervalues():
+                i.pop(judge.id, None)
+            self._use_cnt.pop(judge.id, None)
+
+    def get(self, pcode, data_sig, judge):
+        """return a list of tuple(<address>, <port>) of the judges other than @judge
+        holding the data of @pcode with signature @data_sig, the least used first"""
+        global _peer_sources_max
+        if data_sig is None or not _peer_sources_max:
+            return None
+        with self._lock:
+            try:
+                cand = [j for (j, sig) in self._data[pcode].itervalues()
+                        if sig == data_sig and j.id != judge.id]
+            except KeyError:
+                return None
+            cand.sort(key = lambda j: self._use_cnt[j.id])
+            cand = cand[:_peer_sources_max]
+            for j in cand:
+                self._use_cnt[j.id] += 1
+            return [(j.peer_addr, j.peer_port) for j in cand]
+
+_peer_registry = _Peer_registry()
+
+class _Data_locality:
+    def __init__(self):
+        """problem data held by connected judges, learned from
+        successful synchronizations"""
+        self._data = dict()
+        # dict of <problem code> => dict(<judge id> => tuple(<language id set>, <data signature>))
+        self._lock = threading.Lock()
 
-            if cur_task is None:
-                self._cd.wait()
-                self._cd.release()
-            else:
-                self._cd.release()
-                cur_task.call()
+    def add(self, pcode, judge_id, lang_id_set, data_sig):
+        if data_sig is None:
+            return
+        with self._lock:
+            self._data.setdefault(pcode, dict())[judge_id] = (lang_id_set, data_sig)
 
+    def remove_judge(self, judge_id):
+        with self._lock:
+            for i in self._data.itervalues():
+                i.pop(judge_id, None)
+
+    def is_held(self, pcode, judge_id, data_sig):
+        """whether the judge holds the data of @pcode whose current
+        signature is @data_sig"""
+        if data_sig is None:
+            return False
+        with self._lock:
+            try:
+                return self._data[pcode][judge_id][1] == data_sig
+            except KeyError:
+                return False
+
+    def is_held_by_other(self, pcode, lang_id, judge_id, data_sig, judge_ids):
+        """whether any judge in @judge_ids other than @judge_id supporting the
+        language @lang_id holds the data of @pcode whose current signature
+        is @data_sig"""
+        if data_sig is None:
+            return False
+        with self._lock:
+            try:
+                data = self._data[pcode]
+            except KeyError:
+                return False
+            for jid in judge_ids:
+                if jid != judge_id and jid in data:
+                    (lset, sig) = data[jid]
+                    if lang_id in lset and sig == data_sig:
+                        return True
+        return False
+
+_data_locality = _Data_locality()
 
 def thread_work():
     """wait for tasks and distribute them to judges"""
@@ -174,48 +553,122 @@ def thread_work():
     threading.Thread(target = web.thread_sched_work, name = "web.thread_web_sched_work").start()
 
     while not control.test_termination_flag():
+        start = time.time()
         while not control.test_termination_flag():
             try:
-                task = web.fetch_task()
+                tasks = web.fetch_tasks()
             except web.Error as e:
                 log.error("ending program because of communication error with website")
                 control.set_termination_flag()
                 return
-            if task is None:
+            if not tasks:
                 break
 
-            task.lang_id = _get_lang_id(task.lang)
-            _task_queue.put(task)
-
-            log.info("fetched task #{0} from website" . format(task.id))
+            for task in tasks:
+                task.lang_id = _get_lang_id(task.lang)
+                task.queue_time = time.time()
+                _task_queue.put(task)
+                _prefetch_list.add_recent(task.prob)
 
-        time.sleep(_refresh_interval)
+                log.info("fetched task #{0} from website" . format(task.id))
 
+        if web.is_long_poll():
+            # the website has waited for new tasks; only guard against
+            # one which returns at once
+            time.sleep(max(_refresh_interval - (time.time() - start), 0))
+        else:
+            time.sleep(_refresh_interval)
+
+
+class _Judge_slot:
+    def __init__(self, conn, num):
+        """a slot of a judge, working on one task at a time
+        @conn: the connection (a stream if the judge has several slots)
+        @num: 0 if the judge has only one slot, otherwise starting from 1"""
+        self.conn = conn
+        self.num = num
+        self.cur_task = None
+
+def _forget_judge(judge):
+    """remove @judge from the registries of connected judges"""
+    global _judge_id_set, _judge_id_set_lock, _peer_registry, _data_locality, _task_queue
+    _peer_registry.remove_judge(judge)
+    _data_locality.remove_judge(judge.id)
+    _task_queue.forget_judge(judge.id)
+    if judge.id:
+        with _judge_id_set_lock:
+            _judge_id_set.remove(judge.id)
+
+def _find_prefetch(judge, lang_id_set, synced, syncing):
+    """return tuple(<problem code>, <data signature>) of a problem whose data
+    are likely to be needed by @judge soon but have not been synchronized,
+    or None; @synced and @syncing are as in thread_new_judge_connection"""
+    global _task_queue, _prefetch_list
+    if judge.protocol_version < msg.PROTOCOL_VERSION_PREFETCH:
+        return None
+    for pcode in _task_queue.get_prob_list(lang_id_set) + _prefetch_list.get():
+        data_sig = _prefetch_list.get_signature(pcode)
+        if data_sig is None:
+            continue
+        if synced.get(pcode) == data_sig or pcode in syncing:
+            continue
+        return (pcode, data_sig)
+    return None
+
+def _get_peers(judge, pcode, data_sig):
+    """return the @peers argument of sync_dir.send for @judge"""
+    global _peer_registry
+    if judge.protocol_version < msg.PROTOCOL_VERSION_PEER:
+        return None
+    peers = _peer_registry.get(pcode, data_sig, judge)
+    if peers:
+        log.info("[judge {0!r}] data of problem {1!r} will be fetched from other judges: {2!r}" .
+                format(judge.id, pcode, peers))
+    return peers
+
+def _connect_ok_fields(judge):
+    """return the fields of msg.CONNECT_OK for @judge"""
+    ret = list()
+    if judge.hash_algo:
+        ret.append(judge.hash_algo)
+    if judge.protocol_version >= msg.PROTOCOL_VERSION_COMPRESS:
+        ret.append(judge.compression)
+    if judge.protocol_version >= msg.PROTOCOL_VERSION_HEARTBEAT:
+        ret.append(int(judge.heartbeat_interval * 1000))
+    return ret
 
 class thread_new_judge_connection(threading.Thread):
-    def __init__(self, sock):
+    def __init__(self, sock, addr = None):
         """serve a new connection, which should be orzoj-judge.
         No exceptions are raised, exit silently on error
-        sock will be closed"""
+        sock will be closed
+        @addr is the peer's address returned by snc.socket.accept"""
         threading.Thread.__init__(self, name = "work.thread_new_judge_connection")
         self._sock = sock
+        self._addr = addr
         self._snc = None
-        self._cur_task = None
+        self._mux = None
+        self._slots = list()
+        self._slot_error = None
         self._web_registered = False
         self._judge = structures.judge()
         self._lang_id_set = set()
+        self._synced = dict()
+        # dict of <problem code> => <data signature when last synchronized>
+        self._syncing = set()
+        # problem codes being prefetched by some slot
+        self._synced_lock = threading.Lock()
 
     def _clean(self):
-        global _task_queue, _judge_id_set, _judge_id_set_lock
+        global _task_queue
 
-        if self._cur_task:
-            _task_queue.put(self._cur_task)
-            self._cur_task = None
+        for slot in self._slots:
+            if slot.cur_task:
+                _task_queue.put(slot.cur_task)
+                slot.cur_task = None
 
         judge = self._judge
-        if judge.id:
-            with _judge_id_set_lock:
-                _judge_id_set.remove(judge.id)
+        _forget_judge(judge)
 
         if self._web_registered:
             try:
@@ -227,11 +680,8 @@ class thread_new_judge_connection(threading.Thread):
 
     def run(self):
         judge = self._judge
-        def _write_msg(m):
-            msg.write_msg(self._snc, m)
-
-        def _write_str(s):
-            self._snc.write_str(s)
+        def _write_msg(m, *fields):
+            msg.write_msg(self._snc, m, *fields)
 
         def _read_msg():
             return msg.read_msg(self._snc)
@@ -271,11 +721,16 @@ class thread_new_judge_connection(threading.Thread):
             judge.id = judge_id
             del judge_id
 
-            if _read_uint32() != msg.PROTOCOL_VERSION:
+            judge.protocol_version = _read_uint32()
+            if judge.protocol_version < msg.PROTOCOL_VERSION_MIN or \
+                    judge.protocol_version > msg.PROTOCOL_VERSION:
                 log.warning("[judge {0!r}] version check error" .
                         format(judge.id))
                 _write_msg(msg.ERROR)
                 raise _internal_error
+            if judge.protocol_version < msg.PROTOCOL_VERSION_TLS12:
+                log.warning("[judge {0!r}] is connected by TLSv1, please upgrade it" .
+                        format(judge.id))
 
             cnt = _read_uint32()
             while cnt:
@@ -284,12 +739,55 @@ class thread_new_judge_connection(threading.Thread):
                 judge.lang_supported.add(lang)
                 self._lang_id_set.add(_get_lang_id(lang))
 
-            _write_msg(msg.CONNECT_OK)
+            if judge.protocol_version >= msg.PROTOCOL_VERSION_PEER:
+                judge.peer_addr = _read_str()
+                judge.peer_port = _read_uint32()
+                if judge.peer_port and not judge.peer_addr:
+                    if self._addr:
+                        judge.peer_addr = self._addr.rsplit(':', 1)[0]
+                    else:
+                        judge.peer_port = 0
+
+            if judge.protocol_version >= msg.PROTOCOL_VERSION_HASH:
+                algos = set()
+                cnt = _read_uint32()
+                while cnt:
+                    cnt -= 1
+                    algos.add(_read_str())
+                algos.intersection_update(sync_dir.algorithms())
+                for i in _sync_hash_algos:
+                    if i in algos:
+                        judge.hash_algo = i
+                        break
+                else:
+                    log.warning("[judge {0!r}] no common checksum algorithm" .
+                            format(judge.id))
+                    _write_msg(msg.ERROR)
+                    raise _internal_error
+
+            if judge.protocol_version >= msg.PROTOCOL_VERSION_ARCHIVE:
+                formats = [_read_str() for i in range(_read_uint32())]
+                judge.archive_format = sync_dir.choose_archive_format(formats)
+
+            if judge.protocol_version >= msg.PROTOCOL_VERSION_SLOT:
+                judge.nslot = max(min(_read_uint32(), _judge_slots_max), 1)
+
+            if judge.protocol_version >= msg.PROTOCOL_VERSION_COMPRESS:
+                methods = [_read_str() for i in range(_read_uint32())]
+                judge.compression = zstream.choose(methods)
+
+            if judge.protocol_version >= msg.PROTOCOL_VERSION_HEARTBEAT:
+                judge.heartbeat_interval = max(min(_read_uint32() / 1000.0,
+                    snc.heartbeat_interval()), msg.TELL_ONLINE_INTERVAL)
+
+            _write_msg(msg.CONNECT_OK, *_connect_ok_fields(judge))
+            if judge.compression:
+                self._snc = zstream.Conn(self._snc, judge.compression)
+            self._snc.heartbeat_interval = judge.heartbeat_interval
 
             query_ans = dict()
             for i in web.get_query_list():
-                _write_msg(msg.QUERY_INFO)
-                _write_str(i)
+                _write_msg(msg.QUERY_INFO, i)
                 _check_msg(msg.ANS_QUERY)
                 query_ans[i] = _read_str()
 
@@ -298,8 +796,12 @@ class thread_new_judge_connection(threading.Thread):
 
             log.info("[judge {0!r}] successfully connected" . format(judge.id))
 
-            while not control.test_termination_flag():
-                self._solve_task()
+            if judge.nslot > 1:
+                _write_msg(msg.MUX_BEGIN, judge.nslot)
+                self._serve_mux()
+            else:
+                self._slots.append(_Judge_slot(self._snc, 0))
+                self._serve_slot(self._slots[0])
 
             self._snc.close()
             self._sock.close()
@@ -311,7 +813,8 @@ class thread_new_judge_connection(threading.Thread):
             self._clean()
         except web.Error:
             log.warning("[judge {0!r}] failed because of error while communicating with website" . format(judge.id))
-            _write_msg(msg.ERROR)
+            if self._mux is None:
+                _write_msg(msg.ERROR)
             self._clean()
         except sync_dir.Error:
             log.warning("[judge {0!r}] failed to synchronize data directory" .
@@ -328,25 +831,59 @@ class thread_new_judge_connection(threading.Thread):
             self._snc.close()
         self._sock.close()
 
-    def _solve_task(self):
-        judge = self._judge
-        def _write_msg(m):
-            msg.write_msg(self._snc, m)
+    def _serve_slot(self, slot):
+        while not control.test_termination_flag() and self._slot_error is None:
+            self._solve_task(slot)
 
-        def _write_str(s):
-            self._snc.write_str(s)
+    def _serve_mux(self):
+        """serve all the slots of the judge in multiplexed mode,
+        re-raise the first exception raised by a slot"""
+        self._mux = mux.Mux(self._snc, self._judge.nslot)
+        for i in range(self._judge.nslot):
+            self._slots.append(_Judge_slot(self._mux.stream(i + 1), i + 1))
+        log.info("[judge {0!r}] working with {1} slots" . format(self._judge.id, len(self._slots)))
 
-        def _write_uint32(v):
-            self._snc.write_uint32(v)
+        def _run(slot):
+            try:
+                self._serve_slot(slot)
+            except Exception as e:
+                if self._slot_error is None:
+                    self._slot_error = e
+                    if isinstance(e, web.Error):
+                        try:
+                            msg.write_msg(slot.conn, msg.ERROR)
+                        except snc.Error:
+                            pass
+                # stop the other slots
+                self._mux.close()
+
+        threads = list()
+        for slot in self._slots:
+            th = threading.Thread(target = _run, args = (slot, ),
+                    name = "work.thread_new_judge_connection._serve_mux._run")
+            th.start()
+            threads.append(th)
+        for th in threads:
+            while th.is_alive():
+                th.join(1)
+        self._mux.close()
+        if self._slot_error is not None:
+            raise self._slot_error
+
+    def _solve_task(self, slot):
+        judge = self._judge
+        conn = slot.conn
+        def _write_msg(m, *fields):
+            msg.write_msg(conn, m, *fields)
 
         def _read_msg():
-            return msg.read_msg(self._snc)
+            return msg.read_msg(conn)
 
         def _read_str():
-            return self._snc.read_str()
+            return conn.read_str()
 
         def _read_uint32():
-            return self._snc.read_uint32()
+            return conn.read_uint32()
 
         def _check_msg(m):
             if m != _read_msg():
@@ -356,30 +893,31 @@ class thread_new_judge_connection(threading.Thread):
             
         def _stop_web_report(tell_online = True):
             th_report.stop()
+            sent = _Alarm()
+            th_report.notify_sent(sent.set)
             if tell_online:
-                while th_report.is_alive():
-                    th_report.join(msg.TELL_ONLINE_INTERVAL)
-                    _write_msg(msg.TELL_ONLINE)
+                _wait_tell_online(conn, sent)
             else:
-                th_report.join()
+                sent.wait()
 
-        global _task_queue
-        task = _task_queue.get(self._lang_id_set)
+        global _task_queue, _prefetch_list, _peer_registry, _data_locality
+        task = _task_queue.get(self._lang_id_set, judge.id)
         if task is None:
-            _write_msg(msg.TELL_ONLINE)
-            time.sleep(msg.TELL_ONLINE_INTERVAL)
-            return
+            if self._prefetch(slot):
+                return
+            task = self._wait_task(slot)
+            if task is None:
+                return
         
         log.info("[judge {0!r}] received task #{1} for problem {2!r}" .
-                format(judge.id, task.id, task.prob))
+                format(self._slot_name(slot), task.id, task.prob))
 
-        self._cur_task = task
+        slot.cur_task = task
 
-        th_report = _thread_web_communicate()
-        th_report.start()
+        th_report = web.Report_channel()
 
         if not os.path.isdir(task.prob):
-            self._cur_task = None
+            slot.cur_task = None
             log.error("No data for problem {0!r}, task #{1} discarded" .
                     format(task.prob, task.id))
             th_report.report(web.report_no_data, [task])
@@ -387,10 +925,11 @@ class thread_new_judge_connection(threading.Thread):
             return
 
         th_report.report(web.report_sync_data, [task, judge])
-        _write_msg(msg.PREPARE_DATA)
-        _write_str(task.prob)
+        _write_msg(msg.PREPARE_DATA, task.prob)
         
-        speed = sync_dir.send(task.prob, self._snc)
+        data_sig = _prefetch_list.get_signature(task.prob)
+        speed = sync_dir.send(task.prob, conn, _get_peers(judge, task.prob, data_sig),
+                judge.hash_algo, judge.archive_format)
         if speed:
             log.info("[judge {0!r}] file transfer speed: {1!r} kb/s" . 
                     format(judge.id, speed))
@@ -398,7 +937,7 @@ class thread_new_judge_connection(threading.Thread):
         m = _read_msg()
 
         if m == msg.DATA_ERROR:
-            self._cur_task = None
+            slot.cur_task = None
             reason = _read_str()
             log.error("[judge {0!r}] [task #{1}] [prob: {2!r}] data error:\n{3}" . 
                     format(judge.id, task.id, task.prob, reason))
@@ -412,12 +951,12 @@ class thread_new_judge_connection(threading.Thread):
             raise _internal_error
 
         ncase = _read_uint32()
+        with self._synced_lock:
+            self._synced[task.prob] = data_sig
+        _peer_registry.add(task.prob, judge, data_sig)
+        _data_locality.add(task.prob, judge.id, self._lang_id_set, data_sig)
 
-        _write_msg(msg.START_JUDGE)
-        _write_str(task.lang)
-        _write_str(task.src)
-        _write_str(task.input)
-        _write_str(task.output)
+        _write_msg(msg.START_JUDGE, task.lang, task.src, task.input, task.output)
 
         while True:
             m = _read_msg()
@@ -447,7 +986,7 @@ class thread_new_judge_connection(threading.Thread):
                             format(judge.id))
                     _stop_web_report(False)
                     raise _internal_error
-                self._cur_task = None
+                slot.cur_task = None
                 th_report.report(web.report_compile_failure, [task, _read_str()])
                 _stop_web_report()
                 return
@@ -455,7 +994,8 @@ class thread_new_judge_connection(threading.Thread):
         prob_res = list()
 
         for i in range(ncase):
-            th_report.lazy_report(web.report_judge_progress, [task, i])
+            if not web.report_cases():
+                th_report.lazy_report(web.report_judge_progress, [task, i])
             while True:
                 m = _read_msg()
                 if m == msg.REPORT_CASE:
@@ -467,15 +1007,17 @@ class thread_new_judge_connection(threading.Thread):
                     _stop_web_report(False)
                     raise _internal_error
             result = structures.case_result()
-            result.read(self._snc)
+            result.read(conn)
             prob_res.append(result)
+            if web.report_cases():
+                th_report.report_case(web.report_case_result, [task, i, result])
 
         th_report.clean_lazy()
         th_report.report(web.report_prob_result, [task, prob_res])
 
         _check_msg(msg.REPORT_JUDGE_FINISH)
 
-        self._cur_task = None
+        slot.cur_task = None
         _stop_web_report()
 
         if th_report.check_error():
@@ -483,9 +1025,71 @@ class thread_new_judge_connection(threading.Thread):
                     format(judge.id, task.id))
         else:
             log.info("[judge {0!r}] finished task #{1} normally" .
-                    format(judge.id, task.id))
+                    format(self._slot_name(slot), task.id))
 
+    def _wait_task(self, slot):
+        """wait for a task while sending TELL_ONLINE; return None when the
+        queue changes without a task usable, when it is time to look for data
+        to prefetch again, or on termination"""
+        global _task_queue
+        judge = self._judge
+        waiter = _Task_waiter()
+        try:
+            (task, expire) = _task_queue.get_or_watch(self._lang_id_set, waiter, judge.id)
+            if task is not None:
+                return task
+            timeout = _PREFETCH_RESCAN_INTERVAL
+            if expire is not None:
+                timeout = max(min(timeout, expire - time.time()), 0)
+            _wait_tell_online(slot.conn, waiter, timeout)
+        finally:
+            _task_queue.unwatch(waiter)
+        if control.test_termination_flag():
+            return None
+        return _task_queue.get(self._lang_id_set, judge.id)
+
+    def _slot_name(self, slot):
+        """the judge id with slot number, for logging"""
+        if slot.num:
+            return "{0}#{1}" . format(self._judge.id, slot.num)
+        return self._judge.id
+
+    def _prefetch(self, slot):
+        """synchronize the data of a problem which is likely to be judged soon
+        but has not been synchronized to this judge yet,
+        return whether any data are synchronized"""
+        global _peer_registry, _data_locality
+        judge = self._judge
+        with self._synced_lock:
+            found = _find_prefetch(judge, self._lang_id_set, self._synced, self._syncing)
+            if found is None:
+                return False
+            (pcode, data_sig) = found
+            self._syncing.add(pcode)
 
+        try:
+            log.info("[judge {0!r}] prefetching data for problem {1!r}" .
+                    format(self._slot_name(slot), pcode))
+            msg.write_msg(slot.conn, msg.PREFETCH_DATA, pcode)
+            speed = sync_dir.send(pcode, slot.conn, _get_peers(judge, pcode, data_sig),
+                    judge.hash_algo, judge.archive_format)
+            if speed:
+                log.info("[judge {0!r}] file transfer speed: {1!r} kb/s" . 
+                        format(self._slot_name(slot), speed))
+            with self._synced_lock:
+                self._synced[pcode] = data_sig
+        finally:
+            with self._synced_lock:
+                self._syncing.discard(pcode)
+        _peer_registry.add(pcode, judge, data_sig)
+        _data_locality.add(pcode, judge.id, self._lang_id_set, data_sig)
+        return True
+
+
+def stop():
+    """wake the threads blocked on the task queue, called at termination"""
+    global _task_queue
+    _task_queue.close()
 
 def _set_refresh_interval(arg):
     global _refresh_interval
@@ -499,6 +1103,11 @@ def _set_id_max_len(arg):
     if _id_max_len < 1:
         raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
 
+def _set_accept_tlsv1(arg):
+    if arg[1] not in ("0", "1"):
+        raise conf.UserError("Option {0} takes 0 or 1" . format(arg[0]))
+    snc.set_accept_tlsv1(arg[1] == "1")
+
 def _set_data_dir(arg):
     os.chdir(arg[1])
 
@@ -506,8 +1115,74 @@ def _set_max_queue_size(arg):
     global _max_queue_size
     _max_queue_size = int(arg[1])
 
+def _set_prefetch_list(arg):
+    global _prefetch_list_file
+    _prefetch_list_file = os.path.abspath(arg[1])
+
+def _set_peer_sources_max(arg):
+    global _peer_sources_max
+    _peer_sources_max = int(arg[1])
+    if _peer_sources_max < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _set_prefetch_recent(arg):
+    global _prefetch_recent_max
+    _prefetch_recent_max = int(arg[1])
+    if _prefetch_recent_max < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _set_judge_slots_max(arg):
+    global _judge_slots_max
+    _judge_slots_max = int(arg[1])
+    if _judge_slots_max < 1:
+        raise conf.UserError("Option {0} can not be less than 1" . format(arg[0]))
+
+def _set_task_order(arg):
+    global _task_key
+    try:
+        _task_key = _TASK_ORDER[arg[1]]
+    except KeyError:
+        raise conf.UserError("unknown value for option {0}: {1!r}" . format(arg[0], arg[1]))
+
+def _set_locality_window(arg):
+    global _locality_window
+    _locality_window = int(arg[1])
+    if _locality_window < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _set_locality_max_delay(arg):
+    global _locality_max_delay
+    _locality_max_delay = float(arg[1])
+    if _locality_max_delay < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _ch_sync_hash_algos(arg):
+    if len(arg) == 1:
+        return
+    if arg[1] is None:
+        raise conf.UserError("Option {0} takes at least one argument" . format(arg[0]))
+    global _sync_hash_algos
+    _sync_hash_algos = list()
+    for i in arg[1:]:
+        if i in sync_dir.algorithms():
+            _sync_hash_algos.append(i)
+        else:
+            log.warning("checksum algorithm {0!r} is not supported by this orzoj-server, ignored" .
+                    format(i))
+    if not _sync_hash_algos:
+        raise conf.UserError("none of the checksum algorithms for Option {0} is supported" .
+                format(arg[0]))
+
 conf.simple_conf_handler("RefreshInterval", _set_refresh_interval, default = "2")
 conf.simple_conf_handler("JudgeIdMaxLen", _set_id_max_len, default = "20")
 conf.simple_conf_handler("DataDir", _set_data_dir)
 conf.simple_conf_handler("MaxQueueSize", _set_max_queue_size, default = "1024")
-
+conf.simple_conf_handler("TaskOrder", _set_task_order, default = "id")
+conf.simple_conf_handler("JudgeSlotsMax", _set_judge_slots_max, default = "64")
+conf.simple_conf_handler("LocalityWindow", _set_locality_window, default = "8")
+conf.simple_conf_handler("LocalityMaxDelay", _set_locality_max_delay, default = "10")
+conf.simple_conf_handler("PrefetchList", _set_prefetch_list, required = False)
+conf.simple_conf_handler("PrefetchRecent", _set_prefetch_recent, default = "16")
+conf.simple_conf_handler("PeerSourcesMax", _set_peer_sources_max, default = "4")
+conf.register_handler("SyncHashAlgorithms", _ch_sync_hash_algos, no_dup = True)
+conf.simple_conf_handler("AcceptTLSv1", _set_accept_tlsv1, default = "1")
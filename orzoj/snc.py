@@ -24,7 +24,7 @@
 
 from orzoj import _snc, log, conf
 
-import struct
+import struct, os
 
 _timeout    = None
 _cert_file  = None
@@ -39,14 +39,45 @@ class Error(Exception):
 class ErrorTimeout(Exception):
     pass
 
+class ErrorWantRead(Exception):
+    """raised by a connection in non-blocking mode if the operation
+    should be retried when the socket becomes readable"""
+    pass
+
+class ErrorWantWrite(Exception):
+    """raised by a connection in non-blocking mode if the operation
+    should be retried when the socket becomes writable"""
+    pass
+
 _use_ipv6 = 0
 
+_heartbeat_interval = None
+
+_keepalive = 0
+# idle seconds before TCP keepalive probes are sent, 0 if disabled
+_KEEPALIVE_PROBES = 4
+
+_UINT32 = struct.Struct("!I")
+
+def pack_uint32(val):
+    """return the bytes of an unsigned 32-bit integer as written by write_uint32"""
+    return _UINT32.pack(val)
+
+def pack_str(data):
+    """return the bytes of a string as written by write_str"""
+    if type(data) is unicode:
+        data = str(data.encode('UTF-8'))
+    return _UINT32.pack(len(data)) + data
+
 def socket(host, port, timeout = 0):
     """set @host to None if in server mode (accept() usable)
 
     @timeout is only usable in client mode (connection timeout)"""
     try:
-        return _socket_real(_snc.socket(host, port, _use_ipv6, timeout), host is None)
+        ret = _socket_real(_snc.socket(host, port, _use_ipv6, timeout), host is None)
+        if host is not None:
+            ret._set_keepalive()
+        return ret
     except _snc.error_timeout:
         raise ErrorTimeout
     except Exception as e:
@@ -72,30 +103,51 @@ class _socket_real:
             return
         try:
             ret = self._socket.accept(timeout)
-            return (_socket_real(ret[0], False), ret[1])
+            sock = _socket_real(ret[0], False)
+            sock._set_keepalive()
+            return (sock, ret[1])
         except _snc.error_timeout:
             raise ErrorTimeout
         except Exception as e:
             log.error("socket error: {0!r}" . format(e))
             raise Error
 
+    def fileno(self):
+        return self._socket.fileno()
+
     def close(self):
         if self._socket:
             self._socket.close()
             self._socket = None
 
+    def _set_keepalive(self):
+        if _keepalive:
+            self._socket.set_keepalive(_keepalive,
+                    max(_keepalive // _KEEPALIVE_PROBES, 1), _KEEPALIVE_PROBES)
+
 
 class snc:
-    def __init__(self, sock, is_server = 0):
+    heartbeat_interval = 0.5
+    # the maximal interval in seconds between msg.TELL_ONLINE's sent while
+    # waiting for something, negotiated in msg.HELLO (see msg.tell_online)
+    last_msg_time = 0
+    # when the last message was written by msg.write_msg
+
+    def __init__(self, sock, is_server = 0, nonblock = False):
+        """if @nonblock is True, the socket is set to non-blocking mode
+        and the handshake is done by calling do_handshake(); see the
+        methods for non-blocking mode below"""
         self._snc = None
         try:
             if is_server:
                 is_server = 1
             self._snc = _snc.snc(sock._socket, is_server, _timeout,
-                    _cert_file, _key_file, _ca_file)
+                    _cert_file, _key_file, _ca_file, int(nonblock))
         except Exception as e:
             log.error("failed to establish SSL connection:\n{0!r}" . format(e))
             raise Error
+        if not nonblock and self._snc.session_reused():
+            log.debug("SSL session resumed")
 
     def __del__(self):
         self.close()
@@ -116,8 +168,45 @@ class snc:
                     format(len, e))
             raise Error
 
+    def readinto(self, buf, timeout = 0):
+        """fill the writable buffer @buf (e.g. a bytearray or memoryview)
+        with exactly len(@buf) bytes, without allocating a new string;
+        @timeout is the same as read()"""
+        if timeout < 0:
+            timeout = 0
+        else:
+            timeout += _timeout
+
+        try:
+            return self._snc.readinto(buf, timeout)
+        except Exception as e:
+            log.error("failed to read [len={0}]:\n{1!r}" .
+                    format(len(buf), e))
+            raise Error
+
+    def recv_to_file(self, fd, size, digest = None, timeout = 0):
+        """read exactly @size bytes and write them to file descriptor @fd;
+        if @digest is the name of a hash algorithm (e.g. "sha1"), return
+        the digest of the data; @timeout is the same as read()
+        
+        EnvironmentError is raised if failed to write the file"""
+        if timeout < 0:
+            timeout = 0
+        else:
+            timeout += _timeout
+
+        try:
+            return self._snc.recv_to_file(fd, size, digest, timeout)
+        except EnvironmentError:
+            # failed to write the file
+            raise
+        except Exception as e:
+            log.error("failed to receive file [size={0}]:\n{1!r}" .
+                    format(size, e))
+            raise Error
+
     def write(self, data, timeout = 0):
-        """write all of @data"""
+        """write all of @data, together with buffered data"""
         if timeout < 0:
             timeout = 0
         else:
@@ -129,6 +218,120 @@ class snc:
             log.error("failed to write:\n{0!r}" . format(e))
             raise Error
 
+    def write_buffered(self, data, timeout = 0):
+        """buffer @data to be written later by write(), write_frame(), flush()
+        or read(), or when the buffer is large enough"""
+        if timeout < 0:
+            timeout = 0
+        else:
+            timeout += _timeout
+
+        try:
+            return self._snc.write_buffered(data, timeout)
+        except Exception as e:
+            log.error("failed to write:\n{0!r}" . format(e))
+            raise Error
+
+    def write_frame(self, parts, timeout = 0):
+        """write buffered data and all strings in the list @parts,
+        in as few TLS records as possible"""
+        if timeout < 0:
+            timeout = 0
+        else:
+            timeout += _timeout
+
+        try:
+            return self._snc.write_frame(parts, timeout)
+        except Exception as e:
+            log.error("failed to write:\n{0!r}" . format(e))
+            raise Error
+
+    def flush(self, timeout = 0):
+        """write buffered data"""
+        if timeout < 0:
+            timeout = 0
+        else:
+            timeout += _timeout
+
+        try:
+            return self._snc.flush(timeout)
+        except Exception as e:
+            log.error("failed to write:\n{0!r}" . format(e))
+            raise Error
+
+    def session_reused(self):
+        """whether the SSL session of a previous connection was resumed"""
+        return self._snc.session_reused()
+
+    def wait_readable(self, timeout):
+        """wait at most @timeout seconds until the connection is readable,
+        return whether it is; can be called while another thread is writing"""
+        try:
+            return self._snc.wait_readable(timeout)
+        except Exception as e:
+            log.error("failed to wait for reading:\n{0!r}" . format(e))
+            raise Error
+
+    def has_data(self):
+        """return whether read() would not block, without blocking;
+        must not be called while another thread is using the connection"""
+        try:
+            return self._snc.has_data()
+        except Exception as e:
+            log.error("failed to check for data:\n{0!r}" . format(e))
+            raise Error
+
+    # methods for non-blocking mode, which can be used with select, epoll,
+    # etc. on fileno(); they raise ErrorWantRead or ErrorWantWrite if the
+    # operation should be retried when the socket becomes readable or writable
+
+    def fileno(self):
+        return self._snc.fileno()
+
+    def do_handshake(self):
+        """continue the handshake, which is done if it returns normally"""
+        try:
+            self._snc.do_handshake()
+        except _snc.error_want_read:
+            raise ErrorWantRead
+        except _snc.error_want_write:
+            raise ErrorWantWrite
+        except Exception as e:
+            log.error("failed to establish SSL connection:\n{0!r}" . format(e))
+            raise Error
+        if self._snc.session_reused():
+            log.debug("SSL session resumed")
+
+    def recv(self, maxlen):
+        """read at most @maxlen bytes, return an empty string if
+        the connection is closed by the peer"""
+        try:
+            return self._snc.recv(maxlen)
+        except _snc.error_want_read:
+            raise ErrorWantRead
+        except _snc.error_want_write:
+            raise ErrorWantWrite
+        except Exception as e:
+            log.error("failed to read:\n{0!r}" . format(e))
+            raise Error
+
+    def send(self, data):
+        """write part of @data and return the number of bytes written"""
+        try:
+            return self._snc.send(data)
+        except _snc.error_want_read:
+            raise ErrorWantRead
+        except _snc.error_want_write:
+            raise ErrorWantWrite
+        except Exception as e:
+            log.error("failed to write:\n{0!r}" . format(e))
+            raise Error
+
+    def pending(self):
+        """return the number of bytes that can be read by recv() without
+        waiting for the socket to become readable"""
+        return self._snc.pending()
+
     def read_int32(self, timeout = 0):
         """read a signed 32-bit integer and return it"""
         return struct.unpack("!i", self.read(4, timeout))[0]
@@ -139,11 +342,20 @@ class snc:
 
     def read_uint32(self, timeout = 0):
         """read an unsigned 32-bit integer and return it"""
-        return struct.unpack("!I", self.read(4, timeout))[0]
+        if timeout < 0:
+            timeout = 0
+        else:
+            timeout += _timeout
+
+        try:
+            return self._snc.read_uint32(timeout)
+        except Exception as e:
+            log.error("failed to read [len=4]:\n{0!r}" . format(e))
+            raise Error
 
     def write_uint32(self, val, timeout = 0):
         """write an unsigned 32-bit integer"""
-        self.write(struct.pack("!I", val), timeout)
+        self.write(pack_uint32(val), timeout)
 
     def read_str(self, timeout = 0):
         """read a string and return it"""
@@ -152,10 +364,7 @@ class snc:
 
     def write_str(self, data, timeout = 0):
         """write a string"""
-        if type(data) is unicode:
-            data = str(data.encode('UTF-8'))
-        self.write_uint32(len(data), timeout)
-        self.write(data, timeout)
+        self.write(pack_str(data), timeout)
 
     def close(self):
         if self._snc:
@@ -163,6 +372,23 @@ class snc:
             self._snc = None
 
 
+def network_timeout():
+    """return the network timeout in seconds (NetworkTimeout), which is
+    added to the timeout of every read"""
+    return _timeout
+
+def heartbeat_interval():
+    """return the maximal heartbeat interval in seconds this side accepts,
+    which is short enough for the peer not to time out"""
+    return min(_heartbeat_interval, _timeout / 3.0)
+
+
+def set_accept_tlsv1(flag):
+    """set whether orzoj-server accepts TLSv1 and TLSv1.1 (see
+    msg.PROTOCOL_VERSION_TLS12); should be called before any connection"""
+    _snc.set_accept_tlsv1(int(bool(flag)))
+
+
 def _ch_set_ipv6(arg):
     if len(arg) > 2 or (len(arg) == 2 and arg[1]):
         raise conf.UserError("Option UseIPv6 takes no argument")
@@ -170,6 +396,12 @@ def _ch_set_ipv6(arg):
         global _use_ipv6
         _use_ipv6 = 1
 
+def _set_keepalive(arg):
+    global _keepalive
+    _keepalive = int(arg[1])
+    if _keepalive < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
 def _set_timeout(arg):
     global _timeout
     _timeout = float(arg[1])
@@ -177,6 +409,15 @@ def _set_timeout(arg):
         raise conf.UserError("Option {0} can not be less than 1 second." .
                 format(arg[0]))
 
+def _set_heartbeat_interval(arg):
+    # msg imports this module
+    from orzoj import msg
+    global _heartbeat_interval
+    _heartbeat_interval = float(arg[1])
+    if _heartbeat_interval < msg.TELL_ONLINE_INTERVAL:
+        raise conf.UserError("Option {0} can not be less than {1} seconds" .
+                format(arg[0], msg.TELL_ONLINE_INTERVAL))
+
 def _set_cert_file(arg):
     global _cert_file
     _cert_file = arg[1]
@@ -189,11 +430,37 @@ def _set_ca_file(arg):
     global _ca_file
     _ca_file = arg[1]
 
+def _set_ticket_key_file(arg):
+    try:
+        try:
+            fd = os.open(arg[1], os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0600)
+        except OSError:
+            with open(arg[1], "rb") as f:
+                keys = f.read(_snc.TICKET_KEYS_LEN + 1)
+        else:
+            keys = os.urandom(_snc.TICKET_KEYS_LEN)
+            with os.fdopen(fd, "wb") as f:
+                f.write(keys)
+    except (OSError, IOError) as e:
+        raise conf.UserError("failed to open session ticket key file {0!r}: {1}" .
+                format(arg[1], e.strerror))
+    if len(keys) != _snc.TICKET_KEYS_LEN:
+        raise conf.UserError("session ticket key file {0!r} should be {1} bytes" .
+                format(arg[1], _snc.TICKET_KEYS_LEN))
+    _snc.set_ticket_keys(keys)
+
+def _set_session_file(arg):
+    _snc.set_session_file(arg[1])
+
 conf.register_handler("UseIPv6", _ch_set_ipv6)
 conf.simple_conf_handler("NetworkTimeout", _set_timeout, default = "30")
+conf.simple_conf_handler("HeartbeatInterval", _set_heartbeat_interval, default = "5")
+conf.simple_conf_handler("TCPKeepAlive", _set_keepalive, default = "0")
 conf.simple_conf_handler("CertificateFile", _set_cert_file)
 conf.simple_conf_handler("PrivateKeyFile", _set_key_file)
 conf.simple_conf_handler("CAFile", _set_ca_file)
+conf.simple_conf_handler("TLSTicketKeyFile", _set_ticket_key_file, required = False)
+conf.simple_conf_handler("TLSSessionFile", _set_session_file, required = False)
 
 
 def _init():
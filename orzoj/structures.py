@@ -29,6 +29,16 @@ class judge:
         self.id = None  # should be assigned a string 
         self.lang_supported = set([])
         self.id_num = None # will be assigned in web.register_new_judge
+        self.protocol_version = None # the version declared in HELLO
+        self.peer_addr = None # address and port to fetch data cache from,
+        self.peer_port = 0    # peer_port is 0 if not serving other judges
+        self.hash_algo = None # checksum algorithm negotiated in HELLO,
+                              # None if older than PROTOCOL_VERSION_HASH
+        self.archive_format = None # archive format for compressible data files,
+                                   # None if older than PROTOCOL_VERSION_ARCHIVE
+        self.nslot = 1 # number of tasks judged at the same time
+        self.compression = "" # method to compress messages, empty for none
+        self.heartbeat_interval = 0.5 # negotiated in HELLO, in seconds
 
 class task:
     def __init__(self):
@@ -39,7 +49,13 @@ class task:
         self.src = None
         self.input = None
         self.output = None
-        # all attributes except self.id should be string
+        # all attributes above except self.id should be string
+        self.priority = 0  # int, tasks with higher priority are judged first
+                           # if TaskOrder is priority
+        self.deadline = None # float (unix timestamp) or None, used if TaskOrder is deadline
+        # priority and deadline are optional for the website
+        self.queue_time = None # float (unix timestamp), set by orzoj-server
+                               # when the task is queued
 
 (
 EXESTS_NORMAL,
@@ -49,8 +65,9 @@ EXESTS_SIGSEGV,
 EXESTS_SIGNAL,
 EXESTS_ILLEGAL_CALL,  # illegal syscall
 EXESTS_EXIT_NONZERO,
-EXESTS_SYSTEM_ERROR
-) = range(8)
+EXESTS_SYSTEM_ERROR,
+EXESTS_SKIPPED # not executed because of an earlier failure (see skip in probconf)
+) = range(9)
 
 EXECUTION_STATUS_STR = {
     EXESTS_NORMAL : "normal",
@@ -60,7 +77,8 @@ EXECUTION_STATUS_STR = {
     EXESTS_SIGNAL : "terminated by signal",
     EXESTS_ILLEGAL_CALL : "illegal system call",
     EXESTS_EXIT_NONZERO : "non-zero exit code",
-    EXESTS_SYSTEM_ERROR : "system error"
+    EXESTS_SYSTEM_ERROR : "system error",
+    EXESTS_SKIPPED : "skipped"
 }
 
 class case_result:
@@ -71,6 +89,11 @@ class case_result:
         self.time = None        # microseconds
         self.memory = None      # kb
         self.extra_info = None  # human-readable string
+    def fields(self):
+        """return the list of values written by write(), which can be
+        passed to msg.write_msg"""
+        return [self.exe_status, self.score, self.full_score,
+                self.time, self.memory, self.extra_info]
     def write(self, conn, timeout = 0):
         conn.write_uint32(self.exe_status, timeout)
         conn.write_uint32(self.score, timeout)
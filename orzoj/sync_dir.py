@@ -25,99 +25,354 @@
 class Error(Exception):
     pass
 
-import os, os.path, hashlib, threading, tempfile, tarfile, traceback
-from orzoj import filetrans, log, snc, msg
+import os, os.path, hashlib, threading, tempfile, tarfile, traceback, zlib
+from collections import OrderedDict
+from orzoj import filetrans, log, snc, msg, conf, evloop
+
+try:
+    from orzoj import _filehash
+except ImportError:
+    _filehash = None
+
+try:
+    from orzoj import _zstd
+except ImportError:
+    _zstd = None
 
 # during directory synchronizing, msg.TELL_ONLINE may be sent
 # when busy computing something
 
+# the algorithm used by orzoj-server and orzoj-judge before
+# msg.PROTOCOL_VERSION_HASH, and the one used to verify files
+# fetched from other judges since then
+HASH_LEGACY = "sha1"
+HASH_PEER = "sha256"
+
+_checksum_cache = OrderedDict()
+# dict of tuple(<absolute file path>, <algorithm>) => tuple(<file identity>, <checksum>),
+# where file identity is (st_ino, st_size, st_mtime), so that
+# synchronizing an unchanged directory again does not read every file;
+# the least recently used first
+_checksum_cache_lock = threading.Lock()
+
+_CHECKSUM_CACHE_MAX = 65536
+# the maximal number of entries in _checksum_cache
+
+_hash_threads = 0
+
+# archive formats:
+#   gz -- tar compressed by gzip, the only format used before
+#         msg.PROTOCOL_VERSION_ARCHIVE
+#   zstd -- tar compressed by zstd
+#   tar -- tar without compression, used for files that hardly compress
+ARCHIVE_LEGACY = "gz"
+ARCHIVE_STORE = "tar"
+
+_compression = "zstd"
+_compression_level = 0 # 0 means the default level of the format
+_compression_threads = 0
+
+_SAMPLE_SIZE = 1024 * 64
+_SAMPLE_MIN_FILE_SIZE = 1024 * 4
+_INCOMPRESSIBLE_RATIO = 0.9
+# files are sampled at the beginning and the middle, and are stored
+# without compression if the samples can not be compressed to less than
+# _INCOMPRESSIBLE_RATIO of their sizes; files smaller than
+# _SAMPLE_MIN_FILE_SIZE are always compressed
+
+_INCOMPRESSIBLE_SUFFIX = (".zst", ".gz", ".bz2", ".xz", ".zip", ".7z", ".png", ".jpg")
+
+_PEER_CONNECT_TIMEOUT = 5
+
+def algorithms():
+    """return a tuple of names of supported checksum algorithms"""
+    if _filehash:
+        return _filehash.algorithms()
+    return ("sha256", "sha1")
+
+def archive_formats():
+    """return a tuple of names of archive formats supported"""
+    if _zstd:
+        return ("zstd", ARCHIVE_LEGACY, ARCHIVE_STORE)
+    return (ARCHIVE_LEGACY, ARCHIVE_STORE)
+
+def choose_archive_format(formats):
+    """return the archive format to use for compressible files with
+    a client supporting archive formats @formats"""
+    global _compression
+    if _compression in formats and _compression in archive_formats():
+        return _compression
+    return ARCHIVE_LEGACY
+
+def _is_compressible(path):
+    """estimate whether the file at @path is worth compressing"""
+    if path.lower().endswith(_INCOMPRESSIBLE_SUFFIX):
+        return False
+    size = os.path.getsize(path)
+    if size < _SAMPLE_MIN_FILE_SIZE:
+        return True
+    with open(path, 'rb') as f:
+        sample = f.read(_SAMPLE_SIZE)
+        if size > _SAMPLE_SIZE * 2:
+            f.seek(size / 2)
+            sample += f.read(_SAMPLE_SIZE)
+    if _zstd:
+        csize = len(_zstd.compress(sample, 1))
+    else:
+        csize = len(zlib.compress(sample, 1))
+    return csize < len(sample) * _INCOMPRESSIBLE_RATIO
+
+def _hash_files(paths, algo):
+    """return the list of @algo digests of the files in @paths"""
+    global _hash_threads
+    if _filehash:
+        try:
+            return _filehash.hash_files(algo, paths, _hash_threads)
+        except _filehash.error as e:
+            raise Error(str(e))
+    ret = list()
+    for path in paths:
+        with open(path, 'rb') as f:
+            ctx = hashlib.new(algo)
+            while True:
+                buf = f.read(1024 * 64)
+                if not buf:
+                    break
+                ctx.update(buf)
+            ret.append(ctx.digest())
+    return ret
+
+def _hash_files_cached(paths, algo):
+    """like _hash_files, but use _checksum_cache for files not modified"""
+    global _checksum_cache, _checksum_cache_lock
+    ret = [None] * len(paths)
+    missing = list()
+    with _checksum_cache_lock:
+        for i in range(len(paths)):
+            path = os.path.abspath(paths[i])
+            st = os.stat(path)
+            ident = (st.st_ino, st.st_size, st.st_mtime)
+            try:
+                (ident_cached, checksum) = _checksum_cache.pop((path, algo))
+                if ident_cached == ident:
+                    _checksum_cache[(path, algo)] = (ident, checksum)
+                    ret[i] = checksum
+                    continue
+            except KeyError:
+                pass
+            missing.append((i, path, ident))
+
+    if missing:
+        checksums = _hash_files([i[1] for i in missing], algo)
+        with _checksum_cache_lock:
+            for ((i, path, ident), checksum) in zip(missing, checksums):
+                _checksum_cache[(path, algo)] = (ident, checksum)
+                ret[i] = checksum
+            while len(_checksum_cache) > _CHECKSUM_CACHE_MAX:
+                _checksum_cache.popitem(False)
+    return ret
+
+def _is_plain_name(name):
+    """whether @name is a file name not containing any directory component"""
+    if not name or name == os.curdir or name == os.pardir or '\0' in name:
+        return False
+    if os.sep in name or '/' in name:
+        return False
+    if os.altsep and os.altsep in name:
+        return False
+    return True
+
 class _thread_get_file_list(threading.Thread):
-    def __init__(self, path, return_list = True):
+    def __init__(self, path, algo, return_list = True):
         """@return_list: whether to return the result as list of tuple(<filename>, <checksum>)
         or dict(<filename> => <checksum>)
         self.result would be the requested result, or None on error"""
         threading.Thread.__init__(self)
         self.result = None # public, and should not be modified
         self._path = path
+        self._algo = algo
         self._ret_list = return_list
 
     def run(self):
-        def _sha1_file(path):
-            with open(path, 'rb') as f:
-                sha1_ctx = hashlib.sha1()
-                while True:
-                    buf = f.read(sha1_ctx.block_size)
-                    if not buf:
-                        return sha1_ctx.digest()
-                    sha1_ctx.update(buf)
-
         try:
-            rlist = self._ret_list
             path = self._path
-            if rlist:
-                ret = list()
+            fnames = [i for i in os.listdir(path) if os.path.isfile(os.path.join(path, i))]
+            checksums = _hash_files_cached([os.path.join(path, i) for i in fnames], self._algo)
+            if self._ret_list:
+                self.result = zip(fnames, checksums)
             else:
-                ret = dict()
-            for i in os.listdir(path):
-                pf = os.path.join(path, i)
-                if os.path.isfile(pf):
-                    checksum = _sha1_file(pf)
-                    if rlist:
-                        tmp = (i, checksum)
-                        ret.append(tmp)
-                    else:
-                        ret[i] = checksum
-            self.result = ret
+                self.result = dict(zip(fnames, checksums))
                 
         except Exception as e:
             log.error("failed to obtain file list of: {0}" . format(e))
 
 class _thread_make_tar(threading.Thread):
-    def __init__ (self, fobj, dirpath, flist):
+    def __init__ (self, dirpath, flist, archive):
+        """pack files in @flist into archives in temporary files
+        @archive is the archive format for compressible files, or None to
+        pack all files into one ARCHIVE_LEGACY archive
+        self.result would be a list of tuple(<archive format>, <file path>),
+        or None on error; the files should be removed by the caller"""
         threading.Thread.__init__(self)
-        self._fobj = fobj
         self._dirpath = dirpath
         self._flist = flist
-        self.error = False
+        self._archive = archive
+        self.result = None
 
     def run(self):
+        result = list()
         try:
-            tf = tarfile.open(mode = 'w:gz', fileobj = self._fobj, dereference = True)
-            for f in self._flist:
-                tf.add(os.path.join(self._dirpath, f), f)
-            tf.close()
+            if self._archive is None:
+                groups = [(ARCHIVE_LEGACY, self._flist)]
+            elif self._archive == ARCHIVE_STORE:
+                groups = [(ARCHIVE_STORE, self._flist)]
+            else:
+                flist_comp = list()
+                flist_store = list()
+                for f in self._flist:
+                    if _is_compressible(os.path.join(self._dirpath, f)):
+                        flist_comp.append(f)
+                    else:
+                        flist_store.append(f)
+                groups = [(self._archive, flist_comp), (ARCHIVE_STORE, flist_store)]
+
+            for (fmt, flist) in groups:
+                if not flist:
+                    continue
+                (fd, fpath) = tempfile.mkstemp('orzoj')
+                os.close(fd)
+                result.append((fmt, fpath))
+                with open(fpath, 'wb') as f:
+                    self._make(fmt, f, flist)
+                log.debug("{0} file(s) packed into {1} archive of {2} bytes" .
+                        format(len(flist), fmt, os.path.getsize(fpath)))
+            self.result = result
         except Exception as e:
             log.error("failed to create tar file: {0}" . format(e))
-            self.error = True
+            for i in result:
+                os.remove(i[1])
+
+    def _make(self, fmt, fobj, flist):
+        global _compression_level, _compression_threads
+        zobj = None
+        if fmt == "gz":
+            tf = tarfile.open(mode = 'w:gz', fileobj = fobj, dereference = True,
+                    compresslevel = min(_compression_level, 9) or 9)
+        elif fmt == "zstd":
+            zobj = _zstd.compressor(fobj.fileno(), _compression_level or 3,
+                    _compression_threads)
+            tf = tarfile.open(mode = 'w|', fileobj = zobj, dereference = True)
+        else:
+            tf = tarfile.open(mode = 'w', fileobj = fobj, dereference = True)
+        for f in flist:
+            tf.add(os.path.join(self._dirpath, f), f)
+        tf.close()
+        if zobj:
+            zobj.close()
+
+class _thread_fetch_peer(threading.Thread):
+    def __init__(self, dirpath, addr, port, flist, algo):
+        """fetch files into @dirpath from the judge serving at @addr:@port,
+        @flist is a list of tuple(<file number>, <filename>, <checksum>),
+        where checksum is computed with algorithm @algo
+        self.fetched would be the list of numbers of files successfully fetched"""
+        threading.Thread.__init__(self)
+        self._dirpath = dirpath
+        self._addr = addr
+        self._port = port
+        self._flist = flist
+        self._algo = algo
+        self.fetched = list()
+
+    def run(self):
+        sock = None
+        conn = None
+        try:
+            sock = snc.socket(self._addr, self._port, _PEER_CONNECT_TIMEOUT)
+            conn = snc.snc(sock)
+            for (num, fname, checksum) in self._flist:
+                msg.write_msg(conn, msg.PEER_GET_FILE, self._dirpath, fname)
+                if msg.read_msg(conn) != msg.PEER_FILE_OK:
+                    log.warning("peer {0}:{1} failed to provide file {2!r}" .
+                            format(self._addr, self._port, fname))
+                    continue
+
+                (fd, ftmp) = tempfile.mkstemp('orzoj', dir = self._dirpath)
+                os.close(fd)
+                try:
+                    filetrans.recv(ftmp, conn)
+                    if _hash_files([ftmp], self._algo)[0] != checksum:
+                        log.warning("checksum of file {0!r} from peer {1}:{2} does not match" .
+                                format(fname, self._addr, self._port))
+                        continue
+                    os.rename(ftmp, os.path.join(self._dirpath, fname))
+                    ftmp = None
+                    self.fetched.append(num)
+                finally:
+                    if ftmp:
+                        os.remove(ftmp)
+
+            msg.write_msg(conn, msg.PEER_END)
+
+        except (snc.Error, snc.ErrorTimeout):
+            log.warning("network error while fetching files from peer {0}:{1}" .
+                    format(self._addr, self._port))
+        except filetrans.OFTPError:
+            log.warning("failed to transfer file from peer {0}:{1}" .
+                    format(self._addr, self._port))
+        except Exception as e:
+            log.warning("failed to fetch files from peer {0}:{1}: {2}" .
+                    format(self._addr, self._port, e))
+            log.debug(traceback.format_exc())
+        finally:
+            if conn:
+                conn.close()
+            if sock:
+                sock.close()
 
 class _thread_extract_tar(threading.Thread):
-    def __init__(self, fobj, dirpath):
+    def __init__(self, flist, dirpath):
+        """@flist is a list of tuple(<archive format>, <file path>)"""
         threading.Thread.__init__(self)
-        self._fobj = fobj
+        self._flist = flist
         self._dirpath = dirpath
         self.error = False
 
     def run(self):
         try:
-            tf = tarfile.open(mode = "r", fileobj = self._fobj)
-            tf.extractall(self._dirpath)
-            tf.close()
+            for (fmt, fpath) in self._flist:
+                with open(fpath, 'rb') as f:
+                    zobj = None
+                    if fmt == "zstd":
+                        zobj = _zstd.decompressor(f.fileno())
+                        tf = tarfile.open(mode = "r|", fileobj = zobj)
+                    else:
+                        tf = tarfile.open(mode = "r", fileobj = f)
+                    tf.extractall(self._dirpath)
+                    tf.close()
+                    if zobj:
+                        zobj.close()
         except Exception as e:
             log.error("failed to extract tar file: {0}" . format(e))
             self.error = True
 
-def send(path, conn):
+def send(path, conn, peers = None, hash_algo = None, archive = None):
     """send the directory at @path via snc connection @conn,
-    return the speed in kb/s, or None if no file transferred"""
+    return the speed in kb/s, or None if no file transferred
+
+    @peers is a list of tuple(<address>, <port>) of judges holding a verified
+    copy of the directory, from which the client should try to fetch the files
+    first; it must be None if the client does not support SYNCDIR_PEERS
 
-    def _write_msg(m):
-        msg.write_msg(conn, m)
+    @hash_algo is the checksum algorithm negotiated with the client, or None
+    if the client is older than msg.PROTOCOL_VERSION_HASH
 
-    def _write_str(s):
-        conn.write_str(s)
+    @archive is the archive format for compressible files chosen by
+    choose_archive_format(), or None if the client is older than
+    msg.PROTOCOL_VERSION_ARCHIVE"""
 
-    def _write_uint32(v):
-        conn.write_uint32(v)
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
 
     def _read_msg():
         return msg.read_msg(conn)
@@ -139,21 +394,20 @@ def send(path, conn):
                 raise Error
             return
 
-    flist = _thread_get_file_list(path)
+    flist = _thread_get_file_list(path, hash_algo or HASH_LEGACY)
     flist.start()
     while flist.is_alive():
-        flist.join(msg.TELL_ONLINE_INTERVAL)
-        _write_msg(msg.TELL_ONLINE)
+        flist.join(conn.heartbeat_interval)
+        msg.tell_online(conn)
     flist = flist.result
     if flist is None:
         raise Error
 
     try:
-        _write_msg(msg.SYNCDIR_BEGIN)
-        _write_uint32(len(flist))
+        fields = [len(flist)]
         for i in flist:
-            _write_str(i[0])
-            _write_str(i[1])
+            fields.extend([i[0], i[1]])
+        _write_msg(msg.SYNCDIR_BEGIN, *fields)
 
         _check_msg(msg.SYNCDIR_FILELIST)
 
@@ -165,29 +419,71 @@ def send(path, conn):
         flist_req = list()
         while nfile:
             nfile -= 1
-            flist_req.append(flist[_read_uint32()][0])
-
-        ftar = tempfile.mkstemp('orzoj')
+            flist_req.append(_read_uint32())
+
+        if peers:
+            peers = peers[:len(flist_req)]
+            assign = [list() for i in peers]
+            for i in range(len(flist_req)):
+                assign[i % len(peers)].append(flist_req[i])
+
+            if hash_algo:
+                checksum_peer = _hash_files_cached(
+                        [os.path.join(path, flist[i][0]) for i in flist_req], HASH_PEER)
+                checksum_peer = dict(zip(flist_req, checksum_peer))
+
+            fields = [len(peers)]
+            for i in range(len(peers)):
+                fields.extend([peers[i][0], peers[i][1], len(assign[i])])
+                for j in assign[i]:
+                    fields.append(j)
+                    if hash_algo:
+                        fields.append(checksum_peer[j])
+            _write_msg(msg.SYNCDIR_PEERS, *fields)
+
+            _check_msg(msg.SYNCDIR_FILELIST)
+            nfile_req = len(flist_req)
+            nfile = _read_uint32()
+            flist_req = list()
+            while nfile:
+                nfile -= 1
+                flist_req.append(_read_uint32())
+
+            log.info("{0} of {1} file(s) fetched from other judges" .
+                    format(nfile_req - len(flist_req), nfile_req))
+
+            if len(flist_req) == 0:
+                _check_msg(msg.SYNCDIR_DONE)
+                return None
+
+        flist_req = [flist[i][0] for i in flist_req]
+
+        th_mktar = _thread_make_tar(path, flist_req, archive)
+        th_mktar.start()
+        while th_mktar.is_alive():
+            th_mktar.join(conn.heartbeat_interval)
+            msg.tell_online(conn)
+        ftar = th_mktar.result
+        if ftar is None:
+            raise Error
 
         try:
-            with open(ftar[1], 'wb') as f:
-                th_mktar = _thread_make_tar(f, path, flist_req)
-                th_mktar.start()
-                while th_mktar.is_alive():
-                    th_mktar.join(msg.TELL_ONLINE_INTERVAL)
-                    _write_msg(msg.TELL_ONLINE)
-                if th_mktar.error:
-                    raise Error
-
-            _write_msg(msg.SYNCDIR_FTRANS)
-            speed = filetrans.send(ftar[1], conn)
+            if archive is not None:
+                _write_msg(msg.SYNCDIR_FTRANS, len(ftar), *[i[0] for i in ftar])
+            else:
+                _write_msg(msg.SYNCDIR_FTRANS)
+            size_tot = 0
+            time_tot = 0
+            for i in ftar:
+                size = os.path.getsize(i[1]) / 1024.0
+                size_tot += size
+                time_tot += size / filetrans.send(i[1], conn)
             _check_msg(msg.SYNCDIR_DONE)
-            return speed
+            return size_tot / time_tot
 
         finally:
-
-            os.close(ftar[0])
-            os.remove(ftar[1])
+            for i in ftar:
+                os.remove(i[1])
 
 
     except Error as e:
@@ -207,30 +503,23 @@ def send(path, conn):
         raise Error
 
 
-def recv(path, conn):
-    """save the directory to @path via snc connection @conn,
-    return the speed in kb/s, or None if no file transferred"""
-    def _write_msg(m):
-        msg.write_msg(conn, m)
+def send_async(path, conn, peers = None, hash_algo = None, archive = None):
+    """like send, but a coroutine for evloop, where @conn is an evloop.Conn
+    or evloop.Stream; checksums and archives are computed by the worker
+    threads of evloop"""
 
-    def _write_str(s):
-        conn.write_str(s)
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
 
-    def _write_uint32(v):
-        conn.write_uint32(v)
-
-    def _read_msg():
-        return msg.read_msg(conn)
-
-    def _read_str():
-        return conn.read_str()
+    def _tell_online():
+        msg.tell_online(conn)
 
     def _read_uint32():
         return conn.read_uint32()
 
     def _check_msg(m):
         while True:
-            m1 = _read_msg()
+            m1 = yield _read_uint32()
             if m1 == msg.TELL_ONLINE:
                 continue
             if m1 != m:
@@ -239,15 +528,159 @@ def recv(path, conn):
                 raise Error
             return
 
+    def _read_flist_req():
+        nfile = yield _read_uint32()
+        ret = list()
+        while nfile:
+            nfile -= 1
+            ret.append((yield _read_uint32()))
+        yield evloop.Return(ret)
+
+    flist = _thread_get_file_list(path, hash_algo or HASH_LEGACY)
+    yield evloop.wait(evloop.run_in_thread(flist.run), conn.heartbeat_interval,
+            _tell_online)
+    flist = flist.result
+    if flist is None:
+        raise Error
+
+    try:
+        fields = [len(flist)]
+        for i in flist:
+            fields.extend([i[0], i[1]])
+        _write_msg(msg.SYNCDIR_BEGIN, *fields)
+
+        yield _check_msg(msg.SYNCDIR_FILELIST)
+
+        flist_req = yield _read_flist_req()
+        if not flist_req:
+            yield _check_msg(msg.SYNCDIR_DONE)
+            yield evloop.Return(None)
+
+        if peers:
+            peers = peers[:len(flist_req)]
+            assign = [list() for i in peers]
+            for i in range(len(flist_req)):
+                assign[i % len(peers)].append(flist_req[i])
+
+            if hash_algo:
+                checksum_peer = yield evloop.run_in_thread(_hash_files_cached,
+                        [os.path.join(path, flist[i][0]) for i in flist_req], HASH_PEER)
+                checksum_peer = dict(zip(flist_req, checksum_peer))
+
+            fields = [len(peers)]
+            for i in range(len(peers)):
+                fields.extend([peers[i][0], peers[i][1], len(assign[i])])
+                for j in assign[i]:
+                    fields.append(j)
+                    if hash_algo:
+                        fields.append(checksum_peer[j])
+            _write_msg(msg.SYNCDIR_PEERS, *fields)
+
+            yield _check_msg(msg.SYNCDIR_FILELIST)
+            nfile_req = len(flist_req)
+            flist_req = yield _read_flist_req()
+
+            log.info("{0} of {1} file(s) fetched from other judges" .
+                    format(nfile_req - len(flist_req), nfile_req))
+
+            if len(flist_req) == 0:
+                yield _check_msg(msg.SYNCDIR_DONE)
+                yield evloop.Return(None)
+
+        flist_req = [flist[i][0] for i in flist_req]
+
+        th_mktar = _thread_make_tar(path, flist_req, archive)
+        yield evloop.wait(evloop.run_in_thread(th_mktar.run), conn.heartbeat_interval,
+                _tell_online)
+        ftar = th_mktar.result
+        if ftar is None:
+            raise Error
+
+        try:
+            if archive is not None:
+                _write_msg(msg.SYNCDIR_FTRANS, len(ftar), *[i[0] for i in ftar])
+            else:
+                _write_msg(msg.SYNCDIR_FTRANS)
+            size_tot = 0
+            time_tot = 0
+            for i in ftar:
+                size = os.path.getsize(i[1]) / 1024.0
+                size_tot += size
+                time_tot += size / (yield filetrans.send_async(i[1], conn))
+            yield _check_msg(msg.SYNCDIR_DONE)
+
+        finally:
+            for i in ftar:
+                os.remove(i[1])
+
+    except Error as e:
+        raise e
+
+    except snc.Error:
+        log.warning("network error while synchronizing directory")
+        raise Error
+
+    except filetrans.OFTPError:
+        log.warning("failed to transfer file while synchronizing directory")
+        raise Error
+
+    except Exception as e:
+        log.error("failed to synchronize directory: {0}" . format(e))
+        log.debug(traceback.format_exc())
+        raise Error
+
+    yield evloop.Return(size_tot / time_tot)
+
+
+def recv(path, conn, hash_algo = None, archive_formats = None, before_change = None):
+    """save the directory to @path via snc connection @conn,
+    return the speed in kb/s, or None if no file transferred
+
+    @hash_algo: see send()
+    @archive_formats: the archive formats announced to the server, or None
+    if the server is older than msg.PROTOCOL_VERSION_ARCHIVE
+    @before_change: if not None, it is called before anything under @path
+    is modified, and not called if the directory is up to date"""
+    def _write_msg(m, *fields):
+        msg.write_msg(conn, m, *fields)
+
+    def _read_msg():
+        return msg.read_msg(conn)
+
+    def _read_str():
+        return conn.read_str()
+
+    def _read_uint32():
+        return conn.read_uint32()
+
+    def _wait_msg():
+        while True:
+            m = _read_msg()
+            if m != msg.TELL_ONLINE:
+                return m
+
+    def _check_msg(m):
+        m1 = _wait_msg()
+        if m1 != m:
+            log.warning("message check error: expecting {0}, got {1}" .
+                    format(m, m1))
+            raise Error
+
+    def _write_filelist():
+        _write_msg(msg.SYNCDIR_FILELIST, len(flist_needed), *flist_needed)
+
     try:
         if os.path.isdir(path):
-            th_hash = _thread_get_file_list(path, False)
+            th_hash = _thread_get_file_list(path, hash_algo or HASH_LEGACY, False)
             th_hash.start()
             while th_hash.is_alive():
-                th_hash.join(msg.TELL_ONLINE_INTERVAL)
-                _write_msg(msg.TELL_ONLINE)
+                th_hash.join(conn.heartbeat_interval)
+                msg.tell_online(conn)
             flist_local = th_hash.result
         else:
+            if before_change:
+                before_change()
+                before_change = None
             if os.path.exists(path):
                 os.remove(path)
             os.mkdir(path)
@@ -256,51 +689,106 @@ def recv(path, conn):
             raise Error
 
         flist_needed = list()
+        flist_remote = list()
+        flist_remove = list()
         _check_msg(msg.SYNCDIR_BEGIN)
         
         for i in range(_read_uint32()):
             fname = _read_str()
             checksum = _read_str()
+            if not _is_plain_name(fname):
+                log.error("bad file name in file list: {0!r}" . format(fname))
+                raise Error
+            flist_remote.append((i, fname, checksum))
             try:
                 if checksum != flist_local[fname]:
-                    os.remove(os.path.join(path, fname))
+                    flist_remove.append(fname)
                     flist_needed.append(i)
                 del flist_local[fname]
             except KeyError:
                 flist_needed.append(i)
 
-        for i in flist_local:
+        flist_remove.extend(flist_local)
+        if (flist_remove or flist_needed) and before_change:
+            before_change()
+        for i in flist_remove:
             os.remove(os.path.join(path, i))
 
-        _write_msg(msg.SYNCDIR_FILELIST)
-        _write_uint32(len(flist_needed))
+        _write_filelist()
 
         if len(flist_needed) == 0:
             _write_msg(msg.SYNCDIR_DONE)
             return None
 
-        for i in flist_needed:
-            _write_uint32(i)
+        m = _wait_msg()
+        if m == msg.SYNCDIR_PEERS:
+            th_peers = list()
+            for i in range(_read_uint32()):
+                addr = _read_str()
+                port = _read_uint32()
+                flist_peer = list()
+                for j in range(_read_uint32()):
+                    (num, fname, checksum) = flist_remote[_read_uint32()]
+                    if hash_algo:
+                        checksum = _read_str()
+                    flist_peer.append((num, fname, checksum))
+                th_peers.append(_thread_fetch_peer(path, addr, port, flist_peer,
+                    HASH_PEER if hash_algo else HASH_LEGACY))
+            for th in th_peers:
+                th.start()
+            for th in th_peers:
+                while th.is_alive():
+                    th.join(conn.heartbeat_interval)
+                    msg.tell_online(conn)
+                for j in th.fetched:
+                    flist_needed.remove(j)
+
+            _write_filelist()
+            if len(flist_needed) == 0:
+                _write_msg(msg.SYNCDIR_DONE)
+                return None
+            m = _wait_msg()
+
+        if m != msg.SYNCDIR_FTRANS:
+            log.warning("message check error: expecting {0}, got {1}" .
+                    format(msg.SYNCDIR_FTRANS, m))
+            raise Error
 
-        _check_msg(msg.SYNCDIR_FTRANS)
+        if archive_formats is None:
+            fmt_list = [ARCHIVE_LEGACY]
+        else:
+            fmt_list = [_read_str() for i in range(_read_uint32())]
+            for i in fmt_list:
+                if i not in archive_formats:
+                    log.error("unsupported archive format: {0!r}" . format(i))
+                    raise Error
 
+        ftar = list()
         try:
-            ftar = tempfile.mkstemp('orzoj')
-            speed = filetrans.recv(ftar[1], conn)
-            with open(ftar[1], 'r') as f:
-                th_extar = _thread_extract_tar(f, path)
-                th_extar.start()
-                while th_extar.is_alive():
-                    th_extar.join(msg.TELL_ONLINE_INTERVAL)
-                    _write_msg(msg.TELL_ONLINE)
-                if th_extar.error:
-                    raise Error
+            size_tot = 0
+            time_tot = 0
+            for fmt in fmt_list:
+                (fd, fpath) = tempfile.mkstemp('orzoj')
+                os.close(fd)
+                ftar.append((fmt, fpath))
+                speed = filetrans.recv(fpath, conn)
+                size = os.path.getsize(fpath) / 1024.0
+                size_tot += size
+                time_tot += size / speed
+
+            th_extar = _thread_extract_tar(ftar, path)
+            th_extar.start()
+            while th_extar.is_alive():
+                th_extar.join(conn.heartbeat_interval)
+                msg.tell_online(conn)
+            if th_extar.error:
+                raise Error
             _write_msg(msg.SYNCDIR_DONE)
-            return speed
+            return size_tot / time_tot
 
         finally:
-            os.close(ftar[0])
-            os.remove(ftar[1])
+            for i in ftar:
+                os.remove(i[1])
 
     except Error as e:
         raise e
@@ -318,4 +806,71 @@ def recv(path, conn):
         log.debug(traceback.format_exc())
         raise Error
 
+def serve_peer(conn):
+    """serve another judge via snc connection @conn, sending it the files
+    it requests from the directories under current working directory,
+    until it finishes
+    no exceptions are raised"""
+    try:
+        while True:
+            m = msg.read_msg(conn)
+            if m == msg.PEER_END:
+                return
+            if m != msg.PEER_GET_FILE:
+                log.warning("unexpected message from peer: {0}" . format(m))
+                return
+            dirpath = conn.read_str()
+            fname = conn.read_str()
+            fpath = os.path.join(dirpath, fname)
+            if not _is_plain_name(dirpath) or not _is_plain_name(fname) or \
+                    not os.path.isfile(fpath) or os.path.islink(fpath):
+                log.warning("peer requested unavailable file {0!r}" . format(fpath))
+                msg.write_msg(conn, msg.PEER_FILE_ERROR)
+                continue
+            msg.write_msg(conn, msg.PEER_FILE_OK)
+            filetrans.send(fpath, conn)
 
+    except snc.Error:
+        log.warning("network error while serving peer")
+    except filetrans.OFTPError:
+        log.warning("failed to transfer file to peer")
+    except Exception as e:
+        log.error("failed to serve peer: {0}" . format(e))
+        log.debug(traceback.format_exc())
+
+def _set_hash_threads(arg):
+    global _hash_threads
+    _hash_threads = int(arg[1])
+    if _hash_threads < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _set_compression(arg):
+    global _compression
+    _compression = arg[1]
+    if _compression == "none":
+        _compression = ARCHIVE_STORE
+    if _compression not in ("gz", "zstd", ARCHIVE_STORE):
+        raise conf.UserError("unknown compression method for Option {0}: {1!r}" .
+                format(arg[0], arg[1]))
+
+def _set_compression_level(arg):
+    global _compression_level
+    _compression_level = int(arg[1])
+    if _compression_level < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+def _set_compression_threads(arg):
+    global _compression_threads
+    _compression_threads = int(arg[1])
+    if _compression_threads < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+    if not _compression_threads:
+        try:
+            _compression_threads = os.sysconf("SC_NPROCESSORS_ONLN")
+        except (ValueError, OSError, AttributeError):
+            _compression_threads = 0
+
+conf.simple_conf_handler("HashThreads", _set_hash_threads, default = "0")
+conf.simple_conf_handler("SyncCompression", _set_compression, default = "zstd")
+conf.simple_conf_handler("SyncCompressionLevel", _set_compression_level, default = "0")
+conf.simple_conf_handler("SyncCompressionThreads", _set_compression_threads, default = "0")
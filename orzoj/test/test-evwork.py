@@ -0,0 +1,173 @@
+#!/usr/bin/env python
+# serve scripted judges with orzoj-server in event loop mode (see EventLoop),
+# the website being replaced by a function recording the reports
+
+import sys, os, os.path, tempfile, shutil, filecmp, subprocess, threading, time
+
+from orzoj import snc, conf, msg, sync_dir, structures, control
+
+HOST = '127.0.0.1'
+PORT = 9353
+NJUDGE = 2
+NTASK = 8
+NCASE = 3
+TIMEOUT = 60
+
+def judge(conf_file, judge_id):
+    """connect to orzoj-server and judge tasks until the connection is closed,
+    with the data cache in current working directory; every case gets its
+    full score"""
+    conf.parse_file(conf_file)
+    s = snc.socket(HOST, PORT)
+    conn = snc.snc(s)
+    algos = sync_dir.algorithms()
+    formats = sync_dir.archive_formats()
+    hello = [judge_id, msg.PROTOCOL_VERSION, 1, "c", "", 0, len(algos)]
+    hello.extend(algos)
+    hello.append(len(formats))
+    hello.extend(formats)
+    hello.extend([1, 0, 1000])  # one slot, no compression, heartbeat
+    msg.write_msg(conn, msg.HELLO, *hello)
+    if msg.read_msg(conn) != msg.CONNECT_OK:
+        sys.exit("[{0}] failed to connect" . format(judge_id))
+    hash_algo = conn.read_str()
+    conn.read_str()
+    conn.read_uint32()
+    njudged = 0
+    try:
+        while True:
+            m = msg.read_msg(conn)
+            if m == msg.TELL_ONLINE:
+                continue
+            if m == msg.PREFETCH_DATA:
+                sync_dir.recv(conn.read_str(), conn, hash_algo, formats)
+                continue
+            if m != msg.PREPARE_DATA:
+                sys.exit("[{0}] unexpected message {1}" . format(judge_id, m))
+            sync_dir.recv(conn.read_str(), conn, hash_algo, formats)
+            msg.write_msg(conn, msg.DATA_OK, NCASE)
+            if msg.read_msg(conn) != msg.START_JUDGE:
+                sys.exit("[{0}] message check error" . format(judge_id))
+            for i in range(4):  # lang, src, input, output
+                conn.read_str()
+            msg.write_msg(conn, msg.START_JUDGE_OK)
+            msg.write_msg(conn, msg.COMPILE_SUCCEED)
+            for i in range(NCASE):
+                res = structures.case_result()
+                (res.exe_status, res.score, res.full_score, res.time, res.memory,
+                        res.extra_info) = (structures.EXESTS_NORMAL, 10, 10, i, 0, "")
+                msg.write_msg(conn, msg.REPORT_CASE, *res.fields())
+            msg.write_msg(conn, msg.REPORT_JUDGE_FINISH)
+            njudged += 1
+    except (snc.Error, sync_dir.Error):
+        # orzoj-server stopped
+        pass
+    print "[{0}] judged {1} tasks" . format(judge_id, njudged)
+
+if len(sys.argv) == 4 and sys.argv[1] == "--judge":
+    judge(sys.argv[2], sys.argv[3])
+    sys.exit()
+
+if len(sys.argv) != 1:
+    sys.exit("usage: %s" % sys.argv[0])
+
+# not imported by the judges, whose configuration lacks the server options
+from orzoj.server import web, work, evwork
+
+reports = list()
+reports_lock = threading.Lock()
+
+def web_read(data, maxlen = None, timeout = 0):
+    """replace web._read, the only function talking to the website"""
+    with reports_lock:
+        reports.append(data)
+        if data["action"] == "get_query_list":
+            return dict()
+        if data["action"] == "register_new_judge":
+            return {"id_num": len(reports)}
+
+def finished():
+    with reports_lock:
+        return [i["task"] for i in reports if i["action"] == "report_prob_result"]
+
+def idle():
+    """whether all the judges are connected and have the data of all the
+    problems, so that nothing is being prefetched"""
+    judges = list(evwork._judges)
+    return len(judges) == NJUDGE and all(not j._syncing and len(j._synced) == len(probs)
+            for j in judges)
+
+def watch():
+    """stop the server when all tasks are finished and the judges are idle"""
+    deadline = time.time() + TIMEOUT
+    while (len(finished()) < NTASK or not idle()) and time.time() < deadline:
+        time.sleep(0.2)
+    control.set_termination_flag()
+
+def start_judge(judge_id):
+    datacache = os.path.join(workdir, judge_id)
+    os.mkdir(datacache)
+    os.symlink(os.path.join(testdir, "cert"), os.path.join(datacache, "cert"))
+    return subprocess.Popen([sys.executable, os.path.join(testdir, os.path.basename(sys.argv[0])),
+        "--judge", os.path.join(testdir, "test-snc-client.conf"), judge_id],
+        cwd = datacache, env = dict(os.environ, PYTHONPATH = testdir))
+
+testdir = os.getcwd()
+web._read = web_read
+conf._init_func.remove(web._login)
+
+workdir = tempfile.mkdtemp('orzoj')
+judges = list()
+try:
+    conf.parse_file("test-evwork.conf")
+    # the certificate files are opened after changing to the data directory
+    for i in ("_cert_file", "_key_file", "_ca_file"):
+        setattr(snc, i, os.path.abspath(getattr(snc, i)))
+    datadir = os.path.join(workdir, "data")
+    probs = ("a", "b")
+    for pcode in probs:
+        os.makedirs(os.path.join(datadir, pcode))
+        for i in range(NCASE):
+            with open(os.path.join(datadir, pcode, "{0}.in" . format(i)), "wb") as f:
+                f.write(os.urandom(1024 * (i + 1)))
+    os.chdir(datadir)
+
+    for i in range(NTASK):
+        task = structures.task()
+        (task.id, task.prob, task.lang, task.src, task.input, task.output) = (
+                i, probs[i % len(probs)], "c", "int main(){}", "", "")
+        task.lang_id = work._get_lang_id(task.lang)
+        task.queue_time = time.time()
+        work._task_queue.put(task)
+        work._prefetch_list.add_recent(task.prob)
+
+    web.start_report_threads()
+
+    s = snc.socket(None, PORT)
+    for i in range(NJUDGE):
+        judges.append(start_judge("judge{0}" . format(i)))
+    threading.Thread(target = watch).start()
+    evwork.run(s)
+    s.close()
+
+    for i in judges:
+        i.wait()
+    web.stop_report_threads()
+    done = finished()
+    print "[server] {0} of {1} tasks finished, {2} reported more than once" . format(
+            len(set(done)), NTASK, len(done) - len(set(done)))
+    for i in range(NJUDGE):
+        judge_id = "judge{0}" . format(i)
+        for pcode in probs:
+            dst = os.path.join(workdir, judge_id, pcode)
+            cmp = filecmp.dircmp(pcode, dst)
+            ok = not (cmp.left_only or cmp.right_only or cmp.diff_files or cmp.funny_files)
+            print "[{0}] data of {1!r}: {2}" . format(judge_id, pcode, ok and "ok" or "MISMATCH")
+finally:
+    control.set_termination_flag()
+    web.stop_report_threads()
+    for i in judges:
+        if i.poll() is None:
+            i.kill()
+    os.chdir("/")
+    shutil.rmtree(workdir)
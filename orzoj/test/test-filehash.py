@@ -0,0 +1,17 @@
+#!/usr/bin/env python
+
+import sys, hashlib
+from orzoj import _filehash
+
+if len(sys.argv) < 2:
+    sys.exit("usage: {0} <file> ..." . format(sys.argv[0]))
+
+print "algorithms: {0!r}" . format(_filehash.algorithms())
+
+for algo in _filehash.algorithms():
+    for (f, digest) in zip(sys.argv[1:], _filehash.hash_files(algo, sys.argv[1:], 0)):
+        check = ""
+        if algo in ("sha1", "sha256"):
+            with open(f, "rb") as fptr:
+                check = hashlib.new(algo, fptr.read()).digest() == digest and " ok" or " MISMATCH"
+        print "{0} {1} {2}{3}" . format(algo, digest.encode('hex'), f, check)
@@ -0,0 +1,87 @@
+#!/usr/bin/env python
+# synchronize a directory to two judges on this host, the second of which
+# fetches the files from the first one instead of orzoj-server
+
+import sys, os, os.path, tempfile, shutil, filecmp, subprocess
+from orzoj import snc, conf, sync_dir
+
+HOST = '127.0.0.1'
+PORT = 9351
+PEER_PORT = 9352
+HASH_ALGO = "sha256"
+
+def judge(conf_file, pcode, serve_peer):
+    """receive the directory into @pcode under current working directory
+    (the data cache of the judge), then serve it to one other judge if
+    @serve_peer is set"""
+    conf.parse_file(conf_file)
+    datacache = os.path.basename(os.getcwd())
+    if serve_peer:
+        ps = snc.socket(None, PEER_PORT)
+    s = snc.socket(HOST, PORT)
+    ss = snc.snc(s)
+    print "[{0}] speed: {1}" . format(datacache, sync_dir.recv(pcode, ss, HASH_ALGO))
+    ss.close()
+    s.close()
+    if serve_peer:
+        (conn, addr) = ps.accept()
+        print "[{0}] serving peer {1}" . format(datacache, addr)
+        pconn = snc.snc(conn, True)
+        sync_dir.serve_peer(pconn)
+        pconn.close()
+        conn.close()
+        ps.close()
+
+if len(sys.argv) == 5 and sys.argv[1] == "--judge":
+    judge(sys.argv[2], sys.argv[3], sys.argv[4] == "1")
+    sys.exit()
+
+if len(sys.argv) != 2:
+    sys.exit("usage: %s <directory to be sent>" % sys.argv[0])
+
+src = os.path.abspath(sys.argv[1])
+pcode = os.path.basename(src)
+workdir = tempfile.mkdtemp('orzoj')
+
+def start_judge(name, serve_peer):
+    datacache = os.path.join(workdir, name)
+    os.mkdir(datacache)
+    # paths in the configuration file are relative to the data cache
+    os.symlink(os.path.abspath("cert"), os.path.join(datacache, "cert"))
+    return subprocess.Popen([sys.executable, os.path.abspath(sys.argv[0]), "--judge",
+        os.path.abspath("test-snc-client.conf"), pcode, serve_peer and "1" or "0"],
+        cwd = datacache, env = dict(os.environ, PYTHONPATH = os.getcwd()))
+
+def send(peers):
+    (conn, addr) = s.accept()
+    ss = snc.snc(conn, True)
+    ret = sync_dir.send(src, ss, peers, HASH_ALGO)
+    ss.close()
+    conn.close()
+    return ret
+
+judges = list()
+try:
+    conf.parse_file("test-snc-server.conf")
+    s = snc.socket(None, PORT)
+
+    judges.append(start_judge("judge1", True))
+    print "[server] judge1 speed: {0}" . format(send(None))
+
+    judges.append(start_judge("judge2", False))
+    print "[server] judge2 speed: {0} (None if all the files are fetched from judge1)" . format(
+            send([(HOST, PEER_PORT)]))
+    s.close()
+
+    for i in judges:
+        i.wait()
+
+    for name in ("judge1", "judge2"):
+        cmp = filecmp.dircmp(src, os.path.join(workdir, name, pcode))
+        ok = not (cmp.left_only or cmp.right_only or cmp.diff_files or cmp.funny_files)
+        print "[{0}] {1}" . format(name, ok and "ok" or "MISMATCH")
+finally:
+    for i in judges:
+        if i.poll() is None:
+            i.kill()
+    shutil.rmtree(workdir)
@@ -0,0 +1,263 @@
+# $File: zstream.py
+# $Author: Jiakai <jia.kai66@gmail.com>
+#
+# This file is part of orzoj
+#
+# Copyright (C) <2010>  Jiakai <jia.kai66@gmail.com>
+#
+# Orzoj is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Orzoj is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with orzoj.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""compress the messages between orzoj-server and orzoj-judge
+
+after msg.CONNECT_OK choosing a compression method, everything sent over
+the connection (in both directions) is in frames of
+    (head:uint32, data:len bytes)
+where len is the lower 31 bits of head, and data are compressed if the
+highest bit of head is set; frames smaller than MsgCompressionMinSize are
+not compressed. Compressed frames of a connection form one stream, so
+that a message can refer to data of the previous ones"""
+
+import struct, os, hashlib
+from collections import deque
+
+from orzoj import snc, log, conf
+
+try:
+    from orzoj import _zstd
+except ImportError:
+    _zstd = None
+
+METHOD_ZSTD = "zstd"
+
+_method = None
+_level = 3
+_min_size = 128
+
+_COMPRESSED = 0x80000000
+_LEN_MASK = 0x7fffffff
+
+_FRAME_FLUSH_SIZE = 16384
+# buffered data are sent in a frame when exceeding this size
+
+def methods():
+    """return a tuple of names of compression methods this side
+    is willing to use"""
+    if _method and _zstd:
+        return (_method, )
+    return ()
+
+def choose(peer_methods):
+    """return the compression method to use with a peer supporting
+    compression methods @peer_methods, or an empty string for none"""
+    for i in methods():
+        if i in peer_methods:
+            return i
+    return ""
+
+class Encoder:
+    def __init__(self, method):
+        """compress frames by @method"""
+        self._zobj = _zstd.stream_compressor(_level)
+
+    def encode(self, parts):
+        """return a list of strings forming a frame of the strings in
+        the list @parts"""
+        size = sum(len(i) for i in parts)
+        if size < _min_size:
+            return [snc.pack_uint32(size)] + parts
+        try:
+            data = self._zobj.compress("".join(parts))
+        except _zstd.error as e:
+            log.error("failed to compress: {0}" . format(e))
+            raise snc.Error
+        return [snc.pack_uint32(len(data) | _COMPRESSED), data]
+
+class Decoder:
+    def __init__(self, method):
+        """decompress frames compressed by @method"""
+        self._zobj = _zstd.stream_decompressor()
+        self._buf = deque()
+        self._buf_len = 0
+
+    def decode(self, head, data):
+        """return the data in a frame with head @head and data @data"""
+        if not head & _COMPRESSED:
+            return data
+        try:
+            return self._zobj.decompress(data)
+        except _zstd.error as e:
+            log.error("failed to decompress: {0}" . format(e))
+            raise snc.Error
+
+    def feed(self, data):
+        """feed @data received from the connection, return the data
+        in the frames completed"""
+        self._buf.append(data)
+        self._buf_len += len(data)
+        ret = list()
+        while self._buf_len >= 4:
+            head = snc._UINT32.unpack(self._peek(4))[0]
+            if self._buf_len < 4 + (head & _LEN_MASK):
+                break
+            self._take(4)
+            ret.append(self.decode(head, self._take(head & _LEN_MASK)))
+        return "".join(ret)
+
+    def _peek(self, size):
+        data = self._take(size)
+        self._buf.appendleft(data)
+        self._buf_len += size
+        return data
+
+    def _take(self, size):
+        buf = self._buf
+        ret = list()
+        n = size
+        while n:
+            s = buf.popleft()
+            if len(s) > n:
+                buf.appendleft(s[n:])
+                s = s[:n]
+            ret.append(s)
+            n -= len(s)
+        self._buf_len -= size
+        return "".join(ret)
+
+
+class Conn(snc.snc):
+    def __init__(self, conn, method):
+        """compress messages over @conn (an instance of snc.snc, which
+        must not be used directly any more) by @method; it has the same
+        interface as snc.snc and closes @conn when closed"""
+        self._conn = conn
+        self._snc = None
+        self._enc = Encoder(method)
+        self._dec = Decoder(method)
+        self._rbuf = deque()
+        self._rbuf_len = 0
+        self._wbuf = list()
+        self._wbuf_len = 0
+
+    def read(self, size, timeout = 0):
+        if self._wbuf:
+            self.flush(timeout)
+        while self._rbuf_len < size:
+            head = self._conn.read_uint32(timeout)
+            data = self._conn.read(head & _LEN_MASK, timeout)
+            data = self._dec.decode(head, data)
+            self._rbuf.append(data)
+            self._rbuf_len += len(data)
+        return self._take(size)
+
+    def readinto(self, buf, timeout = 0):
+        size = len(buf)
+        buf[:] = self.read(size, timeout)
+        return size
+
+    def read_uint32(self, timeout = 0):
+        return struct.unpack("!I", self.read(4, timeout))[0]
+
+    def recv_to_file(self, fd, size, digest = None, timeout = 0):
+        h = None
+        if digest:
+            h = hashlib.new(digest)
+        while size:
+            data = self.read(min(size, _FRAME_FLUSH_SIZE), timeout)
+            size -= len(data)
+            if h:
+                h.update(data)
+            while data:
+                data = data[os.write(fd, data):]
+        if h:
+            return h.digest()
+
+    def write(self, data, timeout = 0):
+        self.write_frame([data], timeout)
+
+    def write_buffered(self, data, timeout = 0):
+        self._wbuf.append(data)
+        self._wbuf_len += len(data)
+        if self._wbuf_len >= _FRAME_FLUSH_SIZE:
+            self.flush(timeout)
+
+    def write_frame(self, parts, timeout = 0):
+        self._wbuf.extend(parts)
+        self.flush(timeout)
+
+    def flush(self, timeout = 0):
+        if self._wbuf:
+            parts = self._wbuf
+            self._wbuf = list()
+            self._wbuf_len = 0
+            self._conn.write_frame(self._enc.encode(parts), timeout)
+
+    def wait_readable(self, timeout):
+        if self._rbuf_len:
+            return True
+        return self._conn.wait_readable(timeout)
+
+    def has_data(self):
+        return bool(self._rbuf_len) or self._conn.has_data()
+
+    def close(self):
+        if self._conn:
+            self._conn.close()
+            self._conn = None
+
+    def _take(self, size):
+        buf = self._rbuf
+        ret = list()
+        n = size
+        while n:
+            s = buf.popleft()
+            if len(s) > n:
+                buf.appendleft(s[n:])
+                s = s[:n]
+            ret.append(s)
+            n -= len(s)
+        self._rbuf_len -= size
+        if len(ret) == 1:
+            return ret[0]
+        return "".join(ret)
+
+
+def _set_method(arg):
+    global _method
+    _method = arg[1]
+    if _method == "none":
+        _method = None
+    elif _method != METHOD_ZSTD:
+        raise conf.UserError("unknown compression method for Option {0}: {1!r}" .
+                format(arg[0], arg[1]))
+    elif not _zstd:
+        log.warning("orzoj is compiled without zstd, messages will not be compressed")
+
+def _set_level(arg):
+    global _level
+    _level = int(arg[1])
+    if _level < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+    if not _level:
+        _level = 3
+
+def _set_min_size(arg):
+    global _min_size
+    _min_size = int(arg[1])
+    if _min_size < 0:
+        raise conf.UserError("Option {0} can not be less than 0" . format(arg[0]))
+
+conf.simple_conf_handler("MsgCompression", _set_method, default = "none")
+conf.simple_conf_handler("MsgCompressionLevel", _set_level, default = "0")
+conf.simple_conf_handler("MsgCompressionMinSize", _set_min_size, default = "128")